@@ -2,107 +2,1139 @@
 #define SIMPLEFS_BITMAP_H
 
 #include <linux/bitmap.h>
+#include <linux/blkdev.h>
+#include <linux/buffer_head.h>
+#include <linux/fs.h>
+#include <linux/mm.h>
+#include <linux/percpu_counter.h>
+#include <linux/slab.h>
+#include <linux/smp.h>
+#include <linux/spinlock.h>
 
 #include "simplefs.h"
 
-/* Returns the first bit found and clears the following 'len' consecutive
- * free bits (sets them to 1) in a given in-memory bitmap spanning multiple
- * blocks. Returns 0 if an adequate number of free bits were not found.
+/* Claim the 'len' bits from 'bit' (relative to group 'g') and return the
+ * first one. The next search without a goal resumes right after them.
+ */
+static inline uint32_t claim_bits(struct simplefs_group *g,
+                                  unsigned long bit,
+                                  uint32_t len)
+{
+    bitmap_clear(g->map, bit, len);
+    g->nr_free -= len;
+    g->dirty = true;
+    g->rotor = (bit + len < g->nr_bits) ? bit + len : 0;
+    return g->start + bit;
+}
+
+/* Search group 'g' for 'len' consecutive free bits, clear them (set them to
+ * 0) and return the first one. Return 0 if the group has no such run.
+ *
+ * The search starts at bit 'goal' (relative to the group) and goes on to the
+ * end of the group, then wraps around from the first_free hint up to the
+ * goal, so a goal that cannot be satisfied does not restart from the first
+ * bit. Free runs are walked with find_next_bit()/find_next_zero_bit(), which
+ * skip a whole word of used or free bits at a time. A failed search records
+ * the longest run it has seen in max_run, so later requests that cannot fit
+ * are rejected without a scan.
  * Assumes the first bit is never free (reserved for the superblock and the
  * root inode), allowing the use of 0 as an error value.
+ * The caller must hold the group lock, with the bitmap slice loaded.
  */
-static inline uint32_t get_first_free_bits(unsigned long *freemap,
-                                           unsigned long size,
+static inline uint32_t get_first_free_bits(struct simplefs_group *g,
+                                           uint32_t goal,
                                            uint32_t len)
 {
-    uint32_t bit, prev = 0, count = 0;
-    for_each_set_bit (bit, freemap, size) {
-        if (prev != bit - 1)
-            count = 0;
-        prev = bit;
-        if (++count == len) {
-            bitmap_clear(freemap, bit - len + 1, len);
-            return bit - len + 1;
+    unsigned long bit, next, first;
+    uint32_t longest = 0;
+
+    if (len > g->max_run)
+        return 0;
+
+    /* There is no free bit below first_free */
+    if (goal < g->first_free || goal >= g->nr_bits)
+        goal = g->first_free;
+
+    first = bit = find_next_bit(g->map, g->nr_bits, goal);
+    while (bit < g->nr_bits) {
+        next = find_next_zero_bit(g->map, g->nr_bits, bit);
+        if (next - bit >= len) {
+            if (goal == g->first_free && bit == first)
+                g->first_free = bit + len;
+            return claim_bits(g, bit, len);
+        }
+        longest = max_t(uint32_t, longest, next - bit);
+        bit = find_next_bit(g->map, g->nr_bits, next);
+    }
+
+    /* Wrap around, runs starting before the goal may extend past it */
+    first = bit = find_next_bit(g->map, goal, g->first_free);
+    while (bit < goal) {
+        next = find_next_zero_bit(g->map, g->nr_bits, bit);
+        if (next - bit >= len) {
+            g->first_free = (bit == first) ? bit + len : first;
+            return claim_bits(g, bit, len);
         }
+        longest = max_t(uint32_t, longest, next - bit);
+        bit = find_next_bit(g->map, goal, next);
     }
+
+    g->first_free = first;
+    g->max_run = longest;
     return 0;
 }
 
-/* Return an unused inode number and mark it used.
- * Return 0 if no free inode was found.
+/* Return the length of the free run of group 'g' that contains the 'len'
+ * bits starting at 'bit' (relative to the group). Whole free words are
+ * skipped when walking backward.
  */
-static inline uint32_t get_free_inode(struct simplefs_sb_info *sbi)
+static inline uint32_t get_free_run(struct simplefs_group *g,
+                                    uint32_t bit,
+                                    uint32_t len)
 {
-    uint32_t ret = get_first_free_bits(sbi->ifree_bitmap, sbi->nr_inodes, 1);
-    if (ret)
-        sbi->nr_free_inodes--;
-    return ret;
+    unsigned long end = find_next_zero_bit(g->map, g->nr_bits, bit + len);
+    unsigned long begin = bit;
+
+    while (begin > 0 && test_bit(begin - 1, g->map)) {
+        if (!(begin % BITS_PER_LONG) &&
+            g->map[begin / BITS_PER_LONG - 1] == ~0UL)
+            begin -= BITS_PER_LONG;
+        else
+            begin--;
+    }
+    return end - begin;
 }
 
-/* Return 'len' unused block(s) number and mark it used.
- * Clean the block content.
- * Return 0 if no enough free block(s) were found.
+/* Mark the 'len' bits from 'bit' (relative to group 'g') as free.
+ * The caller must hold the group lock, with the bitmap slice loaded.
  */
-static inline uint32_t get_free_blocks(struct super_block *sb, uint32_t len)
+static inline void set_free_bits(struct simplefs_group *g,
+                                 uint32_t bit,
+                                 uint32_t len)
+{
+    bitmap_set(g->map, bit, len);
+    g->nr_free += len;
+    g->dirty = true;
+    g->first_free = min(g->first_free, bit);
+    g->max_run = max(g->max_run, get_free_run(g, bit, len));
+}
+
+/* Initialize the locks of the groups of a bitmap whose first on-disk block is
+ * 'first_block'. 'size' is the number of valid bits in the bitmap, the last
+ * group may be partial. Nothing is read: the free counters are upper bounds
+ * until the bitmap slice of the group is loaded.
+ */
+static inline void init_groups(struct simplefs_group *groups,
+                               uint32_t nr_groups,
+                               uint32_t first_block,
+                               uint32_t size)
 {
-    struct simplefs_sb_info *sbi = SIMPLEFS_SB(sb);
-    uint32_t ret = get_first_free_bits(sbi->bfree_bitmap, sbi->nr_blocks, len);
     uint32_t i;
-    if (!ret) /* No enough free blocks */
-        return 0;
 
-    sbi->nr_free_blocks -= len;
+    for (i = 0; i < nr_groups; i++) {
+        struct simplefs_group *g = &groups[i];
+
+        spin_lock_init(&g->lock);
+        g->map = NULL;
+        g->block = first_block + i;
+        g->start = i * SIMPLEFS_BITS_PER_GROUP;
+        g->nr_bits = min_t(uint32_t, SIMPLEFS_BITS_PER_GROUP, size - g->start);
+        g->nr_free = g->nr_bits;
+        g->first_free = 0;
+        g->max_run = g->nr_bits;
+        g->rotor = 0;
+        g->dirty = false;
+    }
+}
+
+/* Mark the windows held in block group 'group' as used in 'map', a copy of
+ * the on-disk bitmap block of this group, on which they are free. A window
+ * never spans two groups.
+ */
+static inline void get_prealloc_bits(struct simplefs_sb_info *sbi,
+                                     unsigned long *map,
+                                     uint32_t group)
+{
+    struct simplefs_inode_info *ci;
+
+    spin_lock(&sbi->pa_lock);
+    list_for_each_entry(ci, &sbi->pa_inodes, pa_list) {
+        if (ci->pa_start / SIMPLEFS_BITS_PER_GROUP == group)
+            bitmap_clear(map, ci->pa_start % SIMPLEFS_BITS_PER_GROUP,
+                         ci->pa_len);
+    }
+    spin_unlock(&sbi->pa_lock);
+}
+
+/* Mark the windows held in block group 'group' as free in 'map', a copy of
+ * the bitmap slice of this group about to be written to disk.
+ */
+static inline void put_prealloc_bits(struct simplefs_sb_info *sbi,
+                                     unsigned long *map,
+                                     uint32_t group)
+{
+    struct simplefs_inode_info *ci;
+
+    spin_lock(&sbi->pa_lock);
+    list_for_each_entry(ci, &sbi->pa_inodes, pa_list) {
+        if (ci->pa_start / SIMPLEFS_BITS_PER_GROUP == group)
+            bitmap_set(map, ci->pa_start % SIMPLEFS_BITS_PER_GROUP,
+                       ci->pa_len);
+    }
+    spin_unlock(&sbi->pa_lock);
+}
+
+/* Mark the run being discarded by FITRIM, if it lies in block group 'group',
+ * as used in 'map', a copy of the on-disk bitmap block of this group, on
+ * which it is free
+ */
+static inline void get_trim_bits(struct simplefs_sb_info *sbi,
+                                 unsigned long *map,
+                                 uint32_t group)
+{
+    spin_lock(&sbi->discard_lock);
+    if (sbi->trim_len && sbi->trim_start / SIMPLEFS_BITS_PER_GROUP == group)
+        bitmap_clear(map, sbi->trim_start % SIMPLEFS_BITS_PER_GROUP,
+                     sbi->trim_len);
+    spin_unlock(&sbi->discard_lock);
+}
+
+/* Mark the run being discarded by FITRIM, if it lies in block group 'group',
+ * as free in 'map', a copy of the bitmap slice about to be written to disk
+ */
+static inline void put_trim_bits(struct simplefs_sb_info *sbi,
+                                 unsigned long *map,
+                                 uint32_t group)
+{
+    spin_lock(&sbi->discard_lock);
+    if (sbi->trim_len && sbi->trim_start / SIMPLEFS_BITS_PER_GROUP == group)
+        bitmap_set(map, sbi->trim_start % SIMPLEFS_BITS_PER_GROUP,
+                   sbi->trim_len);
+    spin_unlock(&sbi->discard_lock);
+}
+
+/* Mark the inodes reserved by the per-CPU batches in inode group 'group' as
+ * used in 'map', a copy of the on-disk bitmap block of this group.
+ */
+static inline void get_batch_bits(struct simplefs_sb_info *sbi,
+                                  unsigned long *map,
+                                  uint32_t group)
+{
+    struct simplefs_ino_batch *b;
+    int cpu;
+
+    for_each_possible_cpu(cpu) {
+        b = per_cpu_ptr(sbi->ino_batch, cpu);
+        spin_lock(&b->lock);
+        if (b->nr && b->next / SIMPLEFS_BITS_PER_GROUP == group)
+            bitmap_clear(map, b->next % SIMPLEFS_BITS_PER_GROUP, b->nr);
+        spin_unlock(&b->lock);
+    }
+}
+
+/* Mark the inodes reserved by the per-CPU batches in inode group 'group' as
+ * free in 'map', a copy of the bitmap slice about to be written to disk.
+ */
+static inline void put_batch_bits(struct simplefs_sb_info *sbi,
+                                  unsigned long *map,
+                                  uint32_t group)
+{
+    struct simplefs_ino_batch *b;
+    int cpu;
+
+    for_each_possible_cpu(cpu) {
+        b = per_cpu_ptr(sbi->ino_batch, cpu);
+        spin_lock(&b->lock);
+        if (b->nr && b->next / SIMPLEFS_BITS_PER_GROUP == group)
+            bitmap_set(map, b->next % SIMPLEFS_BITS_PER_GROUP, b->nr);
+        spin_unlock(&b->lock);
+    }
+}
+
+/* Return true if one of the per-CPU batches holds inodes of inode group
+ * 'group'. Taking an inode from a batch marks the group dirty under the lock
+ * of the batch only, so the group must not be found clean and dropped while
+ * a batch still hands out its inodes.
+ */
+static inline bool group_has_batch(struct simplefs_sb_info *sbi,
+                                   uint32_t group)
+{
+    struct simplefs_ino_batch *b;
+    bool ret = false;
+    int cpu;
+
+    for_each_possible_cpu(cpu) {
+        b = per_cpu_ptr(sbi->ino_batch, cpu);
+        spin_lock(&b->lock);
+        if (b->nr && b->next / SIMPLEFS_BITS_PER_GROUP == group)
+            ret = true;
+        spin_unlock(&b->lock);
+        if (ret)
+            break;
+    }
+    return ret;
+}
+
+/* Load the bitmap slice of group 'i' from its on-disk block. The following
+ * bitmap blocks are read ahead, since searches move on to the next groups.
+ * Return 0 on success, -ENOMEM or -EIO on failure.
+ */
+static inline int load_group(struct simplefs_sb_info *sbi,
+                             struct simplefs_group *groups,
+                             uint32_t nr_groups,
+                             uint32_t i)
+{
+    struct simplefs_group *g = &groups[i];
     struct buffer_head *bh;
-    for (i = 0; i < len; i++) {
-        bh = sb_bread(sb, ret + i);
-        if (!bh) {
-            pr_err("get_free_blocks: sb_bread failed for block %d\n", ret + i);
-            /* Restore all len blocks - bitmap was cleared atomically */
-            bitmap_set(sbi->bfree_bitmap, ret, len);
-            sbi->nr_free_blocks += len;
-            return 0; /* Return 0 to indicate failure (0 is reserved) */
+    unsigned long *map;
+    uint32_t j;
+
+    map = kmalloc(SIMPLEFS_BLOCK_SIZE, GFP_NOFS);
+    if (!map)
+        return -ENOMEM;
+
+    for (j = i + 1; j < nr_groups && j <= i + SIMPLEFS_BITMAP_READAHEAD; j++) {
+        if (!READ_ONCE(groups[j].map))
+            sb_breadahead(sbi->sb, groups[j].block);
+    }
+
+    bh = sb_bread(sbi->sb, g->block);
+    if (!bh) {
+        kfree(map);
+        return -EIO;
+    }
+    memcpy(map, bh->b_data, SIMPLEFS_BLOCK_SIZE);
+    brelse(bh);
+
+    spin_lock(&g->lock);
+    if (g->map) {
+        /* Loaded concurrently */
+        spin_unlock(&g->lock);
+        kfree(map);
+        return 0;
+    }
+    if (groups == sbi->bgroups) {
+        get_prealloc_bits(sbi, map, i);
+        get_trim_bits(sbi, map, i);
+    } else {
+        get_batch_bits(sbi, map, i);
+    }
+    g->map = map;
+    g->nr_free = bitmap_weight(map, g->nr_bits);
+    g->max_run = min(g->max_run, g->nr_free);
+    spin_unlock(&g->lock);
+
+    atomic_inc(&sbi->nr_maps);
+    return 0;
+}
+
+/* Lock group 'i', loading its bitmap slice first if needed.
+ * Return 0 with the group lock held, or an error.
+ */
+static inline int lock_group(struct simplefs_sb_info *sbi,
+                             struct simplefs_group *groups,
+                             uint32_t nr_groups,
+                             uint32_t i)
+{
+    struct simplefs_group *g = &groups[i];
+    int ret;
+
+    spin_lock(&g->lock);
+    while (!g->map) {
+        spin_unlock(&g->lock);
+        ret = load_group(sbi, groups, nr_groups, i);
+        if (ret)
+            return ret;
+        spin_lock(&g->lock);
+    }
+    return 0;
+}
+
+/* Free the bitmap slices of up to 'max' clean groups. They are loaded again
+ * on their next use. Inode groups backing a batch are kept: the batch lock is
+ * taken after the group lock, so an inode taken from the batch before the
+ * check has marked the group dirty, and none can be taken after it.
+ * Return the number of slices freed.
+ */
+static inline unsigned long drop_clean_groups(struct simplefs_sb_info *sbi,
+                                              struct simplefs_group *groups,
+                                              uint32_t nr_groups,
+                                              unsigned long max)
+{
+    unsigned long freed = 0;
+    unsigned long *map;
+    uint32_t i;
+
+    for (i = 0; i < nr_groups && freed < max; i++) {
+        struct simplefs_group *g = &groups[i];
+
+        if (!READ_ONCE(g->map) || READ_ONCE(g->dirty))
+            continue;
+
+        map = NULL;
+        spin_lock(&g->lock);
+        if (g->map &&
+            !(groups == sbi->igroups && group_has_batch(sbi, i)) &&
+            !g->dirty) {
+            map = g->map;
+            g->map = NULL;
+        }
+        spin_unlock(&g->lock);
+
+        if (map) {
+            kfree(map);
+            atomic_dec(&sbi->nr_maps);
+            freed++;
         }
-        memset(bh->b_data, 0, SIMPLEFS_BLOCK_SIZE);
-        mark_buffer_dirty(bh);
-        sync_dirty_buffer(bh); /* write the buffer to disk */
-        brelse(bh);
     }
-    return ret;
+    return freed;
 }
 
-/* Mark the 'len' bit(s) from i-th bit in freemap as free (i.e. 1) */
-static inline int put_free_bits(unsigned long *freemap,
-                                unsigned long size,
-                                uint32_t i,
-                                uint32_t len)
+/* Free the bitmap slices of all groups, clean or not, and the groups */
+static inline void destroy_groups(struct simplefs_group *groups,
+                               uint32_t nr_groups)
 {
+    uint32_t i;
+
+    for (i = 0; groups && i < nr_groups; i++)
+        kfree(groups[i].map);
+    kvfree(groups);
+}
+
+/* Allocate 'len' consecutive bits from the groups, starting with group
+ * 'first' and moving on to the next ones. The search starts at bit 'goal' in
+ * the group of 'goal' if it is not 0, and at the rotor of the group, where the
+ * previous allocation ended, otherwise. Groups without enough free bits, or
+ * whose longest free run is too short, are skipped without taking their lock
+ * or loading their bitmap slice.
+ * Return 0 if no group could satisfy the request.
+ */
+static inline uint32_t get_group_bits(struct simplefs_sb_info *sbi,
+                                      struct simplefs_group *groups,
+                                      uint32_t nr_groups,
+                                      uint32_t first,
+                                      uint32_t goal,
+                                      uint32_t len)
+{
+    uint32_t i, idx, bit, ret;
+
+    if (goal)
+        first = goal / SIMPLEFS_BITS_PER_GROUP;
+
+    for (i = 0; i < nr_groups; i++) {
+        struct simplefs_group *g;
+
+        idx = (first + i) % nr_groups;
+        g = &groups[idx];
+        if (READ_ONCE(g->nr_free) < len || READ_ONCE(g->max_run) < len)
+            continue;
+
+        if (lock_group(sbi, groups, nr_groups, idx))
+            continue;
+        bit = (goal && idx == first) ? goal - g->start : g->rotor;
+        ret = get_first_free_bits(g, bit, len);
+        spin_unlock(&g->lock);
+
+        if (ret)
+            return ret;
+    }
+    return 0;
+}
+
+/* Mark the 'len' bit(s) from i-th bit in the bitmap as free (i.e. 1). The
+ * range may straddle several groups, each one is updated under its own lock.
+ * Return the number of bits freed.
+ */
+static inline uint32_t put_free_bits(struct simplefs_sb_info *sbi,
+                                     struct simplefs_group *groups,
+                                     uint32_t nr_groups,
+                                     unsigned long size,
+                                     uint32_t i,
+                                     uint32_t len)
+{
+    uint32_t freed = 0;
+
     /* i is greater than freemap size */
     if (i + len - 1 > size)
-        return -1;
+        return 0;
 
-    bitmap_set(freemap, i, len);
+    while (len) {
+        uint32_t idx = i / SIMPLEFS_BITS_PER_GROUP;
+        struct simplefs_group *g = &groups[idx];
+        uint32_t n = min(len, g->start + g->nr_bits - i);
 
-    return 0;
+        if (!lock_group(sbi, groups, nr_groups, idx)) {
+            set_free_bits(g, i - g->start, n);
+            spin_unlock(&g->lock);
+            freed += n;
+        } else {
+            pr_err("put_free_bits: lost %u bits from %u\n", n, i);
+        }
+
+        i += n;
+        len -= n;
+    }
+
+    return freed;
 }
 
 /* Mark an inode as unused */
 static inline void put_inode(struct simplefs_sb_info *sbi, uint32_t ino)
 {
-    if (put_free_bits(sbi->ifree_bitmap, sbi->nr_inodes, ino, 1))
-        return;
+    percpu_counter_add(&sbi->free_inodes,
+                       put_free_bits(sbi, sbi->igroups, sbi->nr_igroups,
+                                     sbi->nr_inodes, ino, 1));
+}
 
-    sbi->nr_free_inodes++;
+/* Mark len block(s) as unused right away */
+static inline void put_free_blocks(struct simplefs_sb_info *sbi,
+                                   uint32_t bno,
+                                   uint32_t len)
+{
+    percpu_counter_add(&sbi->free_blocks,
+                       put_free_bits(sbi, sbi->bgroups, sbi->nr_bgroups,
+                                     sbi->nr_blocks, bno, len));
 }
 
-/* Mark len block(s) as unused */
+/* Mark len block(s) as unused. With the discard mount option, the blocks are
+ * queued instead and only become free once discarded, so they cannot be
+ * reused while the discard is in flight.
+ */
 static inline void put_blocks(struct simplefs_sb_info *sbi,
                               uint32_t bno,
                               uint32_t len)
 {
-    if (put_free_bits(sbi->bfree_bitmap, sbi->nr_blocks, bno, len))
+    if (sbi->discard && simplefs_queue_discard(sbi, bno, len))
+        return;
+    put_free_blocks(sbi, bno, len);
+}
+
+/* Preallocation windows: a file appending after its last extent claims more
+ * blocks than it needs and keeps the tail in a per-inode window, so its next
+ * extents are carved from the same region instead of interleaving with the
+ * extents of other files. Window blocks are used in the bitmap but counted in
+ * prealloc_blocks instead of free_blocks: they still count as free space, and
+ * are given back when the file is closed or evicted, or when the filesystem
+ * runs out of space. Windows are recorded as free on disk; they only change
+ * under the lock of their group, so a bitmap slice loaded from disk can mark
+ * them used again.
+ */
+
+/* Return the group of the window of 'ci', or -1 if it has none */
+static inline int prealloc_group(struct simplefs_sb_info *sbi,
+                                 struct simplefs_inode_info *ci)
+{
+    int group = -1;
+
+    spin_lock(&sbi->pa_lock);
+    if (ci->pa_len)
+        group = ci->pa_start / SIMPLEFS_BITS_PER_GROUP;
+    spin_unlock(&sbi->pa_lock);
+    return group;
+}
+
+/* Take up to 'len' blocks from the window of 'ci'. If '*bno' is not 0, the
+ * blocks must start there. Return the number of blocks taken, the first one
+ * is stored in '*bno'.
+ */
+static inline uint32_t get_prealloc(struct simplefs_sb_info *sbi,
+                                    struct simplefs_inode_info *ci,
+                                    uint32_t *bno,
+                                    uint32_t len)
+{
+    struct simplefs_group *g;
+    uint32_t n = 0;
+    int group;
+
+    if (!READ_ONCE(ci->pa_len))
+        return 0;
+
+    group = prealloc_group(sbi, ci);
+    if (group < 0 || lock_group(sbi, sbi->bgroups, sbi->nr_bgroups, group))
+        return 0;
+    g = &sbi->bgroups[group];
+
+    spin_lock(&sbi->pa_lock);
+    if (ci->pa_len && ci->pa_start / SIMPLEFS_BITS_PER_GROUP == group &&
+        (!*bno || *bno == ci->pa_start)) {
+        n = min(len, ci->pa_len);
+        *bno = ci->pa_start;
+        ci->pa_start += n;
+        ci->pa_len -= n;
+        if (!ci->pa_len)
+            list_del_init(&ci->pa_list);
+        /* The blocks were written as free on disk while in the window */
+        g->dirty = true;
+    }
+    spin_unlock(&sbi->pa_lock);
+    spin_unlock(&g->lock);
+
+    if (n)
+        percpu_counter_sub(&sbi->prealloc_blocks, n);
+    return n;
+}
+
+/* Turn the 'len' blocks from 'bno', just claimed from the bitmap, into the
+ * window of 'ci', which must be empty.
+ */
+static inline void set_prealloc(struct simplefs_sb_info *sbi,
+                                struct simplefs_inode_info *ci,
+                                uint32_t bno,
+                                uint32_t len)
+{
+    uint32_t group = bno / SIMPLEFS_BITS_PER_GROUP;
+
+    if (lock_group(sbi, sbi->bgroups, sbi->nr_bgroups, group)) {
+        put_blocks(sbi, bno, len);
+        return;
+    }
+    percpu_counter_add(&sbi->prealloc_blocks, len);
+
+    spin_lock(&sbi->pa_lock);
+    ci->pa_start = bno;
+    ci->pa_len = len;
+    list_add_tail(&ci->pa_list, &sbi->pa_inodes);
+    spin_unlock(&sbi->pa_lock);
+    spin_unlock(&sbi->bgroups[group].lock);
+}
+
+/* Give the window of 'ci' back to the free blocks.
+ * Return the number of blocks released.
+ */
+static inline uint32_t put_prealloc(struct simplefs_sb_info *sbi,
+                                    struct simplefs_inode_info *ci)
+{
+    struct simplefs_group *g;
+    uint32_t bno, len = 0;
+    int group;
+
+    if (!READ_ONCE(ci->pa_len))
+        return 0;
+
+    group = prealloc_group(sbi, ci);
+    if (group < 0 || lock_group(sbi, sbi->bgroups, sbi->nr_bgroups, group))
+        return 0;
+    g = &sbi->bgroups[group];
+
+    spin_lock(&sbi->pa_lock);
+    if (ci->pa_len && ci->pa_start / SIMPLEFS_BITS_PER_GROUP == group) {
+        bno = ci->pa_start;
+        len = ci->pa_len;
+        ci->pa_len = 0;
+        list_del_init(&ci->pa_list);
+    }
+    spin_unlock(&sbi->pa_lock);
+    if (len)
+        set_free_bits(g, bno - g->start, len);
+    spin_unlock(&g->lock);
+
+    if (len) {
+        percpu_counter_sub(&sbi->prealloc_blocks, len);
+        percpu_counter_add(&sbi->free_blocks, len);
+    }
+    return len;
+}
+
+/* Give every window back to the free blocks.
+ * Return the number of blocks released.
+ */
+static inline uint32_t put_all_prealloc(struct simplefs_sb_info *sbi)
+{
+    struct simplefs_inode_info *ci;
+    uint32_t len, total = 0;
+
+    for (;;) {
+        spin_lock(&sbi->pa_lock);
+        if (list_empty(&sbi->pa_inodes)) {
+            spin_unlock(&sbi->pa_lock);
+            break;
+        }
+        ci = list_first_entry(&sbi->pa_inodes, struct simplefs_inode_info,
+                              pa_list);
+        spin_unlock(&sbi->pa_lock);
+
+        len = put_prealloc(sbi, ci);
+        if (!len)
+            break;
+        total += len;
+    }
+
+    return total;
+}
+
+/* Data written with a lifetime hint (F_SET_RW_HINT) is kept away from data of
+ * other lifetimes: each lifetime gets its own region of the device, from the
+ * short-lived data at the start to the long-lived data at the end. Files of
+ * the same lifetime are filled one after the other from a cursor, so that
+ * their blocks are also erased together. Files without hint are unaffected.
+ */
+static inline uint32_t hint_region_start(struct simplefs_sb_info *sbi,
+                                         uint32_t h)
+{
+    /* Block 0 would mean "no goal", the superblock is never free anyway */
+    return max_t(uint64_t, 1,
+                 (uint64_t) sbi->nr_blocks * h / SIMPLEFS_NR_HINTS);
+}
+
+static inline void init_hint_goals(struct simplefs_sb_info *sbi)
+{
+    uint32_t h;
+
+    for (h = 0; h < SIMPLEFS_NR_HINTS; h++)
+        sbi->hint_goal[h] = hint_region_start(sbi, h);
+}
+
+/* Return the allocation goal of a file with write lifetime 'hint', or 0 if
+ * the hint does not ask for a region.
+ */
+static inline uint32_t get_hint_goal(struct simplefs_sb_info *sbi,
+                                     unsigned int hint)
+{
+    if (hint < WRITE_LIFE_SHORT || hint > WRITE_LIFE_EXTREME)
+        return 0;
+    return READ_ONCE(sbi->hint_goal[hint - WRITE_LIFE_SHORT]);
+}
+
+/* Move the cursor of lifetime 'hint' past the 'len' blocks allocated from
+ * 'bno', back to the start of its region once the allocation left it.
+ */
+static inline void set_hint_goal(struct simplefs_sb_info *sbi,
+                                 unsigned int hint,
+                                 uint32_t bno,
+                                 uint32_t len)
+{
+    uint32_t h = hint - WRITE_LIFE_SHORT;
+    uint32_t start, next = bno + len;
+
+    if (hint < WRITE_LIFE_SHORT || hint > WRITE_LIFE_EXTREME)
+        return;
+
+    start = hint_region_start(sbi, h);
+    if (next < start || next >= hint_region_start(sbi, h + 1))
+        next = start;
+    WRITE_ONCE(sbi->hint_goal[h], next);
+}
+
+/* The free space counters are per-CPU: updates stay on the local CPU and
+ * reads are lock-free, at the cost of an error of up to one batch per CPU
+ * per counter. Below this margin, decisions use the exact sums.
+ */
+static inline s64 counter_slack(void)
+{
+    return 4 * (s64) percpu_counter_batch * num_online_cpus();
+}
+
+/* Return true if 'fbc' is above 0, reading the exact sum only near 0 */
+static inline bool counter_positive(struct percpu_counter *fbc)
+{
+    return percpu_counter_read(fbc) > counter_slack() ||
+           percpu_counter_sum(fbc) > 0;
+}
+
+/* Approximate number of blocks that can still be allocated, windows and
+ * blocks waiting to be discarded included
+ */
+static inline s64 avail_blocks(struct simplefs_sb_info *sbi)
+{
+    return percpu_counter_read_positive(&sbi->free_blocks) +
+           percpu_counter_read_positive(&sbi->prealloc_blocks) +
+           atomic_read(&sbi->discard_blocks);
+}
+
+/* Exact number of blocks that can still be allocated, as avail_blocks() */
+static inline s64 avail_blocks_sum(struct simplefs_sb_info *sbi)
+{
+    return percpu_counter_sum_positive(&sbi->free_blocks) +
+           percpu_counter_sum_positive(&sbi->prealloc_blocks) +
+           atomic_read(&sbi->discard_blocks);
+}
+
+/* Number of blocks only metadata reservations may take, a small share of
+ * the disk
+ */
+static inline s64 meta_reserve(struct simplefs_sb_info *sbi)
+{
+    return min_t(s64, sbi->nr_blocks / 64, SIMPLEFS_META_RESERVE_BLOCKS);
+}
+
+/* Reserve 'len' blocks, leaving 'keep' blocks free. Far from ENOSPC, the
+ * approximate counters are enough and no lock is taken. Near it,
+ * reservations are serialized and checked against the exact sums.
+ * Return -ENOSPC if not enough free blocks are left.
+ */
+static inline int reserve_blocks_keep(struct simplefs_sb_info *sbi,
+                                      uint32_t len,
+                                      s64 keep)
+{
+    s64 left = avail_blocks(sbi) -
+               percpu_counter_read_positive(&sbi->dirty_blocks) - len - keep;
+
+    if (left > counter_slack()) {
+        percpu_counter_add(&sbi->dirty_blocks, len);
+        return 0;
+    }
+
+    spin_lock(&sbi->reserve_lock);
+    left = avail_blocks_sum(sbi) -
+           percpu_counter_sum_positive(&sbi->dirty_blocks) - len - keep;
+    if (left < 0) {
+        spin_unlock(&sbi->reserve_lock);
+        return -ENOSPC;
+    }
+    percpu_counter_add(&sbi->dirty_blocks, len);
+    spin_unlock(&sbi->reserve_lock);
+    return 0;
+}
+
+/* Reserve 'len' blocks for data, delayed allocation included. The blocks
+ * stay free in the bitmap until they are allocated, but other writers cannot
+ * reserve them anymore. The metadata reserve is left alone.
+ * Return -ENOSPC if not enough free blocks are left.
+ */
+static inline int reserve_blocks(struct simplefs_sb_info *sbi, uint32_t len)
+{
+    return reserve_blocks_keep(sbi, len, meta_reserve(sbi));
+}
+
+/* Reserve 'len' blocks for metadata, which may dip into the metadata
+ * reserve but not into the blocks promised to delayed allocation
+ */
+static inline int reserve_meta_blocks(struct simplefs_sb_info *sbi,
+                                      uint32_t len)
+{
+    return reserve_blocks_keep(sbi, len, 0);
+}
+
+/* Drop a reservation taken by reserve_blocks() */
+static inline void unreserve_blocks(struct simplefs_sb_info *sbi, uint32_t len)
+{
+    percpu_counter_sub(&sbi->dirty_blocks, len);
+}
+
+/* Return an unused inode number and mark it used. The search starts at
+ * inode 'goal', or in the group of the current CPU if 'goal' is 0.
+ * Return 0 if no free inode was found.
+ */
+static inline uint32_t get_free_inode(struct simplefs_sb_info *sbi,
+                                      uint32_t goal)
+{
+    uint32_t ret;
+
+    if (goal >= sbi->nr_inodes)
+        goal = 0;
+    ret = get_group_bits(sbi, sbi->igroups, sbi->nr_igroups,
+                         raw_smp_processor_id() % sbi->nr_igroups, goal, 1);
+    if (ret)
+        percpu_counter_dec(&sbi->free_inodes);
+    return ret;
+}
+
+/* Give the inodes left in batch 'b' back to the bitmap. They were still
+ * counted as free.
+ * Return the number of inodes given back.
+ */
+static inline uint32_t put_ino_batch(struct simplefs_sb_info *sbi,
+                                     struct simplefs_ino_batch *b)
+{
+    struct simplefs_group *g;
+    uint32_t group, ino = 0, nr = 0;
+
+    spin_lock(&b->lock);
+    group = b->next / SIMPLEFS_BITS_PER_GROUP;
+    nr = b->nr;
+    spin_unlock(&b->lock);
+    if (!nr || lock_group(sbi, sbi->igroups, sbi->nr_igroups, group))
+        return 0;
+    g = &sbi->igroups[group];
+
+    nr = 0;
+    spin_lock(&b->lock);
+    if (b->nr && b->next / SIMPLEFS_BITS_PER_GROUP == group) {
+        ino = b->next;
+        nr = b->nr;
+        b->nr = 0;
+    }
+    spin_unlock(&b->lock);
+    if (nr)
+        set_free_bits(g, ino - g->start, nr);
+    spin_unlock(&g->lock);
+
+    return nr;
+}
+
+/* Give the inodes left in all the per-CPU batches back to the bitmap */
+static inline uint32_t put_all_ino_batches(struct simplefs_sb_info *sbi)
+{
+    uint32_t nr = 0;
+    int cpu;
+
+    for_each_possible_cpu(cpu)
+        nr += put_ino_batch(sbi, per_cpu_ptr(sbi->ino_batch, cpu));
+    return nr;
+}
+
+/* Make the 'nr' inodes from 'ino', just claimed from the bitmap for 'goal',
+ * the content of batch 'b'. If another task refilled the batch in the
+ * meantime, they are given back instead.
+ */
+static inline void set_ino_batch(struct simplefs_sb_info *sbi,
+                                 struct simplefs_ino_batch *b,
+                                 uint32_t goal,
+                                 uint32_t ino,
+                                 uint32_t nr)
+{
+    uint32_t group = ino / SIMPLEFS_BITS_PER_GROUP;
+    struct simplefs_group *g = &sbi->igroups[group];
+    bool set = false;
+
+    if (lock_group(sbi, sbi->igroups, sbi->nr_igroups, group))
         return;
 
-    sbi->nr_free_blocks += len;
+    spin_lock(&b->lock);
+    if (!b->nr) {
+        b->goal = goal;
+        b->next = ino;
+        b->nr = nr;
+        set = true;
+    }
+    spin_unlock(&b->lock);
+    if (!set)
+        set_free_bits(g, ino - g->start, nr);
+    spin_unlock(&g->lock);
+}
+
+/* Return true if batch 'b' can serve 'goal': it was taken for this goal, or
+ * its next inode lies within SIMPLEFS_INODE_BATCH_REACH of it. The caller
+ * must hold the batch lock.
+ */
+static inline bool ino_batch_near(struct simplefs_ino_batch *b, uint32_t goal)
+{
+    uint32_t dist = b->next > goal ? b->next - goal : goal - b->next;
+
+    return b->nr && (b->goal == goal || dist < SIMPLEFS_INODE_BATCH_REACH);
+}
+
+/* Return an unused inode number for a new file, taken from the batch of the
+ * current CPU when it can serve 'goal'. No shared state is touched then.
+ * Otherwise, the batch is refilled with a run of free inodes starting near
+ * 'goal', so that the files of a directory do not land wherever the batch
+ * was last filled. If there is no such run, a single inode is taken with
+ * get_free_inode().
+ * Return 0 if no free inode was found.
+ */
+static inline uint32_t get_batched_inode(struct simplefs_sb_info *sbi,
+                                         uint32_t goal)
+{
+    struct simplefs_ino_batch *b = raw_cpu_ptr(sbi->ino_batch);
+    uint32_t group, ino = 0;
+
+    if (!goal || goal >= sbi->nr_inodes)
+        return get_free_inode(sbi, goal);
+    group = goal / SIMPLEFS_BITS_PER_GROUP;
+
+    spin_lock(&b->lock);
+    if (ino_batch_near(b, goal)) {
+        ino = b->next++;
+        b->nr--;
+        /* Recorded as free on disk while in the batch */
+        WRITE_ONCE(sbi->igroups[ino / SIMPLEFS_BITS_PER_GROUP].dirty, true);
+    }
+    spin_unlock(&b->lock);
+    if (ino) {
+        percpu_counter_dec(&sbi->free_inodes);
+        return ino;
+    }
+
+    put_ino_batch(sbi, b);
+    ino = get_group_bits(sbi, sbi->igroups, sbi->nr_igroups, group, goal,
+                         SIMPLEFS_INODE_BATCH);
+    if (!ino)
+        return get_free_inode(sbi, goal);
+    set_ino_batch(sbi, b, goal, ino + 1, SIMPLEFS_INODE_BATCH - 1);
+
+    percpu_counter_dec(&sbi->free_inodes);
+    return ino;
+}
+
+/* Return the first inode of the first inode store block of inode group 'i'
+ * whose inodes are all free, or 0 if there is none.
+ */
+static inline uint32_t get_empty_iblock(struct simplefs_sb_info *sbi,
+                                        uint32_t i)
+{
+    struct simplefs_group *g = &sbi->igroups[i];
+    unsigned long bit, next, first;
+    uint32_t ret = 0;
+
+    if (lock_group(sbi, sbi->igroups, sbi->nr_igroups, i))
+        return 0;
+
+    bit = find_next_bit(g->map, g->nr_bits, g->first_free);
+    while (bit < g->nr_bits) {
+        next = find_next_zero_bit(g->map, g->nr_bits, bit);
+        /* First inode of the first inode store block starting in the run */
+        first = roundup(g->start + bit, SIMPLEFS_INODES_PER_BLOCK) - g->start;
+        if (first + SIMPLEFS_INODES_PER_BLOCK <= next) {
+            ret = g->start + first;
+            break;
+        }
+        bit = find_next_bit(g->map, g->nr_bits, next);
+    }
+    spin_unlock(&g->lock);
+
+    return ret;
+}
+
+/* Choose where the inode of a new directory under 'parent' should go, in the
+ * spirit of the Orlov allocator of ext2/3/4. Top-level directories are spread
+ * over the inode group with the most free inodes. Other directories stay in
+ * the group of their parent while it has at least the average number of free
+ * inodes. Within the chosen group, the directory starts an inode store block
+ * that is still empty, so that the files created in it, which are placed
+ * after it, share its inode store blocks.
+ * Return the inode to start the search from, or 0 for no preference.
+ */
+static inline uint32_t get_dir_inode_goal(struct simplefs_sb_info *sbi,
+                                          uint32_t parent)
+{
+    uint32_t avg =
+        percpu_counter_read_positive(&sbi->free_inodes) / sbi->nr_igroups;
+    uint32_t group = parent / SIMPLEFS_BITS_PER_GROUP;
+    uint32_t i, idx, nr_free, best = 0;
+    uint32_t first = raw_smp_processor_id() % sbi->nr_igroups;
+
+    if (parent == 1 || READ_ONCE(sbi->igroups[group].nr_free) < avg) {
+        for (i = 0; i < sbi->nr_igroups; i++) {
+            idx = (first + i) % sbi->nr_igroups;
+            nr_free = READ_ONCE(sbi->igroups[idx].nr_free);
+            if (nr_free > best) {
+                best = nr_free;
+                group = idx;
+            }
+        }
+    }
+
+    return get_empty_iblock(sbi, group);
+}
+
+/* Write zeroes over the 'len' blocks starting at 'bno' with a single
+ * zero-out request, which the device may serve without transferring data.
+ * Buffers still cached for these blocks from a previous use are dropped, so
+ * they cannot be written back over the new content.
+ */
+static inline int zero_blocks(struct super_block *sb,
+                              uint32_t bno,
+                              uint32_t len)
+{
+    clean_bdev_aliases(sb->s_bdev, bno, len);
+    return sb_issue_zeroout(sb, bno, len, GFP_NOFS);
+}
+
+/* Return the buffer of the newly allocated metadata block 'bno', filled with
+ * zeroes. The stale content is not read from disk, the buffer is marked
+ * uptodate and dirty and reaches the disk with the next writeback.
+ * Return NULL on failure.
+ */
+static inline struct buffer_head *get_zeroed_block(struct super_block *sb,
+                                                   uint32_t bno)
+{
+    struct buffer_head *bh = sb_getblk(sb, bno);
+    if (!bh)
+        return NULL;
+
+    lock_buffer(bh);
+    memset(bh->b_data, 0, SIMPLEFS_BLOCK_SIZE);
+    set_buffer_uptodate(bh);
+    unlock_buffer(bh);
+    mark_buffer_dirty(bh);
+    return bh;
+}
+
+/* Return 'len' unused block(s) number and mark it used. The search starts
+ * at block 'goal', so that related blocks end up close to each other on disk,
+ * or in the group of the current CPU if 'goal' is 0.
+ * The block content is not cleaned: metadata blocks are built with
+ * get_zeroed_block() and data blocks are either fully written by the caller
+ * or cleaned with zero_blocks().
+ * Return 0 if no enough free block(s) were found.
+ */
+static inline uint32_t get_free_blocks(struct super_block *sb,
+                                       uint32_t goal,
+                                       uint32_t len)
+{
+    struct simplefs_sb_info *sbi = SIMPLEFS_SB(sb);
+    uint32_t first = raw_smp_processor_id() % sbi->nr_bgroups;
+    uint32_t ret;
+
+    if (goal >= sbi->nr_blocks)
+        goal = 0;
+    ret = get_group_bits(sbi, sbi->bgroups, sbi->nr_bgroups, first, goal, len);
+
+    /* Blocks waiting to be discarded are released before giving up */
+    if (!ret && simplefs_flush_discard(sbi))
+        ret = get_group_bits(sbi, sbi->bgroups, sbi->nr_bgroups, first, goal,
+                             len);
+    if (!ret) /* No enough free blocks */
+        return 0;
+
+    percpu_counter_sub(&sbi->free_blocks, len);
+    return ret;
+}
+
+/* Allocate 'len' metadata blocks as get_free_blocks() does, without taking
+ * the blocks reserved by delayed allocation.
+ * Return 0 if no enough free block(s) were found.
+ */
+static inline uint32_t get_meta_blocks(struct super_block *sb,
+                                       uint32_t goal,
+                                       uint32_t len)
+{
+    struct simplefs_sb_info *sbi = SIMPLEFS_SB(sb);
+    uint32_t ret;
+
+    if (reserve_meta_blocks(sbi, len))
+        return 0;
+    ret = get_free_blocks(sb, goal, len);
+    unreserve_blocks(sbi, len);
+    return ret;
+}
+
+/* Claim up to 'len' free blocks starting exactly at block 'bno', so that an
+ * extent ending right before 'bno' can grow in place. The run stops at the
+ * first used block or at the end of the group of 'bno'. As with
+ * get_free_blocks(), the block content is not cleaned.
+ * Return the number of blocks claimed, 0 if 'bno' itself is not free.
+ */
+static inline uint32_t get_blocks_at(struct super_block *sb,
+                                     uint32_t bno,
+                                     uint32_t len)
+{
+    struct simplefs_sb_info *sbi = SIMPLEFS_SB(sb);
+    uint32_t group = bno / SIMPLEFS_BITS_PER_GROUP;
+    struct simplefs_group *g = &sbi->bgroups[group];
+    unsigned long bit, end;
+
+    if (bno >= sbi->nr_blocks)
+        return 0;
+    if (lock_group(sbi, sbi->bgroups, sbi->nr_bgroups, group))
+        return 0;
+
+    bit = bno - g->start;
+    end = find_next_zero_bit(g->map, min(g->nr_bits, bit + len), bit);
+    len = end - bit;
+    if (len) {
+        bitmap_clear(g->map, bit, len);
+        g->nr_free -= len;
+        g->dirty = true;
+        /* max_run remains an upper bound, only first_free may move */
+        if (bit == g->first_free)
+            g->first_free = end;
+    }
+    spin_unlock(&g->lock);
+
+    if (len)
+        percpu_counter_sub(&sbi->free_blocks, len);
+    return len;
 }
 
 #endif /* SIMPLEFS_BITMAP_H */
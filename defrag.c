@@ -0,0 +1,101 @@
+#if !defined(__linux__)
+#error "Do not manage to build this file unless your platform is Linux."
+#endif
+
+#define _GNU_SOURCE /* nftw(), O_NOFOLLOW */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "simplefs.h"
+
+/* Totals over the walked tree */
+static uint64_t nr_files, nr_defragged, nr_failed;
+static uint64_t nr_extents_before, nr_extents_after, nr_blocks_moved;
+static int verbose;
+
+/* Defragment one regular file */
+static int defrag_file(const char *path,
+                       const struct stat *st,
+                       int type,
+                       struct FTW *ftw)
+{
+    struct simplefs_defrag_info info;
+    (void) ftw;
+
+    if (type != FTW_F || !S_ISREG(st->st_mode))
+        return 0;
+
+    int fd = open(path, O_RDONLY | O_NOFOLLOW);
+    if (fd == -1) {
+        fprintf(stderr, "%s: %s\n", path, strerror(errno));
+        nr_failed++;
+        return 0;
+    }
+
+    int ret = ioctl(fd, SIMPLEFS_IOC_DEFRAG, &info);
+    close(fd);
+    if (ret) {
+        /* Not on simplefs: stop, the rest of the tree is not either */
+        if (errno == ENOTTY) {
+            fprintf(stderr, "%s: not a simplefs file\n", path);
+            return 1;
+        }
+        fprintf(stderr, "%s: %s\n", path, strerror(errno));
+        nr_failed++;
+        return 0;
+    }
+
+    nr_files++;
+    nr_extents_before += info.nr_extents_before;
+    nr_extents_after += info.nr_extents_after;
+    nr_blocks_moved += info.nr_blocks_moved;
+    if (info.nr_blocks_moved) {
+        nr_defragged++;
+        if (verbose)
+            printf("%s: %u -> %u extents\n", path, info.nr_extents_before,
+                   info.nr_extents_after);
+    }
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    int i = 1;
+
+    if (argc > 1 && !strcmp(argv[1], "-v")) {
+        verbose = 1;
+        i++;
+    }
+    if (i >= argc) {
+        fprintf(stderr, "Usage: %s [-v] path...\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    /* Stay on the filesystem of each path, do not follow symlinks */
+    for (; i < argc; i++) {
+        int ret = nftw(argv[i], defrag_file, 16, FTW_PHYS | FTW_MOUNT);
+        if (ret == -1) {
+            perror(argv[i]);
+            return EXIT_FAILURE;
+        }
+        if (ret)
+            return EXIT_FAILURE;
+    }
+
+    printf("%lu files, %lu defragmented, %lu failed\n",
+           (unsigned long) nr_files, (unsigned long) nr_defragged,
+           (unsigned long) nr_failed);
+    printf("extents: %lu -> %lu, blocks moved: %lu\n",
+           (unsigned long) nr_extents_before, (unsigned long) nr_extents_after,
+           (unsigned long) nr_blocks_moved);
+    return nr_failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -115,4 +115,5 @@ release_bh:
 const struct file_operations simplefs_dir_ops = {
     .owner = THIS_MODULE,
     .iterate_shared = simplefs_iterate,
+    .unlocked_ioctl = simplefs_ioctl,
 };
@@ -0,0 +1,268 @@
+#define pr_fmt(fmt) KBUILD_MODNAME ": " fmt
+
+#include <linux/blkdev.h>
+#include <linux/fs.h>
+#include <linux/kernel.h>
+#include <linux/list_sort.h>
+#include <linux/sched/signal.h>
+#include <linux/slab.h>
+
+#include "bitmap.h"
+#include "simplefs.h"
+
+/* Freed ranges are batched for this long before being discarded, so that the
+ * ranges freed by a large truncate or unlink are merged into few requests.
+ */
+#define SIMPLEFS_DISCARD_DELAY HZ
+
+/* A range of freed blocks waiting for discard */
+struct simplefs_discard {
+    struct list_head list;
+    uint32_t start;
+    uint32_t len;
+};
+
+/* Return true if the device of 'sb' accepts discard requests */
+bool simplefs_can_discard(struct super_block *sb)
+{
+#if SIMPLEFS_AT_LEAST(5, 19, 0)
+    return bdev_max_discard_sectors(sb->s_bdev);
+#else
+    return blk_queue_discard(bdev_get_queue(sb->s_bdev));
+#endif
+}
+
+#if SIMPLEFS_AT_LEAST(5, 13, 0)
+static int simplefs_discard_cmp(void *priv,
+                                const struct list_head *a,
+                                const struct list_head *b)
+#else
+static int simplefs_discard_cmp(void *priv,
+                                struct list_head *a,
+                                struct list_head *b)
+#endif
+{
+    struct simplefs_discard *da = list_entry(a, struct simplefs_discard, list);
+    struct simplefs_discard *db = list_entry(b, struct simplefs_discard, list);
+
+    return da->start < db->start ? -1 : da->start > db->start;
+}
+
+/* Discard the queued ranges, sorted and merged with their neighbours, then
+ * mark their blocks as free.
+ */
+static void simplefs_discard_work(struct work_struct *work)
+{
+    struct simplefs_sb_info *sbi =
+        container_of(to_delayed_work(work), struct simplefs_sb_info,
+                     discard_work);
+    struct simplefs_discard *d, *next;
+    LIST_HEAD(list);
+    int ret;
+
+    spin_lock(&sbi->discard_lock);
+    list_splice_init(&sbi->discard_list, &list);
+    spin_unlock(&sbi->discard_lock);
+
+    list_sort(NULL, &list, simplefs_discard_cmp);
+    list_for_each_entry_safe(d, next, &list, list) {
+        /* Merge the following ranges that touch this one */
+        while (!list_is_last(&d->list, &list) &&
+               next->start == d->start + d->len) {
+            d->len += next->len;
+            list_del(&next->list);
+            kfree(next);
+            next = list_next_entry(d, list);
+        }
+
+        /* The blocks are freed even if the device refuses the discard */
+        ret = sb_issue_discard(sbi->sb, d->start, d->len, GFP_NOFS, 0);
+        if (ret && ret != -EOPNOTSUPP)
+            pr_warn("discard of %u blocks from %u failed: %d\n", d->len,
+                    d->start, ret);
+
+        put_free_blocks(sbi, d->start, d->len);
+        atomic_sub(d->len, &sbi->discard_blocks);
+        list_del(&d->list);
+        kfree(d);
+    }
+}
+
+void simplefs_init_discard(struct simplefs_sb_info *sbi)
+{
+    atomic_set(&sbi->discard_blocks, 0);
+    spin_lock_init(&sbi->discard_lock);
+    INIT_LIST_HEAD(&sbi->discard_list);
+    INIT_DELAYED_WORK(&sbi->discard_work, simplefs_discard_work);
+    mutex_init(&sbi->trim_lock);
+}
+
+/* Queue the 'len' freed blocks from 'bno' for discard. A range following the
+ * last queued one is merged into it.
+ * Return false if the range could not be queued, the caller must then free
+ * the blocks itself.
+ */
+bool simplefs_queue_discard(struct simplefs_sb_info *sbi,
+                            uint32_t bno,
+                            uint32_t len)
+{
+    struct simplefs_discard *d;
+    bool merged = false;
+
+    atomic_add(len, &sbi->discard_blocks);
+
+    spin_lock(&sbi->discard_lock);
+    if (!list_empty(&sbi->discard_list)) {
+        d = list_last_entry(&sbi->discard_list, struct simplefs_discard, list);
+        if (d->start + d->len == bno) {
+            d->len += len;
+            merged = true;
+        }
+    }
+    spin_unlock(&sbi->discard_lock);
+
+    if (!merged) {
+        d = kmalloc(sizeof(*d), GFP_NOFS);
+        if (!d) {
+            atomic_sub(len, &sbi->discard_blocks);
+            return false;
+        }
+        d->start = bno;
+        d->len = len;
+        spin_lock(&sbi->discard_lock);
+        list_add_tail(&d->list, &sbi->discard_list);
+        spin_unlock(&sbi->discard_lock);
+    }
+
+    queue_delayed_work(system_unbound_wq, &sbi->discard_work,
+                       SIMPLEFS_DISCARD_DELAY);
+    return true;
+}
+
+/* Discard the queued ranges now and wait for their blocks to be free.
+ * Return the number of blocks that were waiting.
+ */
+uint32_t simplefs_flush_discard(struct simplefs_sb_info *sbi)
+{
+    uint32_t nr = atomic_read(&sbi->discard_blocks);
+
+    if (!nr)
+        return 0;
+    flush_delayed_work(&sbi->discard_work);
+    return nr;
+}
+
+/* Claim the first free run of at least 'minlen' bits of group 'i' found
+ * between '*bit' and 'end' (relative to the group), so that it is not
+ * allocated while being discarded. The run is only used in memory: it is
+ * recorded as the FITRIM run, which stays free on disk and is claimed again
+ * if the bitmap slice is dropped and reloaded.
+ * Return the length of the run, whose first bit is stored in '*bit', or 0.
+ * The caller must hold the group lock, with the bitmap slice loaded.
+ */
+static uint32_t simplefs_trim_claim(struct simplefs_sb_info *sbi,
+                                    uint32_t i,
+                                    uint32_t *bit,
+                                    uint32_t end,
+                                    uint32_t minlen)
+{
+    struct simplefs_group *g = &sbi->bgroups[i];
+    unsigned long first, next;
+
+    first = find_next_bit(g->map, end, *bit);
+    while (first < end) {
+        next = find_next_zero_bit(g->map, end, first);
+        if (next - first >= minlen) {
+            bitmap_clear(g->map, first, next - first);
+            g->nr_free -= next - first;
+            spin_lock(&sbi->discard_lock);
+            sbi->trim_start = g->start + first;
+            sbi->trim_len = next - first;
+            spin_unlock(&sbi->discard_lock);
+            *bit = first;
+            return next - first;
+        }
+        first = find_next_bit(g->map, end, next);
+    }
+    return 0;
+}
+
+/* Discard the free runs of at least range->minlen bytes within the byte
+ * range given by 'range' (FITRIM). Runs are claimed one at a time, so
+ * allocations may go on in the meantime, and a crash never leaks them.
+ * On return, range->len holds the number of bytes discarded.
+ */
+int simplefs_trim_fs(struct super_block *sb, struct fstrim_range *range)
+{
+    struct simplefs_sb_info *sbi = SIMPLEFS_SB(sb);
+    unsigned int bits = sb->s_blocksize_bits;
+    uint64_t start = range->start >> bits;
+    uint64_t end = min_t(uint64_t, sbi->nr_blocks,
+                         start + (range->len >> bits));
+    uint32_t minlen = max_t(uint64_t, range->minlen >> bits, 1);
+    uint64_t trimmed = 0;
+    uint32_t i, bit, stop, len;
+    bool locked;
+    int ret = 0;
+
+    if (range->len < sb->s_blocksize || start >= sbi->nr_blocks)
+        return -EINVAL;
+    if (minlen > SIMPLEFS_BITS_PER_GROUP)
+        goto out;
+
+    /* Blocks waiting for an online discard are discarded right away */
+    simplefs_flush_discard(sbi);
+
+    mutex_lock(&sbi->trim_lock);
+    for (i = start / SIMPLEFS_BITS_PER_GROUP;
+         i < sbi->nr_bgroups && i * (uint64_t) SIMPLEFS_BITS_PER_GROUP < end;
+         i++) {
+        struct simplefs_group *g = &sbi->bgroups[i];
+
+        if (READ_ONCE(g->nr_free) < minlen)
+            continue;
+
+        bit = start > g->start ? start - g->start : 0;
+        stop = min_t(uint64_t, g->nr_bits, end - g->start);
+        while (bit < stop) {
+            if (fatal_signal_pending(current)) {
+                ret = -ERESTARTSYS;
+                goto unlock;
+            }
+
+            ret = lock_group(sbi, sbi->bgroups, sbi->nr_bgroups, i);
+            if (ret)
+                goto unlock;
+            len = simplefs_trim_claim(sbi, i, &bit, stop, minlen);
+            spin_unlock(&g->lock);
+            if (!len)
+                break;
+
+            ret = sb_issue_discard(sb, g->start + bit, len, GFP_NOFS, 0);
+
+            /* A slice dropped in the meantime has the run claimed again
+             * on reload. If it cannot be loaded, the run is free on disk.
+             */
+            locked = !lock_group(sbi, sbi->bgroups, sbi->nr_bgroups, i);
+            if (locked)
+                set_free_bits(g, bit, len);
+            spin_lock(&sbi->discard_lock);
+            sbi->trim_len = 0;
+            spin_unlock(&sbi->discard_lock);
+            if (locked)
+                spin_unlock(&g->lock);
+            if (ret)
+                goto unlock;
+
+            trimmed += len;
+            bit += len;
+            cond_resched();
+        }
+    }
+
+unlock:
+    mutex_unlock(&sbi->trim_lock);
+out:
+    range->len = trimmed << bits;
+    return ret;
+}
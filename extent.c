@@ -1,73 +1,609 @@
+#include <linux/buffer_head.h>
 #include <linux/fs.h>
 #include <linux/kernel.h>
+#include <linux/rcupdate.h>
+#include <linux/slab.h>
+#include <linux/string.h>
 
+#include "bitmap.h"
 #include "simplefs.h"
 
+/* Return the number of used file indexes. Used extents are packed at the start
+ * of the index, so the first unused one is found with binary search.
+ */
+uint32_t simplefs_ext_count(struct simplefs_file_ei_block *index)
+{
+    uint32_t start = 0;
+    uint32_t end = SIMPLEFS_MAX_EXTENTS;
+
+    while (start < end) {
+        uint32_t mid = start + (end - start) / 2;
+        if (index->extents[mid].ee_start == 0) {
+            end = mid;
+        } else {
+            start = mid + 1;
+        }
+    }
+    return start;
+}
+
 /* Search for the extent containing the target block. Binary search is used
- * for efficiency.
+ * for efficiency. Extents are sorted by logical block and have a variable
+ * length, so holes may lie between them.
  *
- * Returns the first unused file index if not found.
- * Returns -1 if the target block is out of range.
+ * Returns the slot where an extent covering the block must be inserted to keep
+ * the index sorted if not found, which is the slot of the next extent. It is
+ * the first unused file index when the block lies after the last extent.
+ * Returns -1 if the target block lies after the last extent of a full index.
+ * An extent can only be inserted in an index that is not full.
  */
 uint32_t simplefs_ext_search(struct simplefs_file_ei_block *index,
                              uint32_t iblock)
 {
-    /* First, find the first unused file index with binary search.
-     * It will be our right boundary for actual binary search and the return
-     * value when the file index is not found.
-     */
+    uint32_t boundary = simplefs_ext_count(index);
     uint32_t start = 0;
-    uint32_t end = SIMPLEFS_MAX_EXTENTS - 1;
-    uint32_t boundary;
-    uint32_t end_block;
-    uint32_t end_len;
+    uint32_t end = boundary;
 
+    /* Find the first extent ending after the target block */
     while (start < end) {
         uint32_t mid = start + (end - start) / 2;
-        if (index->extents[mid].ee_start == 0) {
+        struct simplefs_extent *ext = &index->extents[mid];
+        if (iblock >= ext->ee_block + ext->ee_len) {
+            start = mid + 1;
+        } else {
+            end = mid;
+        }
+    }
+
+    if (start < SIMPLEFS_MAX_EXTENTS)
+        return start;
+    return -1;
+}
+
+/* Insert 'ext' at slot 'pos', moving the following extents one slot up. The
+ * caller must make sure that the index is not full.
+ */
+void simplefs_ext_insert(struct simplefs_file_ei_block *index,
+                         uint32_t pos,
+                         const struct simplefs_extent *ext)
+{
+    uint32_t count = simplefs_ext_count(index);
+
+    memmove(&index->extents[pos + 1], &index->extents[pos],
+            (count - pos) * sizeof(struct simplefs_extent));
+    index->extents[pos] = *ext;
+}
+
+/* Remove the extent at slot 'pos', moving the following extents one slot
+ * down.
+ */
+void simplefs_ext_remove(struct simplefs_file_ei_block *index, uint32_t pos)
+{
+    uint32_t count = simplefs_ext_count(index);
+
+    memmove(&index->extents[pos], &index->extents[pos + 1],
+            (count - pos - 1) * sizeof(struct simplefs_extent));
+    memset(&index->extents[count - 1], 0, sizeof(struct simplefs_extent));
+}
+
+/* Return the number of children of interior node 'node'. Used entries are
+ * packed at the start of the node, as the extents of a leaf are.
+ */
+static uint32_t simplefs_idx_count(struct simplefs_ext_node *node)
+{
+    uint32_t start = 0;
+    uint32_t end = SIMPLEFS_MAX_EXT_IDX;
+
+    while (start < end) {
+        uint32_t mid = start + (end - start) / 2;
+        if (node->idx[mid].ei_child == 0) {
             end = mid;
         } else {
             start = mid + 1;
         }
     }
+    return start;
+}
+
+/* Return the slot of the child of 'node' covering the target block: the last
+ * one starting at or before it. The first child covers everything below the
+ * second one.
+ */
+static uint32_t simplefs_idx_search(struct simplefs_ext_node *node,
+                                    uint32_t count,
+                                    uint32_t iblock)
+{
+    uint32_t start = 1;
+    uint32_t end = count;
+
+    while (start < end) {
+        uint32_t mid = start + (end - start) / 2;
+        if (node->idx[mid].ei_block <= iblock) {
+            start = mid + 1;
+        } else {
+            end = mid;
+        }
+    }
+    return start - 1;
+}
+
+/* Read the node at block 'bno' of an extent tree. With 'nowait', the node is
+ * only taken from the buffer cache, and NULL is returned if it is not up to
+ * date there.
+ */
+static struct buffer_head *simplefs_ext_bread(struct super_block *sb,
+                                              uint32_t bno,
+                                              bool nowait)
+{
+    struct buffer_head *bh;
+
+    if (!nowait)
+        return sb_bread(sb, bno);
+    bh = sb_find_get_block(sb, bno);
+    if (bh && !buffer_uptodate(bh)) {
+        brelse(bh);
+        return NULL;
+    }
+    return bh;
+}
+
+/* Release the blocks held by 'path'. It may be released more than once. */
+void simplefs_ext_release(struct simplefs_ext_path *path)
+{
+    uint32_t i;
+
+    for (i = 0; i <= path->depth; i++) {
+        brelse(path->bh[i]);
+        path->bh[i] = NULL;
+    }
+    path->depth = 0;
+}
+
+/* Walk down the extent tree from the root held by 'path' to the leaf covering
+ * the target block, with a binary search at each level. The nodes below the
+ * root from a previous walk are released first.
+ * Return 0, or -EIO with the whole path released. A 'nowait' path does not
+ * read nodes missing from the buffer cache and returns -EAGAIN instead.
+ */
+int simplefs_ext_refind(struct super_block *sb,
+                        struct simplefs_ext_path *path,
+                        uint32_t iblock)
+{
+    struct simplefs_ext_node *node;
+    uint32_t i, count;
+
+    for (i = 1; i <= path->depth; i++) {
+        brelse(path->bh[i]);
+        path->bh[i] = NULL;
+    }
+
+    node = (struct simplefs_ext_node *) path->bh[0]->b_data;
+    path->depth = 0;
+    path->end = SIMPLEFS_EXT_END;
+    if (node->depth > SIMPLEFS_EXT_MAX_DEPTH) {
+        pr_err("extent tree of depth %u at block %llu\n", node->depth,
+               (unsigned long long) path->bh[0]->b_blocknr);
+        simplefs_ext_release(path);
+        return -EIO;
+    }
+
+    for (i = 0; i < node->depth; i++) {
+        struct simplefs_ext_node *cur =
+            (struct simplefs_ext_node *) path->bh[i]->b_data;
+
+        count = simplefs_idx_count(cur);
+        if (!count) {
+            simplefs_ext_release(path);
+            return -EIO;
+        }
+        path->pos[i] = simplefs_idx_search(cur, count, iblock);
+        if (path->pos[i] + 1 < count)
+            path->end = cur->idx[path->pos[i] + 1].ei_block;
+
+        path->bh[i + 1] = simplefs_ext_bread(
+            sb, cur->idx[path->pos[i]].ei_child, path->nowait);
+        if (!path->bh[i + 1]) {
+            simplefs_ext_release(path);
+            return path->nowait ? -EAGAIN : -EIO;
+        }
+        path->depth = i + 1;
+    }
+    return 0;
+}
+
+/* Walk down the extent tree whose root is held by 'root' to the leaf covering
+ * the target block. The path takes over the reference to 'root'.
+ * Return 0, or -EIO with the whole path released.
+ */
+int simplefs_ext_find(struct super_block *sb,
+                      struct buffer_head *root,
+                      uint32_t iblock,
+                      struct simplefs_ext_path *path)
+{
+    memset(path, 0, sizeof(*path));
+    path->bh[0] = root;
+    return simplefs_ext_refind(sb, path, iblock);
+}
+
+/* Walk down the extent tree as simplefs_ext_find() does, without waiting for
+ * any I/O: return -EAGAIN if a node is not in the buffer cache.
+ */
+int simplefs_ext_find_nowait(struct super_block *sb,
+                             struct buffer_head *root,
+                             uint32_t iblock,
+                             struct simplefs_ext_path *path)
+{
+    memset(path, 0, sizeof(*path));
+    path->bh[0] = root;
+    path->nowait = true;
+    return simplefs_ext_refind(sb, path, iblock);
+}
+
+/* Allocate a node of the extent tree of 'inode' next to block 'goal', of
+ * depth 'depth' and holding the 'size' bytes of entries at 'entries'.
+ * Return its block or 0 if the disk is full.
+ */
+static uint32_t simplefs_ext_new_node(struct inode *inode,
+                                      uint32_t goal,
+                                      uint32_t depth,
+                                      const void *entries,
+                                      size_t size)
+{
+    struct super_block *sb = inode->i_sb;
+    struct simplefs_ext_node *node;
+    struct buffer_head *bh;
+    uint32_t bno;
+
+    bno = get_meta_blocks(sb, goal, 1);
+    if (!bno)
+        return 0;
+    bh = get_zeroed_block(sb, bno);
+    if (!bh) {
+        put_blocks(SIMPLEFS_SB(sb), bno, 1);
+        return 0;
+    }
+    node = (struct simplefs_ext_node *) bh->b_data;
+    node->depth = depth;
+    memcpy(node->idx, entries, size);
+    mark_buffer_dirty_inode(bh, inode);
+    brelse(bh);
+    return bno;
+}
+
+/* Move the content of the full root of 'path' into a new node below it. The
+ * root stays in place with this node as its only child, one level higher.
+ */
+static int simplefs_ext_grow(struct inode *inode,
+                             struct simplefs_ext_path *path)
+{
+    struct buffer_head *root = path->bh[0];
+    struct simplefs_ext_node *node = (struct simplefs_ext_node *) root->b_data;
+    uint32_t bno;
+
+    if (node->depth == SIMPLEFS_EXT_MAX_DEPTH)
+        return -EFBIG;
+    bno = simplefs_ext_new_node(inode, root->b_blocknr, node->depth, node->idx,
+                                SIMPLEFS_BLOCK_SIZE - sizeof(uint32_t));
+    if (!bno)
+        return -ENOSPC;
+
+    node->depth++;
+    memset(node->idx, 0, sizeof(node->idx));
+    node->idx[0].ei_child = bno;
+    mark_buffer_dirty_inode(root, inode);
+    return 0;
+}
 
-    if (index->extents[end].ee_start == 0) {
-        boundary = end;
+/* Split the full node at level 'level' of 'path' in two, the upper part going
+ * to a new node inserted after it in its parent, which must not be full. A
+ * leaf written at its end keeps all but its last extent, so files written
+ * sequentially fill their leaves, and the extent being appended to stays
+ * first in the new one. Other nodes are split in halves.
+ */
+static int simplefs_ext_split(struct inode *inode,
+                              struct simplefs_ext_path *path,
+                              uint32_t level,
+                              uint32_t iblock)
+{
+    struct buffer_head *bh = path->bh[level];
+    struct simplefs_ext_node *node = (struct simplefs_ext_node *) bh->b_data;
+    struct simplefs_ext_node *parent =
+        (struct simplefs_ext_node *) path->bh[level - 1]->b_data;
+    uint32_t ppos = path->pos[level - 1];
+    uint32_t pcount = simplefs_idx_count(parent);
+    uint32_t count, keep, key, bno;
+    char *moved;
+    size_t size;
+
+    if (!node->depth) {
+        struct simplefs_file_ei_block *leaf =
+            (struct simplefs_file_ei_block *) bh->b_data;
+
+        count = simplefs_ext_count(leaf);
+        keep = count / 2;
+        if (iblock >= leaf->extents[count - 1].ee_block)
+            keep = count - 1;
+        key = leaf->extents[keep].ee_block;
+        moved = (char *) &leaf->extents[keep];
+        size = (count - keep) * sizeof(struct simplefs_extent);
     } else {
-        /* File index full */
-        boundary = end + 1;
+        count = simplefs_idx_count(node);
+        keep = count / 2;
+        key = node->idx[keep].ei_block;
+        moved = (char *) &node->idx[keep];
+        size = (count - keep) * sizeof(struct simplefs_ext_idx);
+    }
+
+    bno = simplefs_ext_new_node(inode, bh->b_blocknr, node->depth, moved, size);
+    if (!bno)
+        return -ENOSPC;
+    memset(moved, 0, size);
+    mark_buffer_dirty_inode(bh, inode);
+
+    memmove(&parent->idx[ppos + 2], &parent->idx[ppos + 1],
+            (pcount - ppos - 1) * sizeof(struct simplefs_ext_idx));
+    parent->idx[ppos + 1].ei_block = key;
+    parent->idx[ppos + 1].ei_child = bno;
+    mark_buffer_dirty_inode(path->bh[level - 1], inode);
+    return 0;
+}
+
+/* Make room for 'n' more extents in the leaf of 'path', which covers the
+ * target block. A full leaf is split into its parent, a full parent into its
+ * own, and a full root grows the tree by one level. The path is walked down
+ * again afterwards, it may lead to a new leaf.
+ * Return 0, -ENOSPC with 'path' unchanged, or -EFBIG or -EIO with 'path'
+ * possibly released.
+ */
+int simplefs_ext_make_room(struct inode *inode,
+                           struct simplefs_ext_path *path,
+                           uint32_t iblock,
+                           uint32_t n)
+{
+    uint32_t level;
+    int ret;
+
+    while (simplefs_ext_count(SIMPLEFS_EXT_LEAF(path)) + n >
+           SIMPLEFS_MAX_EXTENTS) {
+        /* Find the lowest node whose parent can take one more child */
+        for (level = path->depth; level > 0; level--) {
+            struct simplefs_ext_node *parent =
+                (struct simplefs_ext_node *) path->bh[level - 1]->b_data;
+
+            if (simplefs_idx_count(parent) < SIMPLEFS_MAX_EXT_IDX)
+                break;
+        }
+
+        if (level)
+            ret = simplefs_ext_split(inode, path, level, iblock);
+        else
+            ret = simplefs_ext_grow(inode, path);
+        if (ret)
+            return ret;
+
+        ret = simplefs_ext_refind(inode->i_sb, path, iblock);
+        if (ret)
+            return ret;
+    }
+    return 0;
+}
+
+/* Release the extents of the leaf 'leaf' from block 'first' on */
+static void simplefs_ext_free_leaf(struct simplefs_sb_info *sbi,
+                                   struct simplefs_file_ei_block *leaf,
+                                   uint32_t first)
+{
+    struct simplefs_extent *ext;
+    uint32_t pos;
+
+    for (pos = simplefs_ext_count(leaf); pos-- > 0;) {
+        ext = &leaf->extents[pos];
+        if (ext->ee_block + ext->ee_len <= first)
+            break;
+        if (ext->ee_block < first) {
+            put_blocks(sbi, ext->ee_start + first - ext->ee_block,
+                       ext->ee_block + ext->ee_len - first);
+            ext->ee_len = first - ext->ee_block;
+            break;
+        }
+        put_blocks(sbi, ext->ee_start, ext->ee_len);
+        memset(ext, 0, sizeof(*ext));
+    }
+}
+
+/* Release the extents of the subtree at 'bh' from block 'first' on, along with
+ * the children covering only blocks from 'first' on. With 'all', every child
+ * is released, the node is about to be released itself.
+ */
+static int simplefs_ext_free_tree(struct inode *inode,
+                                  struct buffer_head *bh,
+                                  uint32_t first,
+                                  bool all)
+{
+    struct super_block *sb = inode->i_sb;
+    struct simplefs_ext_node *node = (struct simplefs_ext_node *) bh->b_data;
+    struct buffer_head *child;
+    uint32_t i;
+    bool drop;
+    int ret;
+
+    if (!node->depth) {
+        simplefs_ext_free_leaf(SIMPLEFS_SB(sb),
+                               (struct simplefs_file_ei_block *) bh->b_data,
+                               first);
+        mark_buffer_dirty_inode(bh, inode);
+        return 0;
     }
 
-    if (boundary == 0) /* No used file index */
-        return boundary;
+    for (i = simplefs_idx_count(node); i-- > 0;) {
+        drop = all || (i && node->idx[i].ei_block >= first);
+        child = sb_bread(sb, node->idx[i].ei_child);
+        if (!child)
+            return -EIO;
+        ret = simplefs_ext_free_tree(inode, child, first, drop);
+        if (ret) {
+            brelse(child);
+            return ret;
+        }
+        if (!drop) {
+            brelse(child);
+            break;
+        }
+
+        /* The node must not be written back once its block is reused */
+        bforget(child);
+        put_blocks(SIMPLEFS_SB(sb), node->idx[i].ei_child, 1);
+        memset(&node->idx[i], 0, sizeof(node->idx[i]));
+        mark_buffer_dirty_inode(bh, inode);
+    }
+    return 0;
+}
 
-    /* try finding target block using binary search */
-    start = 0;
-    end = boundary - 1;
+/* Release the blocks of a file from block 'first' on, given the root of its
+ * extent tree. The extent covering 'first' is cut short. Releasing all of
+ * them turns the root back into an empty leaf.
+ * The caller must hold ext_lock for writing.
+ */
+int simplefs_ext_truncate(struct inode *inode,
+                          struct buffer_head *root,
+                          uint32_t first)
+{
+    int ret = simplefs_ext_free_tree(inode, root, first, !first);
+
+    if (ret)
+        return ret;
+    if (!first) {
+        memset(root->b_data, 0, SIMPLEFS_BLOCK_SIZE);
+        mark_buffer_dirty_inode(root, inode);
+    }
+    return 0;
+}
+
+/* Look the block 'iblock' up in the extent cache of 'ci'. Store the extent
+ * covering it in 'ext'. For a hole, 'ext' gets no start and covers the blocks
+ * up to the next extent, or none after the last one.
+ * Return 0, or -ENODATA if the file has no cache.
+ */
+int simplefs_ext_cache_lookup(struct simplefs_inode_info *ci,
+                              uint32_t iblock,
+                              struct simplefs_extent *ext)
+{
+    struct simplefs_ext_cache *cache;
+    uint32_t start = 0, end;
+
+    rcu_read_lock();
+    cache = rcu_dereference(ci->ext_cache);
+    if (!cache) {
+        rcu_read_unlock();
+        return -ENODATA;
+    }
+
+    end = cache->nr;
     while (start < end) {
         uint32_t mid = start + (end - start) / 2;
-        uint32_t block = index->extents[mid].ee_block;
-        uint32_t len = index->extents[mid].ee_len;
-        if (iblock >= block && iblock < block + len) {
-            /* found before search finished */
-            return mid;
-        }
-        if (iblock < block) {
-            end = mid;
-        } else {
+        if (iblock >= cache->extents[mid].ee_block + cache->extents[mid].ee_len)
             start = mid + 1;
-        }
+        else
+            end = mid;
     }
 
-    /* Return 'end' if it directs to valid block.
-     * Return 'boundary' if index is not found and eiblock has remaining space
-     */
-    end_block = index->extents[end].ee_block;
-    end_len = index->extents[end].ee_len;
+    if (start < cache->nr && iblock >= cache->extents[start].ee_block) {
+        *ext = cache->extents[start];
+    } else {
+        memset(ext, 0, sizeof(*ext));
+        ext->ee_block = iblock;
+        if (start < cache->nr)
+            ext->ee_len = cache->extents[start].ee_block - iblock;
+    }
+    rcu_read_unlock();
+    return 0;
+}
 
-    if (iblock >= end_block && iblock < end_block + end_len)
-        return end;
-    if (boundary < SIMPLEFS_MAX_EXTENTS)
-        return boundary;
-    return -1;
+/* Build the extent cache of 'ci' from its index, unless it has one already.
+ * Only an index made of a single leaf is cached; the nodes of a deeper tree
+ * are looked up in the buffer cache instead. The caller must hold ext_lock,
+ * which keeps the index from changing. The cache is optional: it is not built
+ * if memory is short.
+ */
+void simplefs_ext_cache_fill(struct simplefs_sb_info *sbi,
+                             struct simplefs_inode_info *ci,
+                             struct simplefs_file_ei_block *index)
+{
+    struct simplefs_ext_cache *cache;
+    uint32_t nr;
+
+    if (READ_ONCE(ci->ext_cache))
+        return;
+
+    nr = simplefs_ext_count(index);
+    cache = kmalloc(struct_size(cache, extents, nr), GFP_NOFS);
+    if (!cache)
+        return;
+    cache->nr = nr;
+    memcpy(cache->extents, index->extents, nr * sizeof(*cache->extents));
+
+    /* Concurrent readers may race to build it, the first one wins */
+    if (cmpxchg(&ci->ext_cache, NULL, cache)) {
+        kfree(cache);
+        return;
+    }
+
+    spin_lock(&sbi->ec_lock);
+    if (list_empty(&ci->ec_list)) {
+        list_add_tail(&ci->ec_list, &sbi->ec_inodes);
+        sbi->nr_ext_caches++;
+    }
+    spin_unlock(&sbi->ec_lock);
+}
+
+/* Drop the extent cache of 'ci', when its index is about to change or the
+ * inode leaves memory. The caller must hold ext_lock for writing, so that
+ * the cache is not built again from the old index. Readers still holding
+ * the old cache keep it until the end of their RCU read-side section.
+ */
+void simplefs_ext_cache_drop(struct simplefs_sb_info *sbi,
+                             struct simplefs_inode_info *ci)
+{
+    struct simplefs_ext_cache *cache = xchg(&ci->ext_cache, NULL);
+
+    if (!cache)
+        return;
+
+    spin_lock(&sbi->ec_lock);
+    if (!list_empty(&ci->ec_list)) {
+        list_del_init(&ci->ec_list);
+        sbi->nr_ext_caches--;
+    }
+    spin_unlock(&sbi->ec_lock);
+    kfree_rcu(cache, rcu);
+}
+
+/* Drop up to 'nr' extent caches, the oldest first, under memory pressure.
+ * Return the number of caches dropped.
+ */
+unsigned long simplefs_ext_cache_shrink(struct simplefs_sb_info *sbi,
+                                        unsigned long nr)
+{
+    struct simplefs_inode_info *ci;
+    struct simplefs_ext_cache *cache;
+    unsigned long freed = 0;
+
+    while (freed < nr) {
+        spin_lock(&sbi->ec_lock);
+        if (list_empty(&sbi->ec_inodes)) {
+            spin_unlock(&sbi->ec_lock);
+            break;
+        }
+        ci = list_first_entry(&sbi->ec_inodes, struct simplefs_inode_info,
+                              ec_list);
+        list_del_init(&ci->ec_list);
+        sbi->nr_ext_caches--;
+        cache = xchg(&ci->ext_cache, NULL);
+        spin_unlock(&sbi->ec_lock);
+
+        if (cache)
+            kfree_rcu(cache, rcu);
+        freed++;
+    }
+    return freed;
 }
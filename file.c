@@ -1,586 +1,2383 @@
 #define pr_fmt(fmt) "simplefs: " fmt
 
+#include <linux/bio.h>
+#include <linux/blkdev.h>
 #include <linux/buffer_head.h>
+#include <linux/falloc.h>
 #include <linux/fs.h>
+#include <linux/highmem.h>
+#include <linux/iomap.h>
 #include <linux/kernel.h>
 #include <linux/module.h>
-#include <linux/mpage.h>
+#include <linux/pagemap.h>
+#include <linux/sched/signal.h>
+#include <linux/slab.h>
 
 #include "bitmap.h"
 #include "simplefs.h"
 
-/* Associate the provided 'buffer_head' parameter with the iblock-th block of
- * the file denoted by inode. Should the specified block be unallocated and the
- * create flag is set to true, proceed to allocate a new block on the disk and
- * establish a mapping for it.
+/* Entries of the delayed allocation map of a file, one per block reserved
+ * over a hole by a buffered write. A block is pending while the write that
+ * reserved it is in progress, and dirty once its data is in the page cache.
  */
-static int simplefs_file_get_block(struct inode *inode,
-                                   sector_t iblock,
-                                   struct buffer_head *bh_result,
-                                   int create)
+#define SIMPLEFS_DELAYED_PENDING xa_mk_value(1)
+#define SIMPLEFS_DELAYED_DIRTY xa_mk_value(2)
+
+#if !SIMPLEFS_AT_LEAST(6, 8, 0)
+/* Return how many blocks from 'iblock' on, up to 'max', belong to dirty pages.
+ * At writeback these are the blocks being written, so one extent can cover
+ * them all, while the holes of a sparse file are left unallocated.
+ */
+static uint32_t simplefs_dirty_blocks(struct address_space *mapping,
+                                      uint32_t iblock,
+                                      uint32_t max)
 {
-    struct super_block *sb = inode->i_sb;
-    struct simplefs_inode_info *ci = SIMPLEFS_INODE(inode);
-    struct simplefs_file_ei_block *index;
-    struct buffer_head *bh_index;
-    int ret = 0, bno;
-    uint32_t extent;
+    unsigned int shift = PAGE_SHIFT - mapping->host->i_blkbits;
+    pgoff_t index = iblock >> shift;
+    pgoff_t last = ((uint64_t) iblock + max - 1) >> shift;
+    uint64_t end;
 
-    /* If block number exceeds filesize, fail */
-    if (iblock >= SIMPLEFS_MAX_BLOCKS_PER_EXTENT * SIMPLEFS_MAX_EXTENTS)
-        return -EFBIG;
+    for (; index <= last; index++) {
+        if (!xa_get_mark(&mapping->i_pages, index, PAGECACHE_TAG_DIRTY))
+            break;
+    }
 
-    /* Read directory block from disk */
-    bh_index = sb_bread(sb, ci->ei_block);
-    if (!bh_index)
-        return -EIO;
-    index = (struct simplefs_file_ei_block *) bh_index->b_data;
+    end = (uint64_t) index << shift;
+    return end > iblock ? min_t(uint64_t, max, end - iblock) : 1;
+}
+#endif
 
-    extent = simplefs_ext_search(index, iblock);
-    if (extent == -1) {
-        ret = -EFBIG;
-        goto brelse_index;
+/* Settle the blocks [first, last) of the file reserved by a buffered write
+ * that copied its data up to block 'done': the blocks before it hold dirty
+ * data now, the others give their reservation back.
+ */
+static void simplefs_settle_delayed(struct inode *inode,
+                                    uint32_t first,
+                                    uint32_t done,
+                                    uint32_t last)
+{
+    struct xarray *delayed = &SIMPLEFS_INODE(inode)->delayed;
+    uint32_t iblock, nr = 0;
+
+    for (iblock = first; iblock < done; iblock++)
+        xa_cmpxchg(delayed, iblock, SIMPLEFS_DELAYED_PENDING,
+                   SIMPLEFS_DELAYED_DIRTY, GFP_NOFS);
+    for (; iblock < last; iblock++) {
+        if (xa_cmpxchg(delayed, iblock, SIMPLEFS_DELAYED_PENDING, NULL,
+                       GFP_NOFS) == SIMPLEFS_DELAYED_PENDING)
+            nr++;
     }
+    if (nr)
+        unreserve_blocks(SIMPLEFS_SB(inode->i_sb), nr);
+}
 
-    /* Determine whether the 'iblock' is currently allocated. If it is not and
-     * the create parameter is set to true, then allocate the block. Otherwise,
-     * retrieve the physical block number.
-     */
-    if (index->extents[extent].ee_start == 0) {
-        if (!create) {
-            ret = 0;
-            goto brelse_index;
-        }
-        bno = get_free_blocks(sb, SIMPLEFS_MAX_BLOCKS_PER_EXTENT);
-        if (!bno) {
-            ret = -ENOSPC;
-            goto brelse_index;
-        }
+/* Reserve the blocks [first, last) of the file, which lie in a hole, for a
+ * buffered write. Blocks reserved by an earlier write are left as they are.
+ * The caller must hold ext_lock, so that writeback does not allocate them
+ * in the meantime.
+ */
+static int simplefs_reserve_delayed(struct inode *inode,
+                                    uint32_t first,
+                                    uint32_t last,
+                                    unsigned int flags)
+{
+    struct simplefs_sb_info *sbi = SIMPLEFS_SB(inode->i_sb);
+    struct xarray *delayed = &SIMPLEFS_INODE(inode)->delayed;
+    uint32_t iblock, nr = 0;
+    int ret;
+
+    for (iblock = first; iblock < last; iblock++)
+        nr += !xa_load(delayed, iblock);
+    if (!nr)
+        return 0;
+    if (flags & IOMAP_NOWAIT)
+        return -EAGAIN;
+    ret = reserve_blocks(sbi, nr);
+    if (ret)
+        return ret;
 
-        index->extents[extent].ee_start = bno;
-        index->extents[extent].ee_len = SIMPLEFS_MAX_BLOCKS_PER_EXTENT;
-        index->extents[extent].ee_block =
-            extent ? index->extents[extent - 1].ee_block +
-                         index->extents[extent - 1].ee_len
-                   : 0;
-    } else {
-        bno = index->extents[extent].ee_start + iblock -
-              index->extents[extent].ee_block;
+    for (iblock = first; iblock < last; iblock++) {
+        ret = xa_insert(delayed, iblock, SIMPLEFS_DELAYED_PENDING, GFP_NOFS);
+        if (ret == -EBUSY)
+            continue;
+        if (ret) {
+            unreserve_blocks(sbi, nr);
+            simplefs_settle_delayed(inode, first, first, last);
+            return ret;
+        }
+        nr--;
     }
+    return 0;
+}
 
-    /* Map the physical block to the given 'buffer_head'. */
-    map_bh(bh_result, sb, bno);
+/* Return how many blocks from 'iblock' on, up to 'max', are delayed */
+static uint32_t simplefs_delayed_run(struct inode *inode,
+                                     uint32_t iblock,
+                                     uint32_t max)
+{
+    struct xarray *delayed = &SIMPLEFS_INODE(inode)->delayed;
+    uint32_t n = 0;
 
-brelse_index:
-    brelse(bh_index);
+    while (n < max && xa_load(delayed, iblock + n))
+        n++;
+    return n;
+}
 
-    return ret;
+/* Return how many blocks of [first, last) of the file are delayed */
+static uint32_t simplefs_delayed_count(struct inode *inode,
+                                       uint32_t first,
+                                       uint32_t last)
+{
+    struct xarray *delayed = &SIMPLEFS_INODE(inode)->delayed;
+    unsigned long index = first;
+    uint32_t nr = 0;
+    void *entry;
+
+    if (first >= last)
+        return 0;
+    for (entry = xa_find(delayed, &index, last - 1, XA_PRESENT); entry;
+         entry = xa_find_after(delayed, &index, last - 1, XA_PRESENT))
+        nr++;
+    return nr;
 }
 
-/* Called by the page cache to read a page from the physical disk and map it
- * into memory.
+/* Give back the reservation of the delayed blocks in [first, last) of the
+ * file, whose pages are dropped or which got blocks of their own.
  */
-#if SIMPLEFS_AT_LEAST(5, 19, 0)
-static void simplefs_readahead(struct readahead_control *rac)
+void simplefs_drop_delayed(struct inode *inode, uint32_t first, uint32_t last)
 {
-    mpage_readahead(rac, simplefs_file_get_block);
+    struct xarray *delayed = &SIMPLEFS_INODE(inode)->delayed;
+    unsigned long index = first;
+    uint32_t nr = 0;
+    void *entry;
+
+    if (first >= last)
+        return;
+    for (entry = xa_find(delayed, &index, last - 1, XA_PRESENT); entry;
+         entry = xa_find_after(delayed, &index, last - 1, XA_PRESENT)) {
+        if (xa_erase(delayed, index))
+            nr++;
+    }
+    if (nr)
+        unreserve_blocks(SIMPLEFS_SB(inode->i_sb), nr);
 }
-#else
-static int simplefs_readpage(struct file *file, struct page *page)
+
+/* Prepare the 'len' blocks from 'bno' newly allocated to a file. They are
+ * unwritten and read as zeroes without touching the disk until data is
+ * written to them. Nothing has to be cleaned up front, only stale buffers of
+ * the blocks are dropped.
+ */
+static void simplefs_init_blocks(struct inode *inode,
+                                 uint32_t bno,
+                                 uint32_t len)
 {
-    return mpage_readpage(page, simplefs_file_get_block);
+    clean_bdev_aliases(inode->i_sb->s_bdev, bno, len);
 }
-#endif
 
-/* Called by the page cache to write a dirty page to the physical disk (when
- * sync is called or when memory is needed).
+/* Return how many blocks to claim ahead for the preallocation window of a
+ * file allocating at slot 'pos' of the leaf of 'path'. Only a file appending
+ * after its last extent and holding no window gets one, and only while free
+ * space is plentiful.
  */
-#if SIMPLEFS_AT_LEAST(6, 8, 0)
-static int simplefs_writepage(struct page *page, struct writeback_control *wbc)
+static uint32_t simplefs_prealloc_len(struct inode *inode,
+                                      struct simplefs_ext_path *path,
+                                      uint32_t pos)
 {
-    struct folio *folio = page_folio(page);
-    return __block_write_full_folio(page->mapping->host, folio,
-                                    simplefs_file_get_block, wbc);
+    struct simplefs_sb_info *sbi = SIMPLEFS_SB(inode->i_sb);
+
+    if (path->end != SIMPLEFS_EXT_END ||
+        pos != simplefs_ext_count(SIMPLEFS_EXT_LEAF(path)) ||
+        READ_ONCE(SIMPLEFS_INODE(inode)->pa_len))
+        return 0;
+    if (avail_blocks(sbi) - percpu_counter_read_positive(&sbi->dirty_blocks) <
+        sbi->nr_blocks / 8)
+        return 0;
+    return SIMPLEFS_PREALLOC_BLOCKS;
 }
-#else
-static int simplefs_writepage(struct page *page, struct writeback_control *wbc)
+
+/* Claim a free run of up to '*len' blocks as close as possible to 'goal',
+ * halving the length until one is found. Return its first block and store its
+ * length in '*len', or return 0.
+ */
+static uint32_t simplefs_get_run(struct super_block *sb,
+                                 uint32_t goal,
+                                 uint32_t *len)
 {
-    return block_write_full_page(page, simplefs_file_get_block, wbc);
+    uint32_t bno;
+
+    for (; *len; *len /= 2) {
+        bno = get_free_blocks(sb, goal, *len);
+        if (bno)
+            return bno;
+    }
+    return 0;
 }
-#endif
 
-/* Called by the VFS when a write() syscall is made on a file, before writing
- * the data into the page cache. This function checks if the write operation
- * can complete and allocates the necessary blocks through block_write_begin().
+/* Allocate the hole of the file starting at 'iblock', whose extent belongs at
+ * slot 'pos' of the leaf of 'path', for up to 'want' blocks with extent flags
+ * 'flags'. The caller keeps 'want' within the blocks covered by the leaf.
+ * Blocks come from the preallocation window of the file first. The extent
+ * ending right before 'iblock' grows in place when it has the same flags and
+ * the blocks following it on disk are free. Otherwise a new extent is
+ * inserted, as long as the leaf has room and free space allows. With
+ * 'window' set, blocks claimed beyond 'want' by an appending file become its
+ * window.
+ * Return the slot of the extent covering 'iblock' or a negative error.
  */
-#if SIMPLEFS_AT_LEAST(6, 15, 0)
-static int simplefs_write_begin(const struct kiocb *iocb,
-                                struct address_space *mapping,
-                                loff_t pos,
-                                unsigned int len,
-                                struct folio **foliop,
-                                void **fsdata)
+static int simplefs_ext_alloc(struct inode *inode,
+                              struct simplefs_ext_path *path,
+                              uint32_t pos,
+                              uint32_t iblock,
+                              uint32_t want,
+                              bool window,
+                              uint32_t flags)
 {
-    struct file *file = iocb->ki_filp;
-    struct simplefs_sb_info *sbi = SIMPLEFS_SB(file->f_inode->i_sb);
-    int err;
-    uint32_t nr_allocs = 0;
+    struct super_block *sb = inode->i_sb;
+    struct simplefs_sb_info *sbi = SIMPLEFS_SB(sb);
+    struct simplefs_inode_info *ci = SIMPLEFS_INODE(inode);
+    struct simplefs_file_ei_block *index = SIMPLEFS_EXT_LEAF(path);
+    struct simplefs_extent *prev = pos ? &index->extents[pos - 1] : NULL;
+    struct simplefs_extent ext;
+    uint32_t extra = window ? simplefs_prealloc_len(inode, path, pos) : 0;
+    uint32_t bno, len, got, goal;
+
+    /* Grow the previous extent if it is contiguous in the file */
+    if (prev && prev->ee_block + prev->ee_len == iblock &&
+        prev->ee_flags == flags &&
+        prev->ee_len < SIMPLEFS_MAX_BLOCKS_PER_EXTENT) {
+        len = min_t(uint32_t, want,
+                    SIMPLEFS_MAX_BLOCKS_PER_EXTENT - prev->ee_len);
+        bno = prev->ee_start + prev->ee_len;
+        got = get_prealloc(sbi, ci, &bno, len);
+        if (!got) {
+            got = get_blocks_at(sb, bno, len + extra);
+            if (got > len) {
+                set_prealloc(sbi, ci, bno + len, got - len);
+                got = len;
+            }
+        }
+        if (got) {
+            simplefs_init_blocks(inode, bno, got);
+            prev->ee_len += got;
+            return pos - 1;
+        }
+    }
 
-    if (pos + len > SIMPLEFS_MAX_FILESIZE)
-        return -ENOSPC;
+    if (simplefs_ext_count(index) == SIMPLEFS_MAX_EXTENTS)
+        return -EFBIG;
 
-    nr_allocs = max(pos + len, file->f_inode->i_size) / SIMPLEFS_BLOCK_SIZE;
-    if (nr_allocs > file->f_inode->i_blocks - 1)
-        nr_allocs -= file->f_inode->i_blocks - 1;
+    /* New blocks go where the previous extent would continue, leaving room
+     * for the hole in between. The first extent goes to the region of the
+     * write lifetime of the file, or right after its index block.
+     */
+    if (prev)
+        goal = prev->ee_start + prev->ee_len +
+               (iblock - prev->ee_block - prev->ee_len);
     else
-        nr_allocs = 0;
-    if (nr_allocs > sbi->nr_free_blocks)
-        return -ENOSPC;
+        goal = get_hint_goal(sbi, inode->i_write_hint);
+    if (!goal)
+        goal = ci->ei_block + 1;
+
+    len = min_t(uint32_t, want, SIMPLEFS_MAX_BLOCKS_PER_EXTENT);
+    bno = 0;
+    got = get_prealloc(sbi, ci, &bno, len);
+    if (!got) {
+        /* Look for a free run as long as possible, halving on failure */
+        got = min_t(uint32_t, len + extra, SIMPLEFS_MAX_BLOCKS_PER_EXTENT);
+        bno = simplefs_get_run(sb, goal, &got);
+
+        /* Out of space: take back the windows of all files and retry */
+        if (!bno && put_all_prealloc(sbi)) {
+            got = len;
+            bno = simplefs_get_run(sb, goal, &got);
+        }
+        if (!bno)
+            return -ENOSPC;
+        set_hint_goal(sbi, inode->i_write_hint, bno, got);
+        if (got > len) {
+            set_prealloc(sbi, ci, bno + len, got - len);
+            got = len;
+        }
+    }
+    simplefs_init_blocks(inode, bno, got);
 
-    err = block_write_begin(mapping, pos, len, foliop, simplefs_file_get_block);
-    if (err < 0)
-        pr_err("newly allocated blocks reclaim not implemented yet\n");
-    return err;
+    ext.ee_block = iblock;
+    ext.ee_len = got;
+    ext.ee_start = bno;
+    ext.ee_flags = flags;
+    simplefs_ext_insert(index, pos, &ext);
+
+    return pos;
 }
-#elif SIMPLEFS_AT_LEAST(6, 12, 0)
-static int simplefs_write_begin(struct file *file,
-                                struct address_space *mapping,
-                                loff_t pos,
-                                unsigned int len,
-                                struct folio **foliop,
-                                void **fsdata)
-{
-    struct simplefs_sb_info *sbi = SIMPLEFS_SB(file->f_inode->i_sb);
-    int err;
-    uint32_t nr_allocs = 0;
 
-    if (pos + len > SIMPLEFS_MAX_FILESIZE)
-        return -ENOSPC;
+/* Mark the 'len' blocks from 'iblock' of the unwritten extent at slot 'pos'
+ * as written, once their data is on disk. They are merged into the previous
+ * extent when it is written and contiguous on disk, as happens when a file
+ * is filled sequentially. Otherwise the extent is split around them, which
+ * takes up to two more slots. When the index has no room for them, the rest
+ * of the extent is zeroed on disk instead and the whole extent is marked
+ * written.
+ * Return the slot of the extent now covering 'iblock' or a negative error.
+ */
+static int simplefs_ext_convert(struct inode *inode,
+                                struct simplefs_file_ei_block *index,
+                                uint32_t pos,
+                                uint32_t iblock,
+                                uint32_t len)
+{
+    struct super_block *sb = inode->i_sb;
+    struct simplefs_extent *ext = &index->extents[pos];
+    struct simplefs_extent *prev = pos ? &index->extents[pos - 1] : NULL;
+    struct simplefs_extent part;
+    uint32_t head = iblock - ext->ee_block;
+    uint32_t tail = ext->ee_block + ext->ee_len - iblock - len;
+    int ret;
+
+    if (!head && prev && !(prev->ee_flags & SIMPLEFS_EXT_UNWRITTEN) &&
+        prev->ee_block + prev->ee_len == iblock &&
+        prev->ee_start + prev->ee_len == ext->ee_start &&
+        prev->ee_len + len <= SIMPLEFS_MAX_BLOCKS_PER_EXTENT) {
+        prev->ee_len += len;
+        ext->ee_block += len;
+        ext->ee_start += len;
+        ext->ee_len -= len;
+        if (!ext->ee_len)
+            simplefs_ext_remove(index, pos);
+        return pos - 1;
+    }
 
-    nr_allocs = max(pos + len, file->f_inode->i_size) / SIMPLEFS_BLOCK_SIZE;
-    if (nr_allocs > file->f_inode->i_blocks - 1)
-        nr_allocs -= file->f_inode->i_blocks - 1;
-    else
-        nr_allocs = 0;
-    if (nr_allocs > sbi->nr_free_blocks)
-        return -ENOSPC;
+    if (simplefs_ext_count(index) + !!head + !!tail > SIMPLEFS_MAX_EXTENTS) {
+        if (head) {
+            ret = zero_blocks(sb, ext->ee_start, head);
+            if (ret)
+                return ret;
+        }
+        if (tail) {
+            ret = zero_blocks(sb, ext->ee_start + head + len, tail);
+            if (ret)
+                return ret;
+        }
+        ext->ee_flags &= ~SIMPLEFS_EXT_UNWRITTEN;
+        return pos;
+    }
 
-    err = block_write_begin(mapping, pos, len, foliop, simplefs_file_get_block);
-    if (err < 0)
-        pr_err("newly allocated blocks reclaim not implemented yet\n");
-    return err;
+    if (tail) {
+        part.ee_block = iblock + len;
+        part.ee_len = tail;
+        part.ee_start = ext->ee_start + head + len;
+        part.ee_flags = SIMPLEFS_EXT_UNWRITTEN;
+        ext->ee_len -= tail;
+        simplefs_ext_insert(index, pos + 1, &part);
+    }
+    if (head) {
+        part.ee_block = iblock;
+        part.ee_len = len;
+        part.ee_start = ext->ee_start + head;
+        part.ee_flags = 0;
+        ext->ee_len = head;
+        simplefs_ext_insert(index, pos + 1, &part);
+        return pos + 1;
+    }
+    ext->ee_flags &= ~SIMPLEFS_EXT_UNWRITTEN;
+    return pos;
 }
-#elif SIMPLEFS_AT_LEAST(5, 19, 0)
-static int simplefs_write_begin(struct file *file,
-                                struct address_space *mapping,
-                                loff_t pos,
-                                unsigned int len,
-                                struct page **pagep,
-                                void **fsdata)
+
+/* Read the index block of a file into '*bh'. A file that never held data has
+ * no index (ei_block is 0) and '*bh' is left NULL, unless 'create' is set: the
+ * index is then allocated next to the inode store block of the file.
+ * The caller must hold ext_lock, for writing if 'create' is set.
+ */
+static int simplefs_get_index(struct inode *inode,
+                              bool create,
+                              struct buffer_head **bh)
 {
-    struct simplefs_sb_info *sbi = SIMPLEFS_SB(file->f_inode->i_sb);
-    int err;
-    uint32_t nr_allocs = 0;
+    struct super_block *sb = inode->i_sb;
+    struct simplefs_inode_info *ci = SIMPLEFS_INODE(inode);
+    uint32_t bno;
 
-    if (pos + len > SIMPLEFS_MAX_FILESIZE)
-        return -ENOSPC;
+    *bh = NULL;
+    if (ci->ei_block) {
+        *bh = sb_bread(sb, ci->ei_block);
+        return *bh ? 0 : -EIO;
+    }
+    if (!create)
+        return 0;
 
-    nr_allocs = max(pos + len, file->f_inode->i_size) / SIMPLEFS_BLOCK_SIZE;
-    if (nr_allocs > file->f_inode->i_blocks - 1)
-        nr_allocs -= file->f_inode->i_blocks - 1;
-    else
-        nr_allocs = 0;
-    if (nr_allocs > sbi->nr_free_blocks)
+    bno = get_meta_blocks(sb, simplefs_inode_block(sb, inode->i_ino, false),
+                          1);
+    if (!bno)
         return -ENOSPC;
-
-    err = block_write_begin(mapping, pos, len, pagep, simplefs_file_get_block);
-    if (err < 0)
-        pr_err("newly allocated blocks reclaim not implemented yet\n");
-    return err;
+    *bh = get_zeroed_block(sb, bno);
+    if (!*bh) {
+        put_blocks(SIMPLEFS_SB(sb), bno, 1);
+        return -EIO;
+    }
+    mark_buffer_dirty_inode(*bh, inode);
+    WRITE_ONCE(ci->ei_block, bno);
+    mark_inode_dirty(inode);
+    return 0;
 }
-#else
-static int simplefs_write_begin(struct file *file,
-                                struct address_space *mapping,
-                                loff_t pos,
-                                unsigned int len,
-                                unsigned int flags,
-                                struct page **pagep,
-                                void **fsdata)
+
+/* Walk the extent tree of a file down to the leaf covering 'iblock', reading
+ * its index as simplefs_get_index() does. With IOMAP_NOWAIT in 'flags', no
+ * block is allocated or read: the index and the nodes must be up to date in
+ * the buffer cache, or -EAGAIN is returned.
+ * Return 0, -ENODATA if the file has no index, or another error.
+ */
+static int simplefs_get_leaf(struct inode *inode,
+                             uint32_t iblock,
+                             bool create,
+                             unsigned int flags,
+                             struct simplefs_ext_path *path)
 {
-    struct simplefs_sb_info *sbi = SIMPLEFS_SB(file->f_inode->i_sb);
-    int err;
-    uint32_t nr_allocs = 0;
+    struct super_block *sb = inode->i_sb;
+    uint32_t bno = SIMPLEFS_INODE(inode)->ei_block;
+    struct buffer_head *bh;
+    int ret;
+
+    if (!(flags & IOMAP_NOWAIT)) {
+        ret = simplefs_get_index(inode, create, &bh);
+        if (ret)
+            return ret;
+        if (!bh)
+            return -ENODATA;
+        return simplefs_ext_find(sb, bh, iblock, path);
+    }
 
-    if (pos + len > SIMPLEFS_MAX_FILESIZE)
-        return -ENOSPC;
+    if (!bno)
+        return create ? -EAGAIN : -ENODATA;
+    bh = sb_find_get_block(sb, bno);
+    if (!bh || !buffer_uptodate(bh)) {
+        brelse(bh);
+        return -EAGAIN;
+    }
+    return simplefs_ext_find_nowait(sb, bh, iblock, path);
+}
 
-    nr_allocs = max(pos + len, file->f_inode->i_size) / SIMPLEFS_BLOCK_SIZE;
-    if (nr_allocs > file->f_inode->i_blocks - 1)
-        nr_allocs -= file->f_inode->i_blocks - 1;
-    else
-        nr_allocs = 0;
-    if (nr_allocs > sbi->nr_free_blocks)
-        return -ENOSPC;
+/* Release the blocks [first, last) of the file, walking the leaves of 'path'
+ * from the one covering 'first'. Extents are trimmed, removed, or split when
+ * the range lies inside one. When the index has no room for the split, the
+ * range is zeroed on disk instead of being released. The number of blocks
+ * released is added to '*count'.
+ * The caller must hold ext_lock for writing.
+ */
+static int simplefs_free_range(struct inode *inode,
+                               struct simplefs_ext_path *path,
+                               uint32_t first,
+                               uint32_t last,
+                               uint32_t *count)
+{
+    struct super_block *sb = inode->i_sb;
+    struct simplefs_sb_info *sbi = SIMPLEFS_SB(sb);
+    struct simplefs_file_ei_block *index;
+    struct simplefs_extent *ext, part;
+    uint32_t iblock = first, pos, start, end, count;
+    int ret;
+
+    while (iblock < last) {
+        ret = simplefs_ext_refind(sb, path, iblock);
+        if (ret)
+            return ret;
+        index = SIMPLEFS_EXT_LEAF(path);
+
+        for (pos = 0; (count = simplefs_ext_count(index)) > pos;) {
+            ext = &index->extents[pos];
+            start = ext->ee_block;
+            end = ext->ee_block + ext->ee_len;
+
+            if (end <= first) {
+                pos++;
+                continue;
+            }
+            if (start >= last)
+                break;
+
+            if (start < first && end > last) {
+                if (count == SIMPLEFS_MAX_EXTENTS) {
+                    ret = simplefs_ext_make_room(inode, path, first, 1);
+                    if (ret == -ENOSPC) {
+                        if (ext->ee_flags & SIMPLEFS_EXT_UNWRITTEN)
+                            return 0;
+                        return zero_blocks(sb, ext->ee_start + first - start,
+                                           last - first);
+                    }
+                    if (ret)
+                        return ret;
+                    index = SIMPLEFS_EXT_LEAF(path);
+                    pos = 0;
+                    continue;
+                }
+                part.ee_block = last;
+                part.ee_len = end - last;
+                part.ee_start = ext->ee_start + last - start;
+                part.ee_flags = ext->ee_flags;
+                put_blocks(sbi, ext->ee_start + first - start, last - first);
+                *count += last - first;
+                ext->ee_len = first - start;
+                simplefs_ext_insert(index, pos + 1, &part);
+                break;
+            }
+            if (start < first) {
+                /* Release the tail of the extent */
+                put_blocks(sbi, ext->ee_start + first - start, end - first);
+                *count += end - first;
+                ext->ee_len = first - start;
+                pos++;
+            } else if (end > last) {
+                /* Release the head of the extent */
+                put_blocks(sbi, ext->ee_start, last - start);
+                *count += last - start;
+                ext->ee_start += last - start;
+                ext->ee_block = last;
+                ext->ee_len = end - last;
+                break;
+            } else {
+                put_blocks(sbi, ext->ee_start, ext->ee_len);
+                *count += ext->ee_len;
+                simplefs_ext_remove(index, pos);
+            }
+        }
+        mark_buffer_dirty_inode(path->bh[path->depth], inode);
 
-    err = block_write_begin(mapping, pos, len, flags, pagep,
-                            simplefs_file_get_block);
-    if (err < 0)
-        pr_err("newly allocated blocks reclaim not implemented yet\n");
-    return err;
+        if (path->end == SIMPLEFS_EXT_END)
+            break;
+        iblock = path->end;
+    }
+    return 0;
 }
-#endif
 
-/* Called by the VFS after writing data from a write() syscall to the page
- * cache. This function updates inode metadata and truncates the file if
- * necessary.
+/* Release the blocks [first, last) of the file, taking ext_lock, as
+ * simplefs_free_range() does.
  */
-#if SIMPLEFS_AT_LEAST(6, 15, 0)
-static int simplefs_write_end(const struct kiocb *iocb,
-                              struct address_space *mapping,
-                              loff_t pos,
-                              unsigned int len,
-                              unsigned int copied,
-                              struct folio *foliop,
-                              void *fsdata)
-{
-    struct inode *inode = iocb->ki_filp->f_inode;
-#elif SIMPLEFS_AT_LEAST(6, 12, 0)
-static int simplefs_write_end(struct file *file,
-                              struct address_space *mapping,
-                              loff_t pos,
-                              unsigned int len,
-                              unsigned int copied,
-                              struct folio *foliop,
-                              void *fsdata)
+static int simplefs_trim_range(struct inode *inode,
+                               uint32_t first,
+                               uint32_t last)
 {
-    struct inode *inode = file->f_inode;
-#else
-static int simplefs_write_end(struct file *file,
-                              struct address_space *mapping,
-                              loff_t pos,
-                              unsigned int len,
-                              unsigned int copied,
-                              struct page *page,
-                              void *fsdata)
-{
-    struct inode *inode = file->f_inode;
-#endif
     struct simplefs_inode_info *ci = SIMPLEFS_INODE(inode);
-    struct super_block *sb = inode->i_sb;
-#if SIMPLEFS_AT_LEAST(6, 6, 0)
-    struct timespec64 cur_time;
-#endif
-    uint32_t nr_blocks_old;
+    struct simplefs_ext_path path;
+    uint32_t count = 0;
+    int ret;
 
-    /* Complete the write() */
-#if SIMPLEFS_AT_LEAST(6, 15, 0)
-    int ret =
-        generic_write_end(iocb, mapping, pos, len, copied, foliop, fsdata);
-#elif SIMPLEFS_AT_LEAST(6, 12, 0)
-    int ret =
-        generic_write_end(file, mapping, pos, len, copied, foliop, fsdata);
-#else
-    int ret = generic_write_end(file, mapping, pos, len, copied, page, fsdata);
-#endif
-    if (ret < len) {
-        pr_err("wrote less than requested.");
-        return ret;
+    if (first >= last)
+        return 0;
+
+    down_write(&ci->ext_lock);
+    ret = simplefs_get_leaf(inode, first, false, 0, &path);
+    if (!ret) {
+        simplefs_ext_cache_drop(SIMPLEFS_SB(inode->i_sb), ci);
+        ret = simplefs_free_range(inode, &path, first, last, &count);
+        simplefs_ext_release(&path);
+    } else if (ret == -ENODATA) {
+        ret = 0;
     }
+    up_write(&ci->ext_lock);
+    return ret;
+}
 
-    nr_blocks_old = inode->i_blocks;
+/* Mark the unwritten blocks of the file between 'first' and 'last' (excluded)
+ * as written, walking the leaves of 'path'.
+ * The caller must hold ext_lock for writing.
+ */
+static int simplefs_convert_range(struct inode *inode,
+                                  struct simplefs_ext_path *path,
+                                  uint32_t first,
+                                  uint32_t last)
+{
+    struct simplefs_file_ei_block *index;
+    struct simplefs_extent *ext;
+    uint32_t iblock = first, pos, len;
+    int ret;
+
+    while (iblock < last) {
+        if (iblock == first || iblock >= path->end) {
+            ret = simplefs_ext_refind(inode->i_sb, path, iblock);
+            if (ret)
+                return ret;
+        }
+        index = SIMPLEFS_EXT_LEAF(path);
 
-    /* Update inode metadata */
-    inode->i_blocks = DIV_ROUND_UP(inode->i_size, SIMPLEFS_BLOCK_SIZE) + 1;
+        /* Skip to the next leaf past the last extent of this one */
+        pos = simplefs_ext_search(index, iblock);
+        ext = pos == -1 ? NULL : &index->extents[pos];
+        if (!ext || !ext->ee_start) {
+            if (path->end == SIMPLEFS_EXT_END)
+                break;
+            iblock = path->end;
+            continue;
+        }
+        if (iblock < ext->ee_block) {
+            iblock = ext->ee_block;
+            continue;
+        }
+        len = min(last, ext->ee_block + ext->ee_len) - iblock;
+        if (ext->ee_flags & SIMPLEFS_EXT_UNWRITTEN) {
+            /* Without room for the split, the extent is zeroed instead */
+            if (simplefs_ext_count(index) + 2 > SIMPLEFS_MAX_EXTENTS) {
+                ret = simplefs_ext_make_room(inode, path, iblock, 2);
+                if (ret && ret != -ENOSPC)
+                    return ret;
+                index = SIMPLEFS_EXT_LEAF(path);
+                pos = simplefs_ext_search(index, iblock);
+            }
+            ret = simplefs_ext_convert(inode, index, pos, iblock, len);
+            if (ret < 0)
+                return ret;
+            mark_buffer_dirty_inode(path->bh[path->depth], inode);
+        }
+        iblock += len;
+    }
+    return 0;
+}
 
-#if SIMPLEFS_AT_LEAST(6, 7, 0)
-    cur_time = current_time(inode);
-    inode_set_mtime_to_ts(inode, cur_time);
-    inode_set_ctime_to_ts(inode, cur_time);
-#elif SIMPLEFS_AT_LEAST(6, 6, 0)
-    cur_time = current_time(inode);
-    inode->i_mtime = cur_time;
-    inode_set_ctime_to_ts(inode, cur_time);
-#else
-    inode->i_mtime = inode->i_ctime = current_time(inode);
-#endif
+/* Mark the unwritten blocks [first, last) of the file as written, taking
+ * ext_lock, as simplefs_convert_range() does.
+ */
+static int simplefs_convert_unwritten(struct inode *inode,
+                                      uint32_t first,
+                                      uint32_t last)
+{
+    struct simplefs_inode_info *ci = SIMPLEFS_INODE(inode);
+    struct simplefs_ext_path path;
+    int ret;
 
-    mark_inode_dirty(inode);
+    if (first >= last)
+        return 0;
 
-    /* If file is smaller than before, free unused blocks */
-    if (nr_blocks_old > inode->i_blocks) {
-        int i;
-        struct buffer_head *bh_index;
-        struct simplefs_file_ei_block *index;
-        uint32_t first_ext;
-
-        /* Free unused blocks from page cache */
-        truncate_pagecache(inode, inode->i_size);
-
-        /* Read ei_block to remove unused blocks */
-        bh_index = sb_bread(sb, ci->ei_block);
-        if (!bh_index) {
-#if SIMPLEFS_AT_LEAST(6, 15, 0)
-            pr_err("Failed to truncate '%s'. Lost %llu blocks\n",
-                   iocb->ki_filp->f_path.dentry->d_name.name,
-                   nr_blocks_old - inode->i_blocks);
-#else
-            pr_err("Failed to truncate '%s'. Lost %llu blocks\n",
-                   file->f_path.dentry->d_name.name,
-                   nr_blocks_old - inode->i_blocks);
-#endif
-            goto end;
-        }
-        index = (struct simplefs_file_ei_block *) bh_index->b_data;
+    down_write(&ci->ext_lock);
+    ret = simplefs_get_leaf(inode, first, false, 0, &path);
+    if (!ret) {
+        simplefs_ext_cache_drop(SIMPLEFS_SB(inode->i_sb), ci);
+        ret = simplefs_convert_range(inode, &path, first, last);
+        simplefs_ext_release(&path);
+    } else if (ret == -ENODATA) {
+        ret = 0;
+    }
+    up_write(&ci->ext_lock);
+    return ret;
+}
+
+/* Report the extent of a file covering 'pos', or the hole up to the next
+ * extent or the end of the leaf, whole. Holes are reported as unwritten by
+ * 'seek', so that SEEK_DATA and SEEK_HOLE look for delayed data in the page
+ * cache. The caller must hold ext_lock.
+ */
+static int simplefs_iomap_lookup(struct inode *inode,
+                                 loff_t pos,
+                                 loff_t length,
+                                 unsigned int flags,
+                                 struct iomap *iomap,
+                                 bool seek)
+{
+    struct simplefs_inode_info *ci = SIMPLEFS_INODE(inode);
+    struct simplefs_file_ei_block *index;
+    struct simplefs_extent *ext;
+    struct simplefs_ext_path path;
+    unsigned int bits = inode->i_blkbits;
+    uint32_t iblock, extent;
+    int ret;
+
+    iomap->bdev = inode->i_sb->s_bdev;
+    iomap->type = seek ? IOMAP_UNWRITTEN : IOMAP_HOLE;
+    iomap->addr = IOMAP_NULL_ADDR;
+    iomap->flags = 0;
+    if (pos >= SIMPLEFS_MAX_FILESIZE) {
+        iomap->offset = pos;
+        iomap->length = length;
+        return 0;
+    }
 
-        first_ext = simplefs_ext_search(index, inode->i_blocks - 1);
+    iblock = pos >> bits;
+    iomap->offset = (loff_t) iblock << bits;
+    iomap->length = SIMPLEFS_MAX_FILESIZE - iomap->offset;
 
-        /* Reserve unused block in last extent */
-        if (inode->i_blocks - 1 != index->extents[first_ext].ee_block)
-            first_ext++;
+    ret = simplefs_get_leaf(inode, iblock, false, flags, &path);
+    if (ret)
+        return ret == -ENODATA ? 0 : ret;
+    index = SIMPLEFS_EXT_LEAF(&path);
+    if (!path.depth)
+        simplefs_ext_cache_fill(SIMPLEFS_SB(inode->i_sb), ci, index);
+    if (path.end != SIMPLEFS_EXT_END)
+        iomap->length = ((loff_t) path.end << bits) - iomap->offset;
 
-        for (i = first_ext; i < SIMPLEFS_MAX_EXTENTS; i++) {
-            if (!index->extents[i].ee_start)
-                break;
-            put_blocks(SIMPLEFS_SB(sb), index->extents[i].ee_start,
-                       index->extents[i].ee_len);
-            memset(&index->extents[i], 0, sizeof(struct simplefs_extent));
-        }
-        mark_buffer_dirty(bh_index);
-        brelse(bh_index);
+    extent = simplefs_ext_search(index, iblock);
+    if (extent == -1)
+        goto release;
+    ext = &index->extents[extent];
+    if (!ext->ee_start)
+        goto release;
+
+    if (iblock < ext->ee_block) {
+        iomap->length = (loff_t) (ext->ee_block - iblock) << bits;
+    } else {
+        if (ext->ee_flags & SIMPLEFS_EXT_UNWRITTEN)
+            iomap->type = IOMAP_UNWRITTEN;
+        else
+            iomap->type = IOMAP_MAPPED;
+        iomap->addr = (uint64_t) (ext->ee_start + iblock - ext->ee_block)
+                      << bits;
+        iomap->length = (loff_t) (ext->ee_block + ext->ee_len - iblock)
+                        << bits;
     }
-end:
+
+release:
+    simplefs_ext_release(&path);
     return ret;
 }
 
-/*
- * Called when a file is opened in the simplefs.
- * It checks the flags associated with the file opening mode (O_WRONLY, O_RDWR,
- * O_TRUNC) and performs truncation if the file is being opened for write or
- * read/write and the O_TRUNC flag is set.
- *
- * Truncation is achieved by reading the file's index block from disk, iterating
- * over the data block pointers, releasing the associated data blocks, and
- * updating the inode metadata (size and block count).
+/* Map the block of a file at 'pos' from its extent cache, as
+ * simplefs_iomap_lookup() does, without taking any lock.
+ * Return -ENODATA if the file has no extent cache.
  */
-static int simplefs_open(struct inode *inode, struct file *filp)
+static int simplefs_iomap_cached(struct inode *inode,
+                                 loff_t pos,
+                                 struct iomap *iomap)
 {
-    bool wronly = (filp->f_flags & O_WRONLY);
-    bool rdwr = (filp->f_flags & O_RDWR);
-    bool trunc = (filp->f_flags & O_TRUNC);
+    struct simplefs_extent ext;
+    unsigned int bits = inode->i_blkbits;
+    uint32_t iblock = pos >> bits;
+    int ret = simplefs_ext_cache_lookup(SIMPLEFS_INODE(inode), iblock, &ext);
 
-    if ((wronly || rdwr) && trunc && inode->i_size) {
-        struct buffer_head *bh_index;
-        struct simplefs_file_ei_block *ei_block;
-        sector_t iblock;
-
-        /* Fetch the file's extent block from disk */
-        bh_index = sb_bread(inode->i_sb, SIMPLEFS_INODE(inode)->ei_block);
-        if (!bh_index)
-            return -EIO;
-
-        ei_block = (struct simplefs_file_ei_block *) bh_index->b_data;
-
-        for (iblock = 0; iblock <= SIMPLEFS_MAX_EXTENTS &&
-                         ei_block->extents[iblock].ee_start;
-             iblock++) {
-            put_blocks(SIMPLEFS_SB(inode->i_sb),
-                       ei_block->extents[iblock].ee_start,
-                       ei_block->extents[iblock].ee_len);
-            memset(&ei_block->extents[iblock], 0,
-                   sizeof(struct simplefs_extent));
-        }
-        /* Update inode metadata */
-        inode->i_size = 0;
-        inode->i_blocks = 1;
+    if (ret)
+        return ret;
 
-        mark_buffer_dirty(bh_index);
-        brelse(bh_index);
-        mark_inode_dirty(inode);
+    iomap->bdev = inode->i_sb->s_bdev;
+    iomap->flags = 0;
+    iomap->offset = (loff_t) iblock << bits;
+    if (!ext.ee_start) {
+        iomap->type = IOMAP_HOLE;
+        iomap->addr = IOMAP_NULL_ADDR;
+        if (ext.ee_len)
+            iomap->length = (loff_t) ext.ee_len << bits;
+        else
+            iomap->length = SIMPLEFS_MAX_FILESIZE - iomap->offset;
+        return 0;
     }
+
+    if (ext.ee_flags & SIMPLEFS_EXT_UNWRITTEN)
+        iomap->type = IOMAP_UNWRITTEN;
+    else
+        iomap->type = IOMAP_MAPPED;
+    iomap->addr = (uint64_t) (ext.ee_start + iblock - ext.ee_block) << bits;
+    iomap->length = (loff_t) (ext.ee_block + ext.ee_len - iblock) << bits;
     return 0;
 }
 
-static ssize_t simplefs_read(struct file *file,
-                             char __user *buf,
-                             size_t len,
-                             loff_t *ppos)
+/* Report the mapping of a file at 'pos' as simplefs_iomap_lookup() does.
+ * Reads are mapped from the extent cache first, so that readahead over a
+ * contiguous file takes neither ext_lock nor the index block.
+ */
+static int simplefs_iomap_report(struct inode *inode,
+                                 loff_t pos,
+                                 loff_t length,
+                                 unsigned int flags,
+                                 struct iomap *iomap,
+                                 bool seek)
 {
-    struct inode *inode = file_inode(file);
-    struct super_block *sb = inode->i_sb;
-    ssize_t bytes_read = 0;
-    loff_t pos = *ppos;
+    struct simplefs_inode_info *ci = SIMPLEFS_INODE(inode);
+    int ret;
 
-    if (pos > inode->i_size)
+    if (!seek && pos < SIMPLEFS_MAX_FILESIZE &&
+        !simplefs_iomap_cached(inode, pos, iomap))
         return 0;
 
-    /* find extent block */
-    struct buffer_head *bh = sb_bread(sb, SIMPLEFS_INODE(inode)->ei_block);
-    struct simplefs_file_ei_block *ei_block =
-        (struct simplefs_file_ei_block *) bh->b_data;
-
-    if (pos + len > inode->i_size)
-        len = inode->i_size - pos;
-
-    /* count block position */
-    sector_t block_index = pos / SIMPLEFS_BLOCK_SIZE;
-    sector_t ei_index = block_index / SIMPLEFS_MAX_BLOCKS_PER_EXTENT;
-    sector_t block_offset = ei_block->extents[ei_index].ee_start +
-                            block_index % SIMPLEFS_MAX_BLOCKS_PER_EXTENT;
-
-    while (len > 0) {
-        struct buffer_head *bh_data = sb_bread(sb, block_offset);
-        if (!bh_data) {
-            pr_err("Failed to read data block %llu\n", block_offset);
-            bytes_read = -EIO;
-            break;
-        }
+    if (!(flags & IOMAP_NOWAIT))
+        down_read(&ci->ext_lock);
+    else if (!down_read_trylock(&ci->ext_lock))
+        return -EAGAIN;
+    ret = simplefs_iomap_lookup(inode, pos, length, flags, iomap, seek);
+    up_read(&ci->ext_lock);
+    return ret;
+}
 
-        size_t offset = pos % SIMPLEFS_BLOCK_SIZE;
-        size_t bytes_to_read =
-            min_t(size_t, len, SIMPLEFS_BLOCK_SIZE - pos % SIMPLEFS_BLOCK_SIZE);
-        if (copy_to_user(buf + bytes_read, bh_data->b_data + offset,
-                         bytes_to_read)) {
-            brelse(bh_data);
-            bytes_read = -EFAULT;
-            break;
-        }
-        brelse(bh_data);
+/* Map the blocks of a direct write from 'pos'. Holes are allocated as
+ * unwritten extents. Unwritten blocks are marked written once the data has
+ * reached them, by simplefs_dio_write_end_io(), so a crash in the middle of
+ * the write never exposes stale blocks.
+ */
+static int simplefs_iomap_write(struct inode *inode,
+                                loff_t pos,
+                                loff_t length,
+                                unsigned int flags,
+                                struct iomap *iomap)
+{
+    struct simplefs_sb_info *sbi = SIMPLEFS_SB(inode->i_sb);
+    struct simplefs_inode_info *ci = SIMPLEFS_INODE(inode);
+    struct simplefs_file_ei_block *index;
+    struct simplefs_extent *ext;
+    struct simplefs_ext_path path;
+    unsigned int bits = inode->i_blkbits;
+    uint32_t iblock = pos >> bits;
+    uint32_t last = DIV_ROUND_UP(pos + length, SIMPLEFS_BLOCK_SIZE);
+    uint32_t extent, want;
+    int ret;
+
+    if (!(flags & IOMAP_NOWAIT))
+        down_write(&ci->ext_lock);
+    else if (!down_write_trylock(&ci->ext_lock))
+        return -EAGAIN;
+    ret = simplefs_get_leaf(inode, iblock, true, flags, &path);
+    if (ret)
+        goto unlock;
+    index = SIMPLEFS_EXT_LEAF(&path);
 
-        /* successfully read data */
-        bytes_read += bytes_to_read;
-        len -= bytes_to_read;
-        pos += bytes_to_read;
+    extent = simplefs_ext_search(index, iblock);
+    ext = extent == -1 ? NULL : &index->extents[extent];
 
-        /* count extent block */
-        block_index++;
-        ei_index = block_index / SIMPLEFS_MAX_BLOCKS_PER_EXTENT;
-        block_offset = ei_block->extents[ei_index].ee_start +
-                       block_index % SIMPLEFS_MAX_BLOCKS_PER_EXTENT;
+    if (!ext || ext->ee_start == 0 || iblock < ext->ee_block) {
+        if (flags & IOMAP_NOWAIT) {
+            ret = -EAGAIN;
+            goto release;
+        }
+        if (simplefs_ext_count(index) == SIMPLEFS_MAX_EXTENTS) {
+            ret = simplefs_ext_make_room(inode, &path, iblock, 1);
+            if (ret)
+                goto release;
+            index = SIMPLEFS_EXT_LEAF(&path);
+            extent = simplefs_ext_search(index, iblock);
+            ext = &index->extents[extent];
+        }
+        want = min(last, path.end) - iblock;
+        if (ext->ee_start)
+            want = min(want, ext->ee_block - iblock);
+
+        /* Leave the blocks reserved by delayed allocation alone */
+        ret = reserve_blocks(sbi, want);
+        if (ret)
+            goto release;
+        simplefs_ext_cache_drop(sbi, ci);
+        ret = simplefs_ext_alloc(inode, &path, extent, iblock, want, false,
+                                 SIMPLEFS_EXT_UNWRITTEN);
+        unreserve_blocks(sbi, want);
+        if (ret < 0)
+            goto release;
+        ext = &index->extents[ret];
+        ret = 0;
+
+        mark_buffer_dirty_inode(path.bh[path.depth], inode);
+        iomap->flags |= IOMAP_F_NEW;
     }
 
-    brelse(bh);
-    *ppos = pos;
+    if (ext->ee_flags & SIMPLEFS_EXT_UNWRITTEN)
+        iomap->type = IOMAP_UNWRITTEN;
+    else
+        iomap->type = IOMAP_MAPPED;
+    iomap->bdev = inode->i_sb->s_bdev;
+    iomap->offset = (loff_t) iblock << bits;
+    iomap->addr = (uint64_t) (ext->ee_start + iblock - ext->ee_block) << bits;
+    iomap->length = (loff_t) (ext->ee_block + ext->ee_len - iblock) << bits;
+
+release:
+    simplefs_ext_release(&path);
+unlock:
+    up_write(&ci->ext_lock);
+    return ret;
+}
 
-    return bytes_read;
+static int simplefs_iomap_begin(struct inode *inode,
+                                loff_t pos,
+                                loff_t length,
+                                unsigned int flags,
+                                struct iomap *iomap,
+                                struct iomap *srcmap)
+{
+    if ((flags & IOMAP_DIRECT) && (flags & IOMAP_WRITE))
+        return simplefs_iomap_write(inode, pos, length, flags, iomap);
+    return simplefs_iomap_report(inode, pos, length, flags, iomap, false);
 }
 
-static ssize_t simplefs_write(struct file *file,
-                              const char __user *buf,
-                              size_t len,
-                              loff_t *ppos)
+/* Give back the blocks a direct write allocated but did not reach, when it
+ * stopped short. They were holes before.
+ */
+static int simplefs_iomap_end(struct inode *inode,
+                              loff_t pos,
+                              loff_t length,
+                              ssize_t written,
+                              unsigned int flags,
+                              struct iomap *iomap)
 {
-    struct inode *inode = file_inode(file);
-    struct super_block *sb = inode->i_sb;
-    ssize_t bytes_write = 0;
-    loff_t pos = *ppos;
+    unsigned int bits = inode->i_blkbits;
 
-    if (pos > inode->i_size)
+    if (!(flags & IOMAP_DIRECT) || !(flags & IOMAP_WRITE) ||
+        !(iomap->flags & IOMAP_F_NEW) || written >= length)
         return 0;
-    len = min_t(size_t, len, SIMPLEFS_MAX_FILESIZE - pos);
+    return simplefs_trim_range(
+        inode, DIV_ROUND_UP(pos + max_t(ssize_t, written, 0),
+                            SIMPLEFS_BLOCK_SIZE),
+        (iomap->offset + iomap->length) >> bits);
+}
 
-    /* find extent block */
-    struct buffer_head *bh = sb_bread(sb, SIMPLEFS_INODE(inode)->ei_block);
-    if (!bh)
-        return -EIO;
-    struct simplefs_file_ei_block *ei_block =
-        (struct simplefs_file_ei_block *) bh->b_data;
-
-    /* count block position */
-    sector_t block_index = pos / SIMPLEFS_BLOCK_SIZE;
-    sector_t ei_index = block_index / SIMPLEFS_MAX_BLOCKS_PER_EXTENT;
-
-    /* write data */
-    while (len > 0) {
-        /* check if block is allocated */
-        if (ei_block->extents[ei_index].ee_start == 0) {
-            int bno = get_free_blocks(sb, SIMPLEFS_MAX_BLOCKS_PER_EXTENT);
-            if (!bno) {
-                bytes_write = -ENOSPC;
-                break;
-            }
-            ei_block->extents[ei_index].ee_start = bno;
-            ei_block->extents[ei_index].ee_len = SIMPLEFS_MAX_BLOCKS_PER_EXTENT;
-            ei_block->extents[ei_index].ee_block =
-                ei_index ? ei_block->extents[ei_index - 1].ee_block +
-                               ei_block->extents[ei_index - 1].ee_len
-                         : 0;
-        }
+static int simplefs_seek_iomap_begin(struct inode *inode,
+                                     loff_t pos,
+                                     loff_t length,
+                                     unsigned int flags,
+                                     struct iomap *iomap,
+                                     struct iomap *srcmap)
+{
+    return simplefs_iomap_report(inode, pos, length, flags, iomap, true);
+}
 
-        struct buffer_head *bh_data =
-            sb_bread(sb, ei_block->extents[ei_index].ee_start +
-                             block_index % SIMPLEFS_MAX_BLOCKS_PER_EXTENT);
-        if (!bh_data) {
-            pr_err("Failed to read data block %llu\n",
-                   ei_block->extents[ei_index].ee_start +
-                       block_index % SIMPLEFS_MAX_BLOCKS_PER_EXTENT);
-            bytes_write = -EIO;
-            break;
-        }
-        /* copy data from buffer */
-        size_t bytes_to_write =
-            min_t(size_t, len, SIMPLEFS_BLOCK_SIZE - pos % SIMPLEFS_BLOCK_SIZE);
-
-        if (copy_from_user(bh_data->b_data + pos % SIMPLEFS_BLOCK_SIZE,
-                           buf + bytes_write, bytes_to_write)) {
-            brelse(bh_data);
-            bytes_write = -EFAULT;
-            break;
-        }
+static const struct iomap_ops simplefs_iomap_ops = {
+    .iomap_begin = simplefs_iomap_begin,
+    .iomap_end = simplefs_iomap_end,
+};
 
-        mark_buffer_dirty(bh_data);
-        sync_dirty_buffer(bh_data);
-        brelse(bh_data);
+static const struct iomap_ops simplefs_seek_iomap_ops = {
+    .iomap_begin = simplefs_seek_iomap_begin,
+};
 
-        /* successfully write data */
-        len = len - bytes_to_write;
-        bytes_write += bytes_to_write;
-        pos += bytes_to_write;
+/* Map the blocks of a buffered write from 'pos'. Blocks on disk are written
+ * in place and unwritten ones are marked written once written back. Holes are
+ * only reserved, one block at a time, and allocated by
+ * simplefs_map_writeback() once the whole dirty range of the file is known,
+ * so short-lived files never reach the bitmap.
+ */
+static int simplefs_buffered_write_begin(struct inode *inode,
+                                         loff_t pos,
+                                         loff_t length,
+                                         unsigned int flags,
+                                         struct iomap *iomap,
+                                         struct iomap *srcmap)
+{
+    struct simplefs_inode_info *ci = SIMPLEFS_INODE(inode);
+    struct buffer_head *bh_index;
+    unsigned int bits = inode->i_blkbits;
+    uint32_t first = pos >> bits, last;
+    int ret;
 
-        /* count extent block */
-        block_index = pos / SIMPLEFS_BLOCK_SIZE;
-        ei_index = block_index / SIMPLEFS_MAX_BLOCKS_PER_EXTENT;
+    /* The first data written to a file allocates its index, so that
+     * writeback never runs out of space for it.
+     */
+    if (!READ_ONCE(ci->ei_block)) {
+        if (flags & IOMAP_NOWAIT)
+            return -EAGAIN;
+        down_write(&ci->ext_lock);
+        ret = simplefs_get_index(inode, true, &bh_index);
+        up_write(&ci->ext_lock);
+        if (ret)
+            return ret;
+        brelse(bh_index);
     }
-    mark_buffer_dirty(bh);
-    sync_dirty_buffer(bh);
-    brelse(bh);
 
-    inode->i_size = max(pos, inode->i_size);
-    inode->i_blocks = DIV_ROUND_UP(inode->i_size, SIMPLEFS_BLOCK_SIZE) + 1;
-#if SIMPLEFS_AT_LEAST(6, 7, 0)
-    struct timespec64 cur_time = current_time(inode);
-    inode_set_mtime_to_ts(inode, cur_time);
-    inode_set_ctime_to_ts(inode, cur_time);
-#elif SIMPLEFS_AT_LEAST(6, 6, 0)
-    struct timespec64 cur_time = current_time(inode);
-    inode->i_mtime = cur_time;
-    inode_set_ctime_to_ts(inode, cur_time);
+    if (!(flags & IOMAP_NOWAIT))
+        down_read(&ci->ext_lock);
+    else if (!down_read_trylock(&ci->ext_lock))
+        return -EAGAIN;
+    ret = simplefs_iomap_lookup(inode, pos, length, flags, iomap, false);
+    if (ret || iomap->type != IOMAP_HOLE)
+        goto unlock;
+
+    last = DIV_ROUND_UP(min(pos + length, iomap->offset + iomap->length),
+                        SIMPLEFS_BLOCK_SIZE);
+    ret = simplefs_reserve_delayed(inode, first, last, flags);
+    if (ret)
+        goto unlock;
+    iomap->type = IOMAP_DELALLOC;
+    iomap->length = (loff_t) (last - first) << bits;
+
+unlock:
+    up_read(&ci->ext_lock);
+    return ret;
+}
+
+/* Settle the blocks reserved by simplefs_buffered_write_begin() once the data
+ * is copied. A short write gives back the blocks it did not reach.
+ */
+static int simplefs_buffered_write_end(struct inode *inode,
+                                       loff_t pos,
+                                       loff_t length,
+                                       ssize_t written,
+                                       unsigned int flags,
+                                       struct iomap *iomap)
+{
+    uint32_t first = pos >> inode->i_blkbits;
+    uint32_t done = first;
+
+    if (iomap->type != IOMAP_DELALLOC)
+        return 0;
+    if (written > 0)
+        done = DIV_ROUND_UP(pos + written, SIMPLEFS_BLOCK_SIZE);
+    simplefs_settle_delayed(inode, first, done,
+                            DIV_ROUND_UP(pos + length, SIMPLEFS_BLOCK_SIZE));
+    return 0;
+}
+
+static const struct iomap_ops simplefs_buffered_write_iomap_ops = {
+    .iomap_begin = simplefs_buffered_write_begin,
+    .iomap_end = simplefs_buffered_write_end,
+};
+
+/* Map the blocks of a file from 'offset' for writeback, 'len' bytes of dirty
+ * data at most. Delayed blocks get an unwritten extent now, covering as many
+ * of them as the dirty range and the leaf allow. Unwritten blocks are only
+ * marked written by simplefs_end_ioend() once the data is on disk, so a
+ * crash in the middle of writeback never exposes stale blocks. Holes without
+ * reservation hold no dirty data: they are reported as such and left out of
+ * the write.
+ */
+static int simplefs_map_writeback(struct inode *inode,
+                                  loff_t offset,
+                                  loff_t len,
+                                  struct iomap *iomap)
+{
+    struct super_block *sb = inode->i_sb;
+    struct simplefs_sb_info *sbi = SIMPLEFS_SB(sb);
+    struct simplefs_inode_info *ci = SIMPLEFS_INODE(inode);
+    struct simplefs_file_ei_block *index;
+    struct simplefs_extent *ext;
+    struct simplefs_ext_path path;
+    struct buffer_head *bh_index;
+    unsigned int bits = inode->i_blkbits;
+    uint32_t iblock = offset >> bits;
+    uint32_t last = DIV_ROUND_UP(offset + len, SIMPLEFS_BLOCK_SIZE);
+    unsigned long next = iblock;
+    uint32_t extent, want;
+    int ret;
+
+    iomap->bdev = sb->s_bdev;
+    iomap->type = IOMAP_HOLE;
+    iomap->addr = IOMAP_NULL_ADDR;
+    iomap->flags = 0;
+    iomap->offset = (loff_t) iblock << bits;
+    iomap->length = (loff_t) (last - iblock) << bits;
+
+    /* Delayed blocks have an index, allocated by the write that made them */
+    down_write(&ci->ext_lock);
+    ret = simplefs_get_index(inode, false, &bh_index);
+    if (ret || !bh_index)
+        goto unlock;
+    ret = simplefs_ext_find(sb, bh_index, iblock, &path);
+    if (ret)
+        goto unlock;
+    index = SIMPLEFS_EXT_LEAF(&path);
+
+    extent = simplefs_ext_search(index, iblock);
+    ext = extent == -1 ? NULL : &index->extents[extent];
+
+    if (!ext || ext->ee_start == 0 || iblock < ext->ee_block) {
+        last = min(last, path.end);
+        if (ext && ext->ee_start)
+            last = min(last, ext->ee_block);
+        want = simplefs_delayed_run(inode, iblock, last - iblock);
+        if (!want) {
+            if (xa_find(&ci->delayed, &next, last - 1, XA_PRESENT))
+                last = next;
+            iomap->length = (loff_t) (last - iblock) << bits;
+            goto release;
+        }
+
+        /* A full leaf is split to make room for the new extent */
+        if (simplefs_ext_count(index) == SIMPLEFS_MAX_EXTENTS) {
+            ret = simplefs_ext_make_room(inode, &path, iblock, 1);
+            if (ret)
+                goto release;
+            index = SIMPLEFS_EXT_LEAF(&path);
+            extent = simplefs_ext_search(index, iblock);
+            ext = &index->extents[extent];
+            want = min(want, path.end - iblock);
+        }
+
+        simplefs_ext_cache_drop(sbi, ci);
+        ret = simplefs_ext_alloc(inode, &path, extent, iblock, want, true,
+                                 SIMPLEFS_EXT_UNWRITTEN);
+        if (ret < 0)
+            goto release;
+        ext = &index->extents[ret];
+        ret = 0;
+
+        mark_buffer_dirty_inode(path.bh[path.depth], inode);
+        simplefs_drop_delayed(inode, iblock, ext->ee_block + ext->ee_len);
+    }
+
+    if (ext->ee_flags & SIMPLEFS_EXT_UNWRITTEN)
+        iomap->type = IOMAP_UNWRITTEN;
+    else
+        iomap->type = IOMAP_MAPPED;
+    iomap->addr = (uint64_t) (ext->ee_start + iblock - ext->ee_block) << bits;
+    iomap->length = (loff_t) (ext->ee_block + ext->ee_len - iblock) << bits;
+
+release:
+    simplefs_ext_release(&path);
+unlock:
+    up_write(&ci->ext_lock);
+    return ret;
+}
+
+/* The bio of an ioend is embedded in it from 6.8 on */
+#if SIMPLEFS_AT_LEAST(6, 8, 0)
+#define SIMPLEFS_IOEND_BIO(ioend) (&(ioend)->io_bio)
 #else
-    inode->i_mtime = inode->i_ctime = current_time(inode);
+#define SIMPLEFS_IOEND_BIO(ioend) ((ioend)->io_bio)
 #endif
-    mark_inode_dirty(inode);
-    *ppos = pos;
 
-    return bytes_write;
+/* Return true if 'ioend' writes to unwritten blocks */
+static bool simplefs_ioend_unwritten(struct iomap_ioend *ioend)
+{
+#if SIMPLEFS_AT_LEAST(6, 14, 0)
+    return ioend->io_flags & IOMAP_IOEND_UNWRITTEN;
+#else
+    return ioend->io_type == IOMAP_UNWRITTEN;
+#endif
+}
+
+/* Complete the writeback of 'ioend' to unwritten blocks: the blocks it wrote
+ * are marked written, then its folios leave writeback. If the write failed,
+ * the blocks stay unwritten and keep reading as zeroes.
+ */
+static void simplefs_end_ioend(struct iomap_ioend *ioend)
+{
+    struct inode *inode = ioend->io_inode;
+    int error = blk_status_to_errno(SIMPLEFS_IOEND_BIO(ioend)->bi_status);
+
+    if (!error)
+        error = simplefs_convert_unwritten(
+            inode, ioend->io_offset >> inode->i_blkbits,
+            DIV_ROUND_UP(ioend->io_offset + ioend->io_size,
+                         SIMPLEFS_BLOCK_SIZE));
+    iomap_finish_ioends(ioend, error);
+}
+
+/* Complete the ioends queued by simplefs_end_bio(), in process context since
+ * converting the blocks reads and allocates extent tree blocks
+ */
+static void simplefs_ioend_work(struct work_struct *work)
+{
+    struct simplefs_sb_info *sbi =
+        container_of(work, struct simplefs_sb_info, ioend_work);
+    struct iomap_ioend *ioend;
+    unsigned long flags;
+    LIST_HEAD(list);
+
+    spin_lock_irqsave(&sbi->ioend_lock, flags);
+    list_splice_init(&sbi->ioend_list, &list);
+    spin_unlock_irqrestore(&sbi->ioend_lock, flags);
+
+    while ((ioend = list_first_entry_or_null(&list, struct iomap_ioend,
+                                             io_list))) {
+        list_del_init(&ioend->io_list);
+        simplefs_end_ioend(ioend);
+        cond_resched();
+    }
+}
+
+/* Called when the bio of an ioend to unwritten blocks completes, possibly in
+ * interrupt context: the ioend is queued for simplefs_ioend_work().
+ */
+static void simplefs_end_bio(struct bio *bio)
+{
+#if SIMPLEFS_AT_LEAST(6, 8, 0)
+    struct iomap_ioend *ioend = container_of(bio, struct iomap_ioend, io_bio);
+#else
+    struct iomap_ioend *ioend = bio->bi_private;
+#endif
+    struct simplefs_sb_info *sbi = SIMPLEFS_SB(ioend->io_inode->i_sb);
+    unsigned long flags;
+
+    spin_lock_irqsave(&sbi->ioend_lock, flags);
+    list_add_tail(&ioend->io_list, &sbi->ioend_list);
+    spin_unlock_irqrestore(&sbi->ioend_lock, flags);
+    queue_work(sbi->ioend_wq, &sbi->ioend_work);
+}
+
+/* Set up the completion of the ioends of a file system */
+int simplefs_init_ioend(struct simplefs_sb_info *sbi)
+{
+    spin_lock_init(&sbi->ioend_lock);
+    INIT_LIST_HEAD(&sbi->ioend_list);
+    INIT_WORK(&sbi->ioend_work, simplefs_ioend_work);
+
+    /* Writeback may run to reclaim memory, its completion must not wait */
+    sbi->ioend_wq = alloc_workqueue("simplefs-ioend/%s", WQ_MEM_RECLAIM, 0,
+                                    sbi->sb->s_id);
+    return sbi->ioend_wq ? 0 : -ENOMEM;
+}
+
+/* Ioends to unwritten blocks complete through simplefs_end_bio(). The ioend
+ * is handed over to ->writeback_submit() from 6.17 on, to ->submit_ioend(),
+ * which submits it, from 6.14 on, and to ->prepare_ioend() before.
+ */
+#if SIMPLEFS_AT_LEAST(6, 17, 0)
+static ssize_t simplefs_writeback_range(struct iomap_writepage_ctx *wpc,
+                                        struct folio *folio,
+                                        u64 offset,
+                                        unsigned int len,
+                                        u64 end_pos)
+{
+    int ret = simplefs_map_writeback(wpc->inode, offset, len, &wpc->iomap);
+
+    if (ret)
+        return ret;
+    return iomap_add_to_ioend(wpc, folio, offset, end_pos, len);
+}
+
+static int simplefs_writeback_submit(struct iomap_writepage_ctx *wpc,
+                                     int error)
+{
+    struct iomap_ioend *ioend = wpc->wb_ctx;
+
+    if (ioend && simplefs_ioend_unwritten(ioend))
+        ioend->io_bio.bi_end_io = simplefs_end_bio;
+    return iomap_ioend_writeback_submit(wpc, error);
+}
+
+static const struct iomap_writeback_ops simplefs_writeback_ops = {
+    .writeback_range = simplefs_writeback_range,
+    .writeback_submit = simplefs_writeback_submit,
+};
+#else
+#if SIMPLEFS_AT_LEAST(6, 8, 0)
+static int simplefs_map_blocks(struct iomap_writepage_ctx *wpc,
+                               struct inode *inode,
+                               loff_t offset,
+                               unsigned int len)
+{
+    return simplefs_map_writeback(inode, offset, len, &wpc->iomap);
+}
+#else
+/* Older kernels do not pass the length of the dirty range: the dirty pages
+ * following 'offset' stand for it.
+ */
+static int simplefs_map_blocks(struct iomap_writepage_ctx *wpc,
+                               struct inode *inode,
+                               loff_t offset)
+{
+    uint32_t iblock = offset >> inode->i_blkbits;
+    uint32_t nr = simplefs_dirty_blocks(inode->i_mapping, iblock,
+                                        SIMPLEFS_MAX_BLOCKS_PER_EXTENT);
+
+    return simplefs_map_writeback(inode, offset,
+                                  (loff_t) nr << inode->i_blkbits,
+                                  &wpc->iomap);
+}
+#endif
+
+#if SIMPLEFS_AT_LEAST(6, 14, 0)
+static int simplefs_submit_ioend(struct iomap_writepage_ctx *wpc, int status)
+{
+    struct iomap_ioend *ioend = wpc->ioend;
+
+    if (simplefs_ioend_unwritten(ioend))
+        ioend->io_bio.bi_end_io = simplefs_end_bio;
+    if (status)
+        return status;
+    submit_bio(&ioend->io_bio);
+    return 0;
+}
+
+static const struct iomap_writeback_ops simplefs_writeback_ops = {
+    .map_blocks = simplefs_map_blocks,
+    .submit_ioend = simplefs_submit_ioend,
+};
+#else
+static int simplefs_prepare_ioend(struct iomap_ioend *ioend, int status)
+{
+    if (simplefs_ioend_unwritten(ioend))
+        SIMPLEFS_IOEND_BIO(ioend)->bi_end_io = simplefs_end_bio;
+    return status;
+}
+
+static const struct iomap_writeback_ops simplefs_writeback_ops = {
+    .map_blocks = simplefs_map_blocks,
+    .prepare_ioend = simplefs_prepare_ioend,
+};
+#endif
+#endif
+
+/* Called by the page cache to write dirty folios to the physical disk (when
+ * sync is called or when memory is needed). Delayed blocks are allocated by
+ * simplefs_map_writeback() as their range is written.
+ */
+static int simplefs_writepages(struct address_space *mapping,
+                               struct writeback_control *wbc)
+{
+#if SIMPLEFS_AT_LEAST(6, 17, 0)
+    struct iomap_writepage_ctx wpc = {
+        .inode = mapping->host,
+        .wbc = wbc,
+        .ops = &simplefs_writeback_ops,
+    };
+
+    return iomap_writepages(&wpc);
+#else
+    struct iomap_writepage_ctx wpc = {};
+
+    return iomap_writepages(mapping, wbc, &wpc, &simplefs_writeback_ops);
+#endif
+}
+
+/* Called by the page cache to read folios from the physical disk. Blocks are
+ * mapped by simplefs_iomap_report(), a whole extent at a time.
+ */
+#if SIMPLEFS_AT_LEAST(6, 19, 0)
+static int simplefs_read_folio(struct file *file, struct folio *folio)
+{
+    iomap_bio_read_folio(folio, &simplefs_iomap_ops);
+    return 0;
+}
+
+static void simplefs_readahead(struct readahead_control *rac)
+{
+    iomap_bio_readahead(rac, &simplefs_iomap_ops);
+}
+#elif SIMPLEFS_AT_LEAST(5, 19, 0)
+static int simplefs_read_folio(struct file *file, struct folio *folio)
+{
+    return iomap_read_folio(folio, &simplefs_iomap_ops);
+}
+
+static void simplefs_readahead(struct readahead_control *rac)
+{
+    iomap_readahead(rac, &simplefs_iomap_ops);
+}
+#else
+static int simplefs_readpage(struct file *file, struct page *page)
+{
+    return iomap_readpage(page, &simplefs_iomap_ops);
+}
+
+#if SIMPLEFS_AT_LEAST(5, 8, 0)
+static void simplefs_readahead(struct readahead_control *rac)
+{
+    iomap_readahead(rac, &simplefs_iomap_ops);
+}
+#endif
+#endif
+
+/*
+ * Called when a file is opened in the simplefs.
+ * It checks the flags associated with the file opening mode (O_WRONLY, O_RDWR,
+ * O_TRUNC) and performs truncation if the file is being opened for write or
+ * read/write and the O_TRUNC flag is set.
+ *
+ * Truncation is achieved by reading the file's index block from disk, walking
+ * its extent tree, releasing the associated data and index blocks, and
+ * updating the inode metadata (size and block count).
+ */
+static int simplefs_open(struct inode *inode, struct file *filp)
+{
+    bool wronly = (filp->f_flags & O_WRONLY);
+    bool rdwr = (filp->f_flags & O_RDWR);
+    bool trunc = (filp->f_flags & O_TRUNC);
+
+    if ((wronly || rdwr) && trunc && inode->i_size) {
+        struct simplefs_inode_info *ci = SIMPLEFS_INODE(inode);
+        struct buffer_head *bh_index;
+        int ret;
+
+        /* Drop cached pages first: they may map the blocks released below or
+         * hold delayed blocks whose reservation must be given back. Direct
+         * writes in flight must not land in the released blocks either.
+         */
+        inode_dio_wait(inode);
+        truncate_setsize(inode, 0);
+        simplefs_drop_delayed(inode, 0, U32_MAX);
+
+        down_write(&ci->ext_lock);
+        simplefs_ext_cache_drop(SIMPLEFS_SB(inode->i_sb), ci);
+
+        /* Fetch the file's extent block from disk, if it has one */
+        ret = simplefs_get_index(inode, false, &bh_index);
+        if (ret) {
+            up_write(&ci->ext_lock);
+            return ret;
+        }
+
+        if (bh_index) {
+            ret = simplefs_ext_truncate(inode, bh_index, 0);
+            brelse(bh_index);
+            if (ret) {
+                up_write(&ci->ext_lock);
+                return ret;
+            }
+        }
+
+        /* Update inode metadata */
+        inode->i_size = 0;
+        inode->i_blocks = !!ci->ei_block;
+        up_write(&ci->ext_lock);
+        mark_inode_dirty(inode);
+    }
+
+#if SIMPLEFS_AT_LEAST(5, 19, 0)
+    /* O_DIRECT goes through simplefs_file_read_iter/write_iter */
+    filp->f_mode |= FMODE_CAN_ODIRECT;
+#endif
+    return 0;
 }
 
 const struct address_space_operations simplefs_aops = {
 #if SIMPLEFS_AT_LEAST(5, 19, 0)
-    .readahead = simplefs_readahead,
+    .read_folio = simplefs_read_folio,
 #else
     .readpage = simplefs_readpage,
 #endif
-#if !SIMPLEFS_AT_LEAST(6, 15, 0)
-    .writepage = simplefs_writepage,
+#if SIMPLEFS_AT_LEAST(5, 8, 0)
+    .readahead = simplefs_readahead,
 #endif
-    .write_begin = simplefs_write_begin,
-    .write_end = simplefs_write_end,
+    .writepages = simplefs_writepages,
+#if SIMPLEFS_AT_LEAST(5, 18, 0)
+    .dirty_folio = iomap_dirty_folio,
+    .invalidate_folio = iomap_invalidate_folio,
+#else
+    .set_page_dirty = iomap_set_page_dirty,
+    .invalidatepage = iomap_invalidatepage,
+#endif
+#if SIMPLEFS_AT_LEAST(5, 19, 0)
+    .release_folio = iomap_release_folio,
+#else
+    .releasepage = iomap_releasepage,
+#endif
+#if SIMPLEFS_AT_LEAST(6, 0, 0)
+    .migrate_folio = filemap_migrate_folio,
+#else
+    .migratepage = iomap_migrate_page,
+#endif
+    .is_partially_uptodate = iomap_is_partially_uptodate,
+#if SIMPLEFS_AT_LEAST(6, 8, 0)
+    .error_remove_folio = generic_error_remove_folio,
+#else
+    .error_remove_page = generic_error_remove_page,
+#endif
+#if !SIMPLEFS_AT_LEAST(5, 19, 0)
+    .direct_IO = noop_direct_IO,
+#endif
+};
+
+/* Zero the bytes [from, to) of the file, which lie in a single block, through
+ * the page cache. Holes already read as zeroes, and their cached copy is
+ * cleared by truncate_pagecache_range(). Unwritten blocks are zeroed too:
+ * data under writeback may be about to land in them.
+ */
+static int simplefs_zero_partial(struct inode *inode, loff_t from, loff_t to)
+{
+    struct iomap iomap;
+#if SIMPLEFS_AT_LEAST(5, 19, 0)
+    struct folio *folio;
+#else
+    struct page *page;
+#endif
+    int ret;
+
+    if (from >= to)
+        return 0;
+
+    ret = simplefs_iomap_report(inode, from, to - from, 0, &iomap, false);
+    if (ret || iomap.type == IOMAP_HOLE)
+        return ret;
+
+#if SIMPLEFS_AT_LEAST(5, 19, 0)
+    folio = read_mapping_folio(inode->i_mapping, from >> PAGE_SHIFT, NULL);
+    if (IS_ERR(folio))
+        return PTR_ERR(folio);
+    folio_lock(folio);
+    folio_zero_range(folio, offset_in_folio(folio, from), to - from);
+    folio_mark_dirty(folio);
+    folio_unlock(folio);
+    folio_put(folio);
+#else
+    page = read_mapping_page(inode->i_mapping, from >> PAGE_SHIFT, NULL);
+    if (IS_ERR(page))
+        return PTR_ERR(page);
+    lock_page(page);
+    zero_user(page, offset_in_page(from), to - from);
+    set_page_dirty(page);
+    unlock_page(page);
+    put_page(page);
+#endif
+    return 0;
+}
+
+/* Store in '*count' how many blocks of [first, last) of the file are
+ * allocated, walking the leaves of 'path'.
+ * The caller must hold ext_lock.
+ */
+static int simplefs_mapped_blocks(struct inode *inode,
+                                  struct simplefs_ext_path *path,
+                                  uint32_t first,
+                                  uint32_t last,
+                                  uint32_t *count)
+{
+    struct simplefs_file_ei_block *index;
+    struct simplefs_extent *ext;
+    uint32_t iblock = first, pos, end;
+    int ret;
+
+    *count = 0;
+    while (iblock < last) {
+        ret = simplefs_ext_refind(inode->i_sb, path, iblock);
+        if (ret)
+            return ret;
+        index = SIMPLEFS_EXT_LEAF(path);
+        end = min(last, path->end);
+
+        pos = simplefs_ext_search(index, iblock);
+        for (; pos < SIMPLEFS_MAX_EXTENTS; pos++) {
+            ext = &index->extents[pos];
+            if (!ext->ee_start || ext->ee_block >= end)
+                break;
+            *count += min(end, ext->ee_block + ext->ee_len) -
+                      max(iblock, ext->ee_block);
+        }
+
+        if (path->end == SIMPLEFS_EXT_END)
+            break;
+        iblock = path->end;
+    }
+    return 0;
+}
+
+/* Allocate unwritten extents over the holes in the blocks [first, last) of
+ * the file, walking the leaves of 'path'. Blocks already allocated are left
+ * as they are. The holes are reserved up front, so that the blocks promised
+ * to delayed allocation are not taken, and -ENOSPC is returned before
+ * anything is allocated if they do not fit. The number of blocks allocated
+ * is added to '*count'.
+ * The caller must hold ext_lock for writing.
+ */
+static int simplefs_alloc_range(struct inode *inode,
+                                struct simplefs_ext_path *path,
+                                uint32_t first,
+                                uint32_t last,
+                                uint32_t *count)
+{
+    struct simplefs_sb_info *sbi = SIMPLEFS_SB(inode->i_sb);
+    struct simplefs_file_ei_block *index;
+    struct simplefs_extent *ext;
+    uint32_t iblock = first, pos, want, nr;
+    int ret;
+
+    /* Delayed blocks hold a reservation of their own already */
+    ret = simplefs_mapped_blocks(inode, path, first, last, &nr);
+    if (ret)
+        return ret;
+    nr = last - first - nr;
+    nr -= min(nr, simplefs_delayed_count(inode, first, last));
+    if (nr) {
+        ret = reserve_blocks(sbi, nr);
+        if (ret)
+            return ret;
+    }
+
+    while (iblock < last) {
+        if (iblock == first || iblock >= path->end) {
+            ret = simplefs_ext_refind(inode->i_sb, path, iblock);
+            if (ret)
+                goto unreserve;
+        }
+        index = SIMPLEFS_EXT_LEAF(path);
+
+        pos = simplefs_ext_search(index, iblock);
+        ext = pos == -1 ? NULL : &index->extents[pos];
+        if (ext && ext->ee_start && iblock >= ext->ee_block) {
+            iblock = ext->ee_block + ext->ee_len;
+            continue;
+        }
+
+        if (simplefs_ext_count(index) == SIMPLEFS_MAX_EXTENTS) {
+            ret = simplefs_ext_make_room(inode, path, iblock, 1);
+            if (ret)
+                goto unreserve;
+            index = SIMPLEFS_EXT_LEAF(path);
+            pos = simplefs_ext_search(index, iblock);
+            ext = &index->extents[pos];
+        }
+
+        want = min(last, path->end) - iblock;
+        if (ext->ee_start)
+            want = min(want, ext->ee_block - iblock);
+        ret = simplefs_ext_alloc(inode, path, pos, iblock, want, false,
+                                 SIMPLEFS_EXT_UNWRITTEN);
+        if (ret < 0)
+            goto unreserve;
+        mark_buffer_dirty_inode(path->bh[path->depth], inode);
+
+        /* Delayed data of the range is written to the new blocks instead */
+        ext = &index->extents[ret];
+        simplefs_drop_delayed(inode, iblock, ext->ee_block + ext->ee_len);
+        *count += ext->ee_block + ext->ee_len - iblock;
+        iblock = ext->ee_block + ext->ee_len;
+    }
+    ret = 0;
+
+unreserve:
+    if (nr)
+        unreserve_blocks(sbi, nr);
+    return ret;
+}
+
+/* Called by the VFS for fallocate(). Besides the default mode, which
+ * allocates unwritten extents reading as zeroes without any I/O, it supports
+ * FALLOC_FL_KEEP_SIZE, FALLOC_FL_PUNCH_HOLE which releases the blocks of the
+ * range, and FALLOC_FL_ZERO_RANGE which replaces them with unwritten ones.
+ * Partial blocks at both ends of a punched or zeroed range are zeroed through
+ * the page cache.
+ */
+static long simplefs_fallocate(struct file *file,
+                               int mode,
+                               loff_t offset,
+                               loff_t len)
+{
+    struct inode *inode = file_inode(file);
+    struct simplefs_inode_info *ci = SIMPLEFS_INODE(inode);
+    struct simplefs_ext_path path;
+    struct buffer_head *bh_index;
+    loff_t end = offset + len;
+    uint32_t freed = 0, allocated = 0;
+#if SIMPLEFS_AT_LEAST(6, 6, 0)
+    struct timespec64 cur_time;
+#endif
+    long ret = 0;
+
+    if (mode & ~(FALLOC_FL_KEEP_SIZE | FALLOC_FL_PUNCH_HOLE |
+                 FALLOC_FL_ZERO_RANGE))
+        return -EOPNOTSUPP;
+    if (end > SIMPLEFS_MAX_FILESIZE)
+        return -EFBIG;
+
+    inode_lock(inode);
+    inode_dio_wait(inode);
+
+    if (mode & (FALLOC_FL_PUNCH_HOLE | FALLOC_FL_ZERO_RANGE)) {
+        ret = simplefs_zero_partial(
+            inode, offset, min(end, round_up(offset, SIMPLEFS_BLOCK_SIZE)));
+        if (!ret && round_down(end, SIMPLEFS_BLOCK_SIZE) >=
+                        round_up(offset, SIMPLEFS_BLOCK_SIZE))
+            ret = simplefs_zero_partial(
+                inode, round_down(end, SIMPLEFS_BLOCK_SIZE), end);
+        if (ret)
+            goto unlock;
+    }
+
+    /* Page faults must not bring the pages back before the blocks change */
+#if SIMPLEFS_AT_LEAST(5, 15, 0)
+    filemap_invalidate_lock(inode->i_mapping);
+#endif
+    if (mode & (FALLOC_FL_PUNCH_HOLE | FALLOC_FL_ZERO_RANGE)) {
+        truncate_pagecache_range(inode, offset, end - 1);
+        simplefs_drop_delayed(inode, DIV_ROUND_UP(offset, SIMPLEFS_BLOCK_SIZE),
+                              end / SIMPLEFS_BLOCK_SIZE);
+    }
+
+    /* Punching holes in a file without index has nothing to do */
+    down_write(&ci->ext_lock);
+    allocated = !ci->ei_block;
+    ret = simplefs_get_index(inode, !(mode & FALLOC_FL_PUNCH_HOLE), &bh_index);
+    if (!ret && bh_index)
+        ret = simplefs_ext_find(inode->i_sb, bh_index,
+                                offset / SIMPLEFS_BLOCK_SIZE, &path);
+    if (ret || !bh_index) {
+        up_write(&ci->ext_lock);
+        goto unlock_mapping;
+    }
+    simplefs_ext_cache_drop(SIMPLEFS_SB(inode->i_sb), ci);
+
+    if (mode & (FALLOC_FL_PUNCH_HOLE | FALLOC_FL_ZERO_RANGE))
+        ret = simplefs_free_range(
+            inode, &path, DIV_ROUND_UP(offset, SIMPLEFS_BLOCK_SIZE),
+            end / SIMPLEFS_BLOCK_SIZE, &freed);
+    if (!ret && !(mode & FALLOC_FL_PUNCH_HOLE))
+        ret = simplefs_alloc_range(inode, &path, offset / SIMPLEFS_BLOCK_SIZE,
+                                   DIV_ROUND_UP(end, SIMPLEFS_BLOCK_SIZE),
+                                   &allocated);
+
+    simplefs_ext_release(&path);
+    up_write(&ci->ext_lock);
+
+    /* The index block counts too, and blocks changed even if the range was
+     * only partly done
+     */
+    inode->i_blocks += allocated;
+    inode->i_blocks -= min_t(blkcnt_t, inode->i_blocks, freed);
+    if (!ret && !(mode & FALLOC_FL_KEEP_SIZE) && end > inode->i_size)
+        i_size_write(inode, end);
+
+    /* Punching and zeroing change the data of the file */
+#if SIMPLEFS_AT_LEAST(6, 7, 0)
+    cur_time = inode_set_ctime_current(inode);
+    if (mode & (FALLOC_FL_PUNCH_HOLE | FALLOC_FL_ZERO_RANGE))
+        inode_set_mtime_to_ts(inode, cur_time);
+#elif SIMPLEFS_AT_LEAST(6, 6, 0)
+    cur_time = inode_set_ctime_current(inode);
+    if (mode & (FALLOC_FL_PUNCH_HOLE | FALLOC_FL_ZERO_RANGE))
+        inode->i_mtime = cur_time;
+#else
+    inode->i_ctime = current_time(inode);
+    if (mode & (FALLOC_FL_PUNCH_HOLE | FALLOC_FL_ZERO_RANGE))
+        inode->i_mtime = inode->i_ctime;
+#endif
+    mark_inode_dirty(inode);
+
+unlock_mapping:
+#if SIMPLEFS_AT_LEAST(5, 15, 0)
+    filemap_invalidate_unlock(inode->i_mapping);
+#endif
+unlock:
+    inode_unlock(inode);
+    return ret;
+}
+
+/* Find the first run of at least two extents, from slot '*pos' on, that can
+ * be merged into one: written, contiguous in the file and not longer than
+ * one extent together. Store its first slot in '*pos' and its length in
+ * '*len'.
+ * Return the number of extents in the run, or 0 if there is none.
+ */
+static uint32_t simplefs_defrag_find(struct simplefs_file_ei_block *index,
+                                     uint32_t *pos,
+                                     uint32_t *len)
+{
+    uint32_t count = simplefs_ext_count(index);
+    uint32_t i, n, total;
+
+    for (i = *pos; i + 1 < count; i++) {
+        struct simplefs_extent *ext = &index->extents[i];
+
+        if (ext->ee_flags & SIMPLEFS_EXT_UNWRITTEN)
+            continue;
+
+        total = ext->ee_len;
+        for (n = 1; i + n < count; n++) {
+            struct simplefs_extent *prev = &index->extents[i + n - 1];
+            struct simplefs_extent *next = &index->extents[i + n];
+
+            if ((next->ee_flags & SIMPLEFS_EXT_UNWRITTEN) ||
+                next->ee_block != prev->ee_block + prev->ee_len ||
+                total + next->ee_len > SIMPLEFS_MAX_BLOCKS_PER_EXTENT)
+                break;
+            total += next->ee_len;
+        }
+        if (n > 1) {
+            *pos = i;
+            *len = total;
+            return n;
+        }
+    }
+    return 0;
+}
+
+/* Copy the 'iblock'-th block of the file to block 'bno' on disk. The data is
+ * read through the page cache; read_mapping_page() reads the page from disk
+ * if it is not cached yet. The dirty buffer of 'bno' is returned in '*bh'.
+ */
+static int simplefs_defrag_copy(struct inode *inode,
+                                uint32_t iblock,
+                                uint32_t bno,
+                                struct buffer_head **bh)
+{
+    loff_t pos = (loff_t) iblock << inode->i_blkbits;
+    struct page *page;
+    char *data;
+
+    page = read_mapping_page(inode->i_mapping, pos >> PAGE_SHIFT, NULL);
+    if (IS_ERR(page))
+        return PTR_ERR(page);
+
+    *bh = sb_getblk(inode->i_sb, bno);
+    if (!*bh) {
+        put_page(page);
+        return -ENOMEM;
+    }
+
+    lock_buffer(*bh);
+    data = kmap(page);
+    memcpy((*bh)->b_data, data + offset_in_page(pos), SIMPLEFS_BLOCK_SIZE);
+    kunmap(page);
+    set_buffer_uptodate(*bh);
+    unlock_buffer(*bh);
+    mark_buffer_dirty(*bh);
+    put_page(page);
+    return 0;
+}
+
+/* Copy the 'len' blocks of the file from 'iblock' to the blocks from 'bno' on
+ * disk, and write them out, a batch of buffers at a time. Only these buffers
+ * are written, not the rest of the block device.
+ */
+static int simplefs_defrag_write(struct inode *inode,
+                                 uint32_t iblock,
+                                 uint32_t bno,
+                                 uint32_t len)
+{
+    struct buffer_head *bhs[SIMPLEFS_SYNC_BATCH];
+    uint32_t i, nr = 0;
+    int ret;
+
+    for (i = 0; i < len; i++) {
+        ret = simplefs_defrag_copy(inode, iblock + i, bno + i, &bhs[nr]);
+        if (ret) {
+            /* The blocks are given back, their buffers must not be written */
+            while (nr--)
+                bforget(bhs[nr]);
+            return ret;
+        }
+        if (++nr == SIMPLEFS_SYNC_BATCH || i + 1 == len) {
+            ret = simplefs_write_batch(bhs, nr);
+            if (ret)
+                return ret;
+            nr = 0;
+        }
+    }
+    return 0;
+}
+
+/* Move the 'n' extents saved in 'old', found at slot 'pos' of their leaf and
+ * covering 'len' blocks, into a single new extent. The data is copied and
+ * written out first, then the leaf is updated and written in one block
+ * write, so the file points either to all old or to all new blocks on disk.
+ * The old blocks are only freed once the page cache no longer maps them.
+ * The invalidate lock keeps page faults and readahead from bringing pages of
+ * the old blocks back in the meantime.
+ * Return 0, -ENOSPC if there is no free run long enough, -EBUSY if the
+ * extents changed meanwhile, or another error.
+ */
+static int simplefs_defrag_move(struct inode *inode,
+                                const struct simplefs_extent *old,
+                                uint32_t n,
+                                uint32_t pos,
+                                uint32_t len)
+{
+    struct super_block *sb = inode->i_sb;
+    struct simplefs_sb_info *sbi = SIMPLEFS_SB(sb);
+    struct simplefs_inode_info *ci = SIMPLEFS_INODE(inode);
+    struct simplefs_file_ei_block *index;
+    struct simplefs_ext_path path;
+    struct buffer_head *bh_index;
+    uint32_t bno, i;
+    loff_t start;
+    int ret;
+
+    /* Both copies exist until the move is committed */
+    ret = reserve_blocks(sbi, len);
+    if (ret)
+        return ret;
+    bno = get_free_blocks(sb, old[0].ee_start, len);
+    if (!bno) {
+        ret = -ENOSPC;
+        goto unreserve;
+    }
+
+#if SIMPLEFS_AT_LEAST(5, 15, 0)
+    filemap_invalidate_lock(inode->i_mapping);
+#endif
+    ret = simplefs_defrag_write(inode, old[0].ee_block, bno, len);
+    if (ret)
+        goto put_new;
+
+    down_write(&ci->ext_lock);
+    ret = simplefs_get_index(inode, false, &bh_index);
+    if (!ret && !bh_index)
+        ret = -EBUSY;
+    if (!ret)
+        ret = simplefs_ext_find(sb, bh_index, old[0].ee_block, &path);
+    if (ret)
+        goto unlock;
+    index = SIMPLEFS_EXT_LEAF(&path);
+    if (memcmp(&index->extents[pos], old, n * sizeof(*old))) {
+        ret = -EBUSY;
+        goto release;
+    }
+
+    simplefs_ext_cache_drop(sbi, ci);
+    index->extents[pos].ee_len = len;
+    index->extents[pos].ee_start = bno;
+    for (i = 1; i < n; i++)
+        simplefs_ext_remove(index, pos + 1);
+    mark_buffer_dirty_inode(path.bh[path.depth], inode);
+    ret = sync_dirty_buffer(path.bh[path.depth]);
+    simplefs_ext_release(&path);
+    up_write(&ci->ext_lock);
+
+    /* The index may not have reached the disk: keep the old blocks */
+    if (ret)
+        goto unlock_mapping;
+
+    /* Cached pages still map the old blocks, they are clean */
+    start = (loff_t) old[0].ee_block << inode->i_blkbits;
+    truncate_pagecache_range(inode, start,
+                             start + ((loff_t) len << inode->i_blkbits) - 1);
+#if SIMPLEFS_AT_LEAST(5, 15, 0)
+    filemap_invalidate_unlock(inode->i_mapping);
+#endif
+    for (i = 0; i < n; i++)
+        put_blocks(sbi, old[i].ee_start, old[i].ee_len);
+    unreserve_blocks(sbi, len);
+    return 0;
+
+release:
+    simplefs_ext_release(&path);
+unlock:
+    up_write(&ci->ext_lock);
+put_new:
+    put_blocks(sbi, bno, len);
+unlock_mapping:
+#if SIMPLEFS_AT_LEAST(5, 15, 0)
+    filemap_invalidate_unlock(inode->i_mapping);
+#endif
+unreserve:
+    unreserve_blocks(sbi, len);
+    return ret;
+}
+
+/* Relocate the data of a regular file into as few extents as possible
+ * (SIMPLEFS_IOC_DEFRAG). Runs of extents contiguous in the file are moved
+ * one at a time into a free run long enough for all of them, going through
+ * the leaves of the extent tree in file order. Runs that do not fit anywhere
+ * are left alone, and runs never span two leaves.
+ * The inode lock keeps writers, truncation and fallocate() away. Readers go
+ * on through the page cache, which holds the same data before and after each
+ * move. Writable mappings could change pages under the copy: files mapped for
+ * writing are refused, and new writable mappings are denied until the end.
+ */
+int simplefs_defrag_file(struct file *file, struct simplefs_defrag_info *info)
+{
+    struct inode *inode = file_inode(file);
+    struct simplefs_inode_info *ci = SIMPLEFS_INODE(inode);
+    struct simplefs_extent *old;
+    struct simplefs_file_ei_block *index;
+    struct simplefs_ext_path path;
+    struct buffer_head *bh_index;
+    uint32_t iblock = 0, pos = 0, n, len, end;
+    int ret;
+
+    memset(info, 0, sizeof(*info));
+    if (!S_ISREG(inode->i_mode))
+        return -EINVAL;
+
+    old = kmalloc_array(SIMPLEFS_MAX_EXTENTS, sizeof(*old), GFP_KERNEL);
+    if (!old)
+        return -ENOMEM;
+
+    inode_lock(inode);
+    inode_dio_wait(inode);
+    if (mapping_deny_writable(inode->i_mapping)) {
+        ret = -EBUSY;
+        goto unlock;
+    }
+
+    /* Allocate all delayed blocks, and leave no window behind */
+    ret = filemap_write_and_wait(inode->i_mapping);
+    if (ret)
+        goto allow;
+    put_prealloc(SIMPLEFS_SB(inode->i_sb), ci);
+
+    for (;;) {
+        down_read(&ci->ext_lock);
+        ret = simplefs_get_index(inode, false, &bh_index);
+        if (!ret && bh_index)
+            ret = simplefs_ext_find(inode->i_sb, bh_index, iblock, &path);
+        if (ret || !bh_index) {
+            up_read(&ci->ext_lock);
+            break;
+        }
+        index = SIMPLEFS_EXT_LEAF(&path);
+
+        /* Count the extents of each leaf when entering and leaving it */
+        if (!pos)
+            info->nr_extents_before += simplefs_ext_count(index);
+        n = simplefs_defrag_find(index, &pos, &len);
+        memcpy(old, &index->extents[pos], n * sizeof(*old));
+        if (!n)
+            info->nr_extents_after += simplefs_ext_count(index);
+        end = path.end;
+        simplefs_ext_release(&path);
+        up_read(&ci->ext_lock);
+
+        if (!n) {
+            if (end == SIMPLEFS_EXT_END)
+                break;
+            iblock = end;
+            pos = 0;
+        } else {
+            ret = simplefs_defrag_move(inode, old, n, pos, len);
+            if (!ret) {
+                info->nr_blocks_moved += len;
+            } else if (ret != -ENOSPC && ret != -EBUSY) {
+                break;
+            }
+            ret = 0;
+            pos++;
+        }
+
+        if (fatal_signal_pending(current)) {
+            ret = -EINTR;
+            break;
+        }
+        cond_resched();
+    }
+
+allow:
+    mapping_allow_writable(inode->i_mapping);
+unlock:
+    inode_unlock(inode);
+    kfree(old);
+    return ret;
+}
+
+/* Called when the last reference to an open file is dropped. The last writer
+ * gives the unused preallocation window of the file back.
+ */
+static int simplefs_release(struct inode *inode, struct file *filp)
+{
+    if ((filp->f_mode & FMODE_WRITE) &&
+        atomic_read(&inode->i_writecount) == 1)
+        put_prealloc(SIMPLEFS_SB(inode->i_sb), SIMPLEFS_INODE(inode));
+    return 0;
+}
+
+/* Called by the VFS for fsync() and fdatasync(). Writing the data back
+ * allocates its blocks, which changes the index and the nodes of the extent
+ * tree. These blocks are attached to the inode when dirtied, and written
+ * before the inode and the cache flush of generic_file_fsync().
+ */
+static int simplefs_fsync(struct file *file,
+                          loff_t start,
+                          loff_t end,
+                          int datasync)
+{
+    int ret = file_write_and_wait_range(file, start, end);
+
+    if (ret)
+        return ret;
+    ret = sync_mapping_buffers(file->f_mapping);
+    if (ret)
+        return ret;
+    return generic_file_fsync(file, start, end, datasync);
+}
+
+/* Complete a direct write: mark the unwritten blocks it filled as written,
+ * then grow the file if the write went past its end. A failed write gives
+ * back the blocks it allocated past the end of the file, which nothing
+ * would release before the file is truncated.
+ */
+static int simplefs_dio_write_end_io(struct kiocb *iocb,
+                                     ssize_t size,
+                                     int error,
+                                     unsigned int flags)
+{
+    struct inode *inode = file_inode(iocb->ki_filp);
+    uint32_t first = iocb->ki_pos / SIMPLEFS_BLOCK_SIZE;
+    loff_t end = iocb->ki_pos + size;
+    int ret;
+
+    if (error) {
+        first = max_t(loff_t, first, DIV_ROUND_UP(i_size_read(inode),
+                                                  SIMPLEFS_BLOCK_SIZE));
+        simplefs_trim_range(inode, first,
+                            DIV_ROUND_UP(end, SIMPLEFS_BLOCK_SIZE));
+        return error;
+    }
+    if (!size)
+        return 0;
+
+    if (flags & IOMAP_DIO_UNWRITTEN) {
+        ret = simplefs_convert_unwritten(
+            inode, first, DIV_ROUND_UP(end, SIMPLEFS_BLOCK_SIZE));
+        if (ret)
+            return ret;
+    }
+
+    if (end > i_size_read(inode)) {
+        i_size_write(inode, end);
+        inode->i_blocks = DIV_ROUND_UP(end, SIMPLEFS_BLOCK_SIZE) + 1;
+        mark_inode_dirty(inode);
+    }
+    return 0;
+}
+
+static const struct iomap_dio_ops simplefs_dio_write_ops = {
+    .end_io = simplefs_dio_write_end_io,
+};
+
+static ssize_t simplefs_dio_rw(struct kiocb *iocb,
+                               struct iov_iter *iter,
+                               const struct iomap_dio_ops *dops)
+{
+#if SIMPLEFS_AT_LEAST(6, 0, 0)
+    return iomap_dio_rw(iocb, iter, &simplefs_iomap_ops, dops, 0, NULL, 0);
+#elif SIMPLEFS_AT_LEAST(5, 16, 0)
+    return iomap_dio_rw(iocb, iter, &simplefs_iomap_ops, dops, 0, 0);
+#elif SIMPLEFS_AT_LEAST(5, 12, 0)
+    return iomap_dio_rw(iocb, iter, &simplefs_iomap_ops, dops, 0);
+#else
+    return iomap_dio_rw(iocb, iter, &simplefs_iomap_ops, dops,
+                        is_sync_kiocb(iocb));
+#endif
+}
+
+/* Read a file, straight from its blocks for O_DIRECT. Dirty pages of the
+ * range are written back first by iomap_dio_rw().
+ */
+static ssize_t simplefs_file_read_iter(struct kiocb *iocb, struct iov_iter *to)
+{
+    struct inode *inode = file_inode(iocb->ki_filp);
+    ssize_t ret;
+
+    if (!(iocb->ki_flags & IOCB_DIRECT))
+        return generic_file_read_iter(iocb, to);
+    if (!iov_iter_count(to))
+        return 0;
+
+    if (!(iocb->ki_flags & IOCB_NOWAIT))
+        inode_lock_shared(inode);
+    else if (!inode_trylock_shared(inode))
+        return -EAGAIN;
+    ret = simplefs_dio_rw(iocb, to, NULL);
+    inode_unlock_shared(inode);
+
+    file_accessed(iocb->ki_filp);
+    return ret;
+}
+
+/* Write a file through the page cache. Holes only get a reservation here,
+ * their blocks are allocated at writeback.
+ */
+static ssize_t simplefs_buffered_write(struct kiocb *iocb,
+                                       struct iov_iter *from)
+{
+    struct file *file = iocb->ki_filp;
+    struct inode *inode = file_inode(file);
+    loff_t pos, size;
+    ssize_t ret;
+
+    if (!(iocb->ki_flags & IOCB_NOWAIT))
+        inode_lock(inode);
+    else if (!inode_trylock(inode))
+        return -EAGAIN;
+
+    ret = generic_write_checks(iocb, from);
+    if (ret <= 0)
+        goto unlock;
+    ret = file_remove_privs(file);
+    if (ret)
+        goto unlock;
+    ret = file_update_time(file);
+    if (ret)
+        goto unlock;
+
+    pos = iocb->ki_pos;
+    size = i_size_read(inode);
+#if SIMPLEFS_AT_LEAST(6, 17, 0)
+    ret = iomap_file_buffered_write(iocb, from,
+                                    &simplefs_buffered_write_iomap_ops, NULL,
+                                    NULL);
+#elif SIMPLEFS_AT_LEAST(6, 13, 0)
+    ret = iomap_file_buffered_write(iocb, from,
+                                    &simplefs_buffered_write_iomap_ops, NULL);
+#else
+    ret = iomap_file_buffered_write(iocb, from,
+                                    &simplefs_buffered_write_iomap_ops);
+#endif
+    /* Older kernels leave the file position to the caller */
+    if (ret > 0 && iocb->ki_pos == pos)
+        iocb->ki_pos += ret;
+
+    if (i_size_read(inode) > size) {
+        inode->i_blocks =
+            DIV_ROUND_UP(i_size_read(inode), SIMPLEFS_BLOCK_SIZE) + 1;
+        mark_inode_dirty(inode);
+    }
+
+unlock:
+    inode_unlock(inode);
+    if (ret > 0)
+        ret = generic_write_sync(iocb, ret);
+    return ret;
+}
+
+/* Write a file, straight to its blocks for O_DIRECT. iomap_dio_rw() writes
+ * back and drops the cached pages of the range around the write. A write
+ * growing the file is waited for under the inode lock, so that the file size
+ * is only ever updated under it. When the cached pages cannot be dropped,
+ * the data goes through the page cache and is written back right away.
+ */
+static ssize_t simplefs_file_write_iter(struct kiocb *iocb,
+                                        struct iov_iter *from)
+{
+    struct file *file = iocb->ki_filp;
+    struct inode *inode = file_inode(file);
+    loff_t pos = iocb->ki_pos;
+    bool extend;
+    ssize_t ret;
+
+    if (!(iocb->ki_flags & IOCB_DIRECT))
+        return simplefs_buffered_write(iocb, from);
+
+    if (!(iocb->ki_flags & IOCB_NOWAIT))
+        inode_lock(inode);
+    else if (!inode_trylock(inode))
+        return -EAGAIN;
+
+    ret = generic_write_checks(iocb, from);
+    if (ret <= 0)
+        goto unlock;
+    ret = file_remove_privs(file);
+    if (ret)
+        goto unlock;
+    ret = file_update_time(file);
+    if (ret)
+        goto unlock;
+
+    pos = iocb->ki_pos;
+    extend = pos + iov_iter_count(from) > i_size_read(inode);
+    ret = simplefs_dio_rw(iocb, from, &simplefs_dio_write_ops);
+    if (extend)
+        inode_dio_wait(inode);
+
+unlock:
+    inode_unlock(inode);
+    if (ret != -ENOTBLK)
+        return ret;
+
+    iocb->ki_flags &= ~IOCB_DIRECT;
+    ret = simplefs_buffered_write(iocb, from);
+    if (ret > 0 &&
+        filemap_write_and_wait_range(file->f_mapping, pos, pos + ret - 1))
+        return -EIO;
+    return ret;
+}
+
+/* List the extents of a file (FS_IOC_FIEMAP) */
+static int simplefs_fiemap(struct inode *inode,
+                           struct fiemap_extent_info *fieinfo,
+                           u64 start,
+                           u64 len)
+{
+    int ret;
+
+    inode_lock_shared(inode);
+    len = min_t(u64, len, i_size_read(inode));
+    ret = iomap_fiemap(inode, fieinfo, start, len, &simplefs_iomap_ops);
+    inode_unlock_shared(inode);
+    return ret;
+}
+
+/* Find the holes and data of a sparse file for SEEK_HOLE and SEEK_DATA */
+static loff_t simplefs_llseek(struct file *file, loff_t offset, int whence)
+{
+    struct inode *inode = file->f_mapping->host;
+
+    switch (whence) {
+    case SEEK_HOLE:
+        inode_lock_shared(inode);
+        offset = iomap_seek_hole(inode, offset, &simplefs_seek_iomap_ops);
+        inode_unlock_shared(inode);
+        break;
+    case SEEK_DATA:
+        inode_lock_shared(inode);
+        offset = iomap_seek_data(inode, offset, &simplefs_seek_iomap_ops);
+        inode_unlock_shared(inode);
+        break;
+    default:
+        return generic_file_llseek(file, offset, whence);
+    }
+    if (offset < 0)
+        return offset;
+    return vfs_setpos(file, offset, inode->i_sb->s_maxbytes);
+}
+
+/* Shrink a file to 'size' bytes. The end of the new last block is zeroed, so
+ * that growing the file again does not expose the old data. The delayed
+ * blocks past the new end give their reservation back, and the allocated
+ * ones are released.
+ * The caller must hold the inode lock.
+ */
+static int simplefs_shrink(struct inode *inode, loff_t size)
+{
+    struct simplefs_inode_info *ci = SIMPLEFS_INODE(inode);
+    struct buffer_head *bh_index;
+    uint32_t first = DIV_ROUND_UP(size, SIMPLEFS_BLOCK_SIZE);
+    int ret;
+
+    inode_dio_wait(inode);
+    ret = simplefs_zero_partial(
+        inode, size,
+        min_t(loff_t, i_size_read(inode), round_up(size, SIMPLEFS_BLOCK_SIZE)));
+    if (ret)
+        return ret;
+
+#if SIMPLEFS_AT_LEAST(5, 15, 0)
+    filemap_invalidate_lock(inode->i_mapping);
+#endif
+    truncate_setsize(inode, size);
+    simplefs_drop_delayed(inode, first, U32_MAX);
+
+    down_write(&ci->ext_lock);
+    simplefs_ext_cache_drop(SIMPLEFS_SB(inode->i_sb), ci);
+    ret = simplefs_get_index(inode, false, &bh_index);
+    if (!ret && bh_index) {
+        ret = simplefs_ext_truncate(inode, bh_index, first);
+        brelse(bh_index);
+    }
+    inode->i_blocks = min_t(blkcnt_t, inode->i_blocks, first + !!ci->ei_block);
+    up_write(&ci->ext_lock);
+#if SIMPLEFS_AT_LEAST(5, 15, 0)
+    filemap_invalidate_unlock(inode->i_mapping);
+#endif
+    mark_inode_dirty(inode);
+    return ret;
+}
+
+/* Called by the VFS to change the attributes of a file, truncate() and
+ * ftruncate() included. Growing a file only moves its end, shrinking it
+ * releases its blocks past the new end.
+ */
+#if SIMPLEFS_AT_LEAST(6, 3, 0)
+static int simplefs_setattr(struct mnt_idmap *id,
+                            struct dentry *dentry,
+                            struct iattr *iattr)
+#elif SIMPLEFS_AT_LEAST(5, 12, 0)
+static int simplefs_setattr(struct user_namespace *ns,
+                            struct dentry *dentry,
+                            struct iattr *iattr)
+#else
+static int simplefs_setattr(struct dentry *dentry, struct iattr *iattr)
+#endif
+{
+    struct inode *inode = d_inode(dentry);
+    int ret;
+
+#if SIMPLEFS_AT_LEAST(6, 3, 0)
+    ret = setattr_prepare(id, dentry, iattr);
+#elif SIMPLEFS_AT_LEAST(5, 12, 0)
+    ret = setattr_prepare(ns, dentry, iattr);
+#else
+    ret = setattr_prepare(dentry, iattr);
+#endif
+    if (ret)
+        return ret;
+
+    if ((iattr->ia_valid & ATTR_SIZE) && iattr->ia_size != i_size_read(inode)) {
+        if (iattr->ia_size < i_size_read(inode))
+            ret = simplefs_shrink(inode, iattr->ia_size);
+        else
+            truncate_setsize(inode, iattr->ia_size);
+        if (ret)
+            return ret;
+    }
+
+#if SIMPLEFS_AT_LEAST(6, 3, 0)
+    setattr_copy(id, inode, iattr);
+#elif SIMPLEFS_AT_LEAST(5, 12, 0)
+    setattr_copy(ns, inode, iattr);
+#else
+    setattr_copy(inode, iattr);
+#endif
+    mark_inode_dirty(inode);
+    return 0;
+}
+
+const struct inode_operations simplefs_file_inode_ops = {
+    .setattr = simplefs_setattr,
+    .fiemap = simplefs_fiemap,
 };
 
 const struct file_operations simplefs_file_ops = {
     .owner = THIS_MODULE,
     .open = simplefs_open,
-    .read = simplefs_read,
-    .write = simplefs_write,
-    .llseek = generic_file_llseek,
-    .fsync = generic_file_fsync,
+    .release = simplefs_release,
+    .fallocate = simplefs_fallocate,
+    .unlocked_ioctl = simplefs_ioctl,
+    .read_iter = simplefs_file_read_iter,
+    .write_iter = simplefs_file_write_iter,
+    .llseek = simplefs_llseek,
+    .fsync = simplefs_fsync,
 };
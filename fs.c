@@ -103,6 +103,8 @@ static int __init simplefs_init(void)
         goto err_inode;
     }
 
+    simplefs_init_proc();
+
     pr_info("module loaded\n");
     return 0;
 
@@ -120,6 +122,7 @@ static void __exit simplefs_exit(void)
     if (ret)
         pr_err("Failed to unregister file system\n");
 
+    simplefs_exit_proc();
     simplefs_destroy_inode_cache();
     /* Only after rcu_barrier() is the memory guaranteed to be freed. */
     rcu_barrier();
@@ -4,6 +4,7 @@
 #include <linux/fs.h>
 #include <linux/kernel.h>
 #include <linux/module.h>
+#include <linux/pagemap.h>
 
 #include "bitmap.h"
 #include "simplefs.h"
@@ -22,6 +23,70 @@ static const struct inode_operations symlink_inode_ops;
         brelse(bh);             \
         bh = NULL;              \
     } while (0)
+/* Allocate a new inode chunk near block 'goal', built zeroed in the buffer
+ * cache. Return its first block, or 0 on failure.
+ */
+static uint32_t simplefs_new_chunk(struct super_block *sb, uint32_t goal)
+{
+    struct buffer_head *bh;
+    uint32_t bno, i;
+
+    bno = get_meta_blocks(sb, goal, SIMPLEFS_INODE_CHUNK_BLOCKS);
+    if (!bno)
+        return 0;
+
+    for (i = 0; i < SIMPLEFS_INODE_CHUNK_BLOCKS; i++) {
+        bh = get_zeroed_block(sb, bno + i);
+        if (!bh) {
+            put_blocks(SIMPLEFS_SB(sb), bno, SIMPLEFS_INODE_CHUNK_BLOCKS);
+            return 0;
+        }
+        brelse(bh);
+    }
+    return bno;
+}
+
+/* Return the inode store block holding inode 'ino'. If the chunk of 'ino' is
+ * not allocated yet and 'create' is set, it is allocated after the previous
+ * chunk.
+ * Return 0 if the chunk is not allocated or on failure.
+ */
+uint32_t simplefs_inode_block(struct super_block *sb, uint32_t ino, bool create)
+{
+    struct simplefs_sb_info *sbi = SIMPLEFS_SB(sb);
+    uint32_t chunk = ino / SIMPLEFS_INODES_PER_CHUNK;
+    uint32_t idx = chunk % SIMPLEFS_CHUNKS_PER_BLOCK;
+    struct buffer_head *bh;
+    uint32_t *map, bno;
+
+    bh = sb_bread(sb, 1 + chunk / SIMPLEFS_CHUNKS_PER_BLOCK);
+    if (!bh)
+        return 0;
+    map = (uint32_t *) bh->b_data;
+
+    bno = READ_ONCE(map[idx]);
+    if (!bno && create) {
+        mutex_lock(&sbi->imap_lock);
+        bno = map[idx];
+        if (!bno) {
+            bno = simplefs_new_chunk(
+                sb, (idx && map[idx - 1])
+                        ? map[idx - 1] + SIMPLEFS_INODE_CHUNK_BLOCKS
+                        : 0);
+            if (bno) {
+                WRITE_ONCE(map[idx], bno);
+                mark_buffer_dirty(bh);
+            }
+        }
+        mutex_unlock(&sbi->imap_lock);
+    }
+    brelse(bh);
+
+    if (!bno)
+        return 0;
+    return bno + (ino % SIMPLEFS_INODES_PER_CHUNK) / SIMPLEFS_INODES_PER_BLOCK;
+}
+
 /* Either return the inode that corresponds to a given inode number (ino), if
  * it is already in the cache, or create a new inode object if it is not in the
  * cache.
@@ -38,7 +103,7 @@ struct inode *simplefs_iget(struct super_block *sb, unsigned long ino)
     struct simplefs_inode_info *ci = NULL;
     struct simplefs_sb_info *sbi = SIMPLEFS_SB(sb);
     struct buffer_head *bh = NULL;
-    uint32_t inode_block = (ino / SIMPLEFS_INODES_PER_BLOCK) + 1;
+    uint32_t inode_block;
     uint32_t inode_shift = ino % SIMPLEFS_INODES_PER_BLOCK;
     int ret;
 
@@ -65,6 +130,11 @@ struct inode *simplefs_iget(struct super_block *sb, unsigned long ino)
 
     ci = SIMPLEFS_INODE(inode);
     /* Read inode from disk and initialize */
+    inode_block = simplefs_inode_block(sb, ino, false);
+    if (!inode_block) {
+        ret = -EIO;
+        goto failed;
+    }
     bh = sb_bread(sb, inode_block);
     if (!bh) {
         ret = -EIO;
@@ -81,7 +151,8 @@ struct inode *simplefs_iget(struct super_block *sb, unsigned long ino)
     inode->i_mode = le32_to_cpu(cinode->i_mode);
     i_uid_write(inode, le32_to_cpu(cinode->i_uid));
     i_gid_write(inode, le32_to_cpu(cinode->i_gid));
-    inode->i_size = le32_to_cpu(cinode->i_size);
+    inode->i_size = le32_to_cpu(cinode->i_size) |
+                    ((loff_t) le32_to_cpu(cinode->i_size_high) << 32);
 
 #if SIMPLEFS_AT_LEAST(6, 6, 0)
     inode_set_ctime(inode, (time64_t) le32_to_cpu(cinode->i_ctime), 0);
@@ -108,8 +179,12 @@ struct inode *simplefs_iget(struct super_block *sb, unsigned long ino)
         inode->i_fop = &simplefs_dir_ops;
     } else if (S_ISREG(inode->i_mode)) {
         ci->ei_block = le32_to_cpu(cinode->ei_block);
+        inode->i_op = &simplefs_file_inode_ops;
         inode->i_fop = &simplefs_file_ops;
         inode->i_mapping->a_ops = &simplefs_aops;
+#if SIMPLEFS_AT_LEAST(6, 6, 0)
+        mapping_set_large_folios(inode->i_mapping);
+#endif
     } else if (S_ISLNK(inode->i_mode)) {
         strncpy(ci->i_data, cinode->i_data, sizeof(ci->i_data));
         inode->i_link = ci->i_data;
@@ -152,9 +227,9 @@ static int __file_lookup(struct inode *dir,
         return -EIO;
     eblock = (struct simplefs_file_ei_block *) (*ret_ei_bh)->b_data;
     hash_code = simplefs_hash(dentry) %
-                (SIMPLEFS_MAX_EXTENTS * SIMPLEFS_MAX_BLOCKS_PER_EXTENT);
-    _ei = hash_code / SIMPLEFS_MAX_BLOCKS_PER_EXTENT;
-    _bi = hash_code % SIMPLEFS_MAX_BLOCKS_PER_EXTENT;
+                (SIMPLEFS_MAX_EXTENTS * SIMPLEFS_DIR_BLOCKS_PER_EXTENT);
+    _ei = hash_code / SIMPLEFS_DIR_BLOCKS_PER_EXTENT;
+    _bi = hash_code % SIMPLEFS_DIR_BLOCKS_PER_EXTENT;
     int nr_ei_files = eblock->nr_files;
     for (idx_ei = 0; nr_ei_files; _ei++, idx_ei++) {
         CHECK_AND_SET_RING_INDEX(_ei, SIMPLEFS_MAX_EXTENTS);
@@ -272,7 +347,8 @@ static struct inode *simplefs_new_inode(struct inode *dir, mode_t mode)
     struct simplefs_inode_info *ci;
     struct super_block *sb;
     struct simplefs_sb_info *sbi;
-    uint32_t ino, bno;
+    struct buffer_head *bh;
+    uint32_t ino, bno = 0;
     int ret;
 
 #if SIMPLEFS_AT_LEAST(6, 6, 0) && SIMPLEFS_LESS_EQUAL(6, 7, 0)
@@ -287,17 +363,32 @@ static struct inode *simplefs_new_inode(struct inode *dir, mode_t mode)
         return ERR_PTR(-EINVAL);
     }
 
-    /* Check if inodes are available */
+    /* Check if inodes are available, and blocks besides the ones reserved
+     * by delayed allocation
+     */
     sb = dir->i_sb;
     sbi = SIMPLEFS_SB(sb);
-    if (sbi->nr_free_inodes == 0 || sbi->nr_free_blocks == 0)
+    if (!counter_positive(&sbi->free_inodes) || reserve_meta_blocks(sbi, 1))
         return ERR_PTR(-ENOSPC);
+    unreserve_blocks(sbi, 1);
 
-    /* Get a new free inode */
-    ino = get_free_inode(sbi);
+    /* Get a new free inode: directories start a lightly used region of the
+     * inode store, other inodes come from the batch of the CPU, refilled
+     * right after their parent
+     */
+    if (S_ISDIR(mode))
+        ino = get_free_inode(sbi, get_dir_inode_goal(sbi, dir->i_ino));
+    else
+        ino = get_batched_inode(sbi, dir->i_ino + 1);
     if (!ino)
         return ERR_PTR(-ENOSPC);
 
+    /* The inode store block of the new inode may not exist yet */
+    if (!simplefs_inode_block(sb, ino, true)) {
+        ret = -ENOSPC;
+        goto put_ino;
+    }
+
     inode = simplefs_iget(sb, ino);
     if (IS_ERR(inode)) {
         ret = PTR_ERR(inode);
@@ -329,11 +420,23 @@ static struct inode *simplefs_new_inode(struct inode *dir, mode_t mode)
 
     ci = SIMPLEFS_INODE(inode);
 
-    /* Get a free block for this new inode's index */
-    bno = get_free_blocks(sb, 1);
-    if (!bno) {
-        ret = -ENOSPC;
-        goto put_inode;
+    /* Get a free block for the index of a new directory, near its parent's
+     * one. A regular file gets its index on its first data write, so that
+     * empty files cost no block.
+     */
+    if (S_ISDIR(mode)) {
+        bno = get_meta_blocks(sb, SIMPLEFS_INODE(dir)->ei_block, 1);
+        if (!bno) {
+            ret = -ENOSPC;
+            goto put_inode;
+        }
+        bh = get_zeroed_block(sb, bno);
+        if (!bh) {
+            put_blocks(sbi, bno, 1);
+            ret = -EIO;
+            goto put_inode;
+        }
+        brelse(bh);
     }
 
     /* Initialize inode */
@@ -344,17 +447,22 @@ static struct inode *simplefs_new_inode(struct inode *dir, mode_t mode)
 #else
     inode_init_owner(inode, dir, mode);
 #endif
-    inode->i_blocks = 1;
     if (S_ISDIR(mode)) {
         ci->ei_block = bno;
+        inode->i_blocks = 1;
         inode->i_size = SIMPLEFS_BLOCK_SIZE;
         inode->i_fop = &simplefs_dir_ops;
         set_nlink(inode, 2); /* . and .. */
     } else if (S_ISREG(mode)) {
-        ci->ei_block = bno;
+        ci->ei_block = 0;
+        inode->i_blocks = 0;
         inode->i_size = 0;
+        inode->i_op = &simplefs_file_inode_ops;
         inode->i_fop = &simplefs_file_ops;
         inode->i_mapping->a_ops = &simplefs_aops;
+#if SIMPLEFS_AT_LEAST(6, 6, 0)
+        mapping_set_large_folios(inode->i_mapping);
+#endif
         set_nlink(inode, 1);
     }
 
@@ -371,6 +479,8 @@ static struct inode *simplefs_new_inode(struct inode *dir, mode_t mode)
     return inode;
 
 put_inode:
+    /* Its number is released below, keep simplefs_evict_inode() off it */
+    make_bad_inode(inode);
     iput(inode);
 put_ino:
     put_inode(sbi, ino);
@@ -385,7 +495,7 @@ static uint32_t simplefs_get_available_ext_idx(
     int ei = 0, idx;
     uint32_t first_empty_blk = -1;
 
-    ei = hash_code / SIMPLEFS_MAX_BLOCKS_PER_EXTENT;
+    ei = hash_code / SIMPLEFS_DIR_BLOCKS_PER_EXTENT;
 
     for (idx = 0; idx < SIMPLEFS_MAX_EXTENTS; ei++, idx++) {
         CHECK_AND_SET_RING_INDEX(ei, SIMPLEFS_MAX_EXTENTS);
@@ -402,33 +512,41 @@ static uint32_t simplefs_get_available_ext_idx(
     return first_empty_blk;
 }
 
-static int simplefs_get_new_ext(struct super_block *sb,
+/* Allocate the blocks of the directory extent 'ei' of 'dir', after its
+ * previous extent or else near its index block.
+ */
+static int simplefs_get_new_ext(struct inode *dir,
                                 uint32_t ei,
                                 struct simplefs_file_ei_block *eblock)
 {
+    struct super_block *sb = dir->i_sb;
+    struct simplefs_extent *prev = ei ? &eblock->extents[ei - 1] : NULL;
+    uint32_t goal = SIMPLEFS_INODE(dir)->ei_block;
     int bno, bi;
     struct buffer_head *bh;
     struct simplefs_dir_block *dblock;
-    bno = get_free_blocks(sb, SIMPLEFS_MAX_BLOCKS_PER_EXTENT);
+
+    if (prev && prev->ee_start)
+        goal = prev->ee_start + prev->ee_len;
+    bno = get_meta_blocks(sb, goal, SIMPLEFS_DIR_BLOCKS_PER_EXTENT);
     if (!bno)
         return -ENOSPC;
 
     eblock->extents[ei].ee_start = bno;
-    eblock->extents[ei].ee_len = SIMPLEFS_MAX_BLOCKS_PER_EXTENT;
+    eblock->extents[ei].ee_len = SIMPLEFS_DIR_BLOCKS_PER_EXTENT;
     /* ee_block is only used for file extent search, not for directory extents.
      * Set to 0 as directory operations rely solely on ee_start and ee_len. */
     eblock->extents[ei].ee_block = 0;
     eblock->extents[ei].nr_files = 0;
 
-    /* clear the ext block*/
+    /* clear the ext block, without reading its stale content */
     /* TODO: fix from 8 to dynamic value */
     for (bi = 0; bi < eblock->extents[ei].ee_len; bi++) {
-        bh = sb_bread(sb, eblock->extents[ei].ee_start + bi);
+        bh = get_zeroed_block(sb, eblock->extents[ei].ee_start + bi);
         if (!bh)
             return -EIO;
 
         dblock = (struct simplefs_dir_block *) bh->b_data;
-        memset(dblock, 0, sizeof(struct simplefs_dir_block));
         dblock->files[0].nr_blk = SIMPLEFS_FILES_PER_BLOCK;
         mark_buffer_dirty(bh);
         RELEASE_BUFFER_HEAD(bh);
@@ -527,7 +645,6 @@ static int simplefs_create(struct inode *dir,
     struct simplefs_inode_info *ci_dir;
     struct simplefs_file_ei_block *eblock;
     struct simplefs_dir_block *dblock;
-    char *fblock;
     struct buffer_head *bh, *bh2;
     uint32_t avail;
 #if SIMPLEFS_AT_LEAST(6, 6, 0) && SIMPLEFS_LESS_EQUAL(6, 7, 0)
@@ -563,21 +680,8 @@ static int simplefs_create(struct inode *dir,
         goto end;
     }
 
-    /* Scrub ei_block for new file/directory to avoid previous data
-     * messing with new file/directory.
-     */
-    bh2 = sb_bread(sb, SIMPLEFS_INODE(inode)->ei_block);
-    if (!bh2) {
-        ret = -EIO;
-        goto iput;
-    }
-    fblock = (char *) bh2->b_data;
-    memset(fblock, 0, SIMPLEFS_BLOCK_SIZE);
-    mark_buffer_dirty(bh2);
-    RELEASE_BUFFER_HEAD(bh2);
-
     hash_code = simplefs_hash(dentry) %
-                (SIMPLEFS_MAX_EXTENTS * SIMPLEFS_MAX_BLOCKS_PER_EXTENT);
+                (SIMPLEFS_MAX_EXTENTS * SIMPLEFS_DIR_BLOCKS_PER_EXTENT);
     avail = simplefs_get_available_ext_idx(eblock, hash_code);
 
     /* Validate avail index is within bounds */
@@ -588,7 +692,7 @@ static int simplefs_create(struct inode *dir,
 
     /* if there is not any empty space, alloc new one */
     if (!eblock->extents[avail].ee_start) {
-        ret = simplefs_get_new_ext(sb, avail, eblock);
+        ret = simplefs_get_new_ext(dir, avail, eblock);
         switch (ret) {
         case -ENOSPC:
             ret = -ENOSPC;
@@ -657,7 +761,8 @@ put_block:
         memset(&eblock->extents[avail], 0, sizeof(struct simplefs_extent));
     }
 iput:
-    put_blocks(SIMPLEFS_SB(sb), SIMPLEFS_INODE(inode)->ei_block, 1);
+    if (SIMPLEFS_INODE(inode)->ei_block)
+        put_blocks(SIMPLEFS_SB(sb), SIMPLEFS_INODE(inode)->ei_block, 1);
     put_inode(SIMPLEFS_SB(sb), inode->i_ino);
     iput(inode);
 end:
@@ -687,9 +792,9 @@ static int simplefs_remove_from_dir(struct inode *dir,
     dir_nr_files = eblock->nr_files;
 
     hash_code = simplefs_hash(dentry) %
-                (SIMPLEFS_MAX_EXTENTS * SIMPLEFS_MAX_BLOCKS_PER_EXTENT);
-    ei = hash_code / SIMPLEFS_MAX_BLOCKS_PER_EXTENT;
-    bi = hash_code % SIMPLEFS_MAX_BLOCKS_PER_EXTENT;
+                (SIMPLEFS_MAX_EXTENTS * SIMPLEFS_DIR_BLOCKS_PER_EXTENT);
+    ei = hash_code / SIMPLEFS_DIR_BLOCKS_PER_EXTENT;
+    bi = hash_code % SIMPLEFS_DIR_BLOCKS_PER_EXTENT;
 
     for (; dir_nr_files; ei++) {
         CHECK_AND_SET_RING_INDEX(ei, SIMPLEFS_MAX_EXTENTS);
@@ -728,97 +833,53 @@ end_ret:
     return ret;
 }
 
-/* Remove a link for a file including the reference in the parent directory.
- * If link count is 0, destroy file in this way:
- *   - remove the file from its parent directory.
- *   - cleanup blocks containing data
+/* Release the blocks and the inode number of an inode whose last link is
+ * gone. Called when it leaves memory: until then, open files still read and
+ * write its blocks. Its cached pages, delayed ones included, are dropped
+ * first, so nothing is written to the blocks once they are released.
+ *   - release blocks containing data
  *   - cleanup file index block
  *   - cleanup inode
  */
-static int simplefs_unlink(struct inode *dir, struct dentry *dentry)
+void simplefs_delete_inode(struct inode *inode)
 {
-    struct super_block *sb = dir->i_sb;
+    struct super_block *sb = inode->i_sb;
     struct simplefs_sb_info *sbi = SIMPLEFS_SB(sb);
-    struct inode *inode = d_inode(dentry);
-    struct buffer_head *bh = NULL, *bh2 = NULL;
+    struct buffer_head *bh = NULL;
     struct simplefs_file_ei_block *eblk = NULL;
-    char *block;
-#if SIMPLEFS_AT_LEAST(6, 6, 0) && SIMPLEFS_LESS_EQUAL(6, 7, 0)
-    struct timespec64 cur_time;
-#endif
-    int ei = 0, bi = 0;
-    int ret = 0;
-
-    uint32_t ino = inode->i_ino;
-    uint32_t bno = 0;
-
-    ret = simplefs_remove_from_dir(dir, dentry, &ei, &bh);
-
-    if (ret != 0) {
-        RELEASE_BUFFER_HEAD(bh);
-        return ret;
-    }
-
-    eblk = (struct simplefs_file_ei_block *) bh->b_data;
-    if (!eblk->extents[ei].nr_files) {
-        put_blocks(sbi, eblk->extents[ei].ee_start, eblk->extents[ei].ee_len);
-        memset(&eblk->extents[ei], 0, sizeof(struct simplefs_extent));
-        mark_buffer_dirty(bh);
-    }
-    RELEASE_BUFFER_HEAD(bh);
+    uint32_t bno = SIMPLEFS_INODE(inode)->ei_block;
+    int ei;
 
     if (S_ISLNK(inode->i_mode))
         goto clean_inode;
 
-        /* Update inode stats */
-#if SIMPLEFS_AT_LEAST(6, 7, 0)
-    simple_inode_init_ts(dir);
-#elif SIMPLEFS_AT_LEAST(6, 6, 0)
-    cur_time = current_time(dir);
-    dir->i_mtime = dir->i_atime = cur_time;
-    inode_set_ctime_to_ts(dir, cur_time);
-#else
-    dir->i_mtime = dir->i_atime = dir->i_ctime = current_time(dir);
-#endif
-
-    if (S_ISDIR(inode->i_mode)) {
-        drop_nlink(dir);
-        drop_nlink(inode);
-    }
-    mark_inode_dirty(dir);
-
-    if (inode->i_nlink > 1) {
-        inode_dec_link_count(inode);
-        return ret;
-    }
-
-    /* Cleans up pointed blocks when unlinking a file. If reading the index
+    /* Cleans up pointed blocks when deleting a file. If reading the index
      * block fails, the inode is cleaned up regardless, resulting in the
-     * permanent loss of this file's blocks. If scrubbing a data block fails,
-     * do not terminate the operation (as it is already too late); instead,
-     * release the block and proceed.
+     * permanent loss of this file's blocks. Data blocks are not scrubbed:
+     * they are cleaned when allocated again.
      */
-    bno = SIMPLEFS_INODE(inode)->ei_block;
+    if (!bno) /* Never held data */
+        goto clean_inode;
     bh = sb_bread(sb, bno);
     if (!bh)
         goto clean_inode;
     eblk = (struct simplefs_file_ei_block *) bh->b_data;
+    if (S_ISREG(inode->i_mode)) {
+        struct simplefs_inode_info *ci = SIMPLEFS_INODE(inode);
+
+        /* Release the nodes of the extent tree too, scrubbing its root */
+        down_write(&ci->ext_lock);
+        simplefs_ext_cache_drop(sbi, ci);
+        simplefs_ext_truncate(inode, bh, 0);
+        up_write(&ci->ext_lock);
+        RELEASE_BUFFER_HEAD(bh);
+        goto clean_inode;
+    }
     for (ei = 0; ei < SIMPLEFS_MAX_EXTENTS; ei++) {
         if (!eblk->extents[ei].ee_start)
             break;
 
         put_blocks(sbi, eblk->extents[ei].ee_start, eblk->extents[ei].ee_len);
-
-        /* Scrub the extent */
-        for (bi = 0; bi < eblk->extents[ei].ee_len; bi++) {
-            bh2 = sb_bread(sb, eblk->extents[ei].ee_start + bi);
-            if (!bh2)
-                continue;
-            block = (char *) bh2->b_data;
-            memset(block, 0, SIMPLEFS_BLOCK_SIZE);
-            mark_buffer_dirty(bh2);
-            RELEASE_BUFFER_HEAD(bh2);
-        }
     }
 
     /* Scrub index block */
@@ -827,7 +888,7 @@ static int simplefs_unlink(struct inode *dir, struct dentry *dentry)
     RELEASE_BUFFER_HEAD(bh);
 
 clean_inode:
-    /* Cleanup inode and mark dirty */
+    /* Cleanup inode */
     inode->i_blocks = 0;
     SIMPLEFS_INODE(inode)->ei_block = 0;
     inode->i_size = 0;
@@ -845,14 +906,67 @@ clean_inode:
     inode->i_ctime.tv_sec = inode->i_mtime.tv_sec = inode->i_atime.tv_sec = 0;
 #endif
 
-    inode_dec_link_count(inode);
-
     /* Free inode and index block from bitmap */
-    if (!S_ISLNK(inode->i_mode))
+    if (bno && !S_ISLNK(inode->i_mode))
         put_blocks(sbi, bno, 1);
     inode->i_mode = 0;
-    put_inode(sbi, ino);
+    put_inode(sbi, inode->i_ino);
+}
 
+/* Remove a link for a file including the reference in the parent directory.
+ * If link count is 0, the file is destroyed by simplefs_delete_inode() once
+ * the last reference to its inode is dropped.
+ */
+static int simplefs_unlink(struct inode *dir, struct dentry *dentry)
+{
+    struct super_block *sb = dir->i_sb;
+    struct simplefs_sb_info *sbi = SIMPLEFS_SB(sb);
+    struct inode *inode = d_inode(dentry);
+    struct buffer_head *bh = NULL;
+    struct simplefs_file_ei_block *eblk = NULL;
+#if SIMPLEFS_AT_LEAST(6, 6, 0) && SIMPLEFS_LESS_EQUAL(6, 7, 0)
+    struct timespec64 cur_time;
+#endif
+    int ei = 0;
+    int ret = 0;
+
+    ret = simplefs_remove_from_dir(dir, dentry, &ei, &bh);
+
+    if (ret != 0) {
+        RELEASE_BUFFER_HEAD(bh);
+        return ret;
+    }
+
+    eblk = (struct simplefs_file_ei_block *) bh->b_data;
+    if (!eblk->extents[ei].nr_files) {
+        put_blocks(sbi, eblk->extents[ei].ee_start, eblk->extents[ei].ee_len);
+        memset(&eblk->extents[ei], 0, sizeof(struct simplefs_extent));
+        mark_buffer_dirty(bh);
+    }
+    RELEASE_BUFFER_HEAD(bh);
+
+    if (S_ISLNK(inode->i_mode))
+        goto drop_link;
+
+        /* Update inode stats */
+#if SIMPLEFS_AT_LEAST(6, 7, 0)
+    simple_inode_init_ts(dir);
+#elif SIMPLEFS_AT_LEAST(6, 6, 0)
+    cur_time = current_time(dir);
+    dir->i_mtime = dir->i_atime = cur_time;
+    inode_set_ctime_to_ts(dir, cur_time);
+#else
+    dir->i_mtime = dir->i_atime = dir->i_ctime = current_time(dir);
+#endif
+
+    if (S_ISDIR(inode->i_mode)) {
+        drop_nlink(dir);
+        drop_nlink(inode);
+    }
+    mark_inode_dirty(dir);
+
+drop_link:
+    inode_dec_link_count(inode);
     return ret;
 }
 
@@ -942,7 +1056,7 @@ static int simplefs_rename(struct inode *src_dir,
     }
 
     hash_code = simplefs_hash(dest_dentry) %
-                (SIMPLEFS_MAX_EXTENTS * SIMPLEFS_MAX_BLOCKS_PER_EXTENT);
+                (SIMPLEFS_MAX_EXTENTS * SIMPLEFS_DIR_BLOCKS_PER_EXTENT);
     dest_ei = simplefs_get_available_ext_idx(eblk_dest, hash_code);
     if (dest_ei >= SIMPLEFS_MAX_EXTENTS) {
         ret = -EMLINK;
@@ -950,7 +1064,7 @@ static int simplefs_rename(struct inode *src_dir,
     }
 
     if (!eblk_dest->extents[dest_ei].ee_start) {
-        ret = simplefs_get_new_ext(sb, dest_ei, eblk_dest);
+        ret = simplefs_get_new_ext(dest_dir, dest_ei, eblk_dest);
         switch (ret) {
         case -ENOSPC:
             ret = -ENOSPC;
@@ -1162,7 +1276,7 @@ static int simplefs_link(struct dentry *src_dentry,
 
 
     hash_code = simplefs_hash(dentry) %
-                (SIMPLEFS_MAX_EXTENTS * SIMPLEFS_MAX_BLOCKS_PER_EXTENT);
+                (SIMPLEFS_MAX_EXTENTS * SIMPLEFS_DIR_BLOCKS_PER_EXTENT);
     avail = simplefs_get_available_ext_idx(eblock, hash_code);
 
     /* Validate avail index is within bounds */
@@ -1173,7 +1287,7 @@ static int simplefs_link(struct dentry *src_dentry,
 
     /* if there is not any empty space, alloc new one */
     if (!eblock->extents[avail].ee_start) {
-        ret = simplefs_get_new_ext(sb, avail, eblock);
+        ret = simplefs_get_new_ext(dir, avail, eblock);
         switch (ret) {
         case -ENOSPC:
             ret = -ENOSPC;
@@ -1279,7 +1393,7 @@ static int simplefs_symlink(struct inode *dir,
 
 
     hash_code = simplefs_hash(dentry) %
-                (SIMPLEFS_MAX_EXTENTS * SIMPLEFS_MAX_BLOCKS_PER_EXTENT);
+                (SIMPLEFS_MAX_EXTENTS * SIMPLEFS_DIR_BLOCKS_PER_EXTENT);
     avail = simplefs_get_available_ext_idx(eblock, hash_code);
 
     /* Validate avail index is within bounds */
@@ -1290,7 +1404,7 @@ static int simplefs_symlink(struct inode *dir,
 
     /* if there is not any empty space, alloc new one */
     if (!eblock->extents[avail].ee_start) {
-        ret = simplefs_get_new_ext(sb, avail, eblock);
+        ret = simplefs_get_new_ext(dir, avail, eblock);
         switch (ret) {
         case -ENOSPC:
             ret = -ENOSPC;
@@ -1345,7 +1459,8 @@ put_block:
         memset(&eblock->extents[avail], 0, sizeof(struct simplefs_extent));
     }
 iput:
-    put_blocks(SIMPLEFS_SB(sb), ci->ei_block, 1);
+    if (ci->ei_block)
+        put_blocks(SIMPLEFS_SB(sb), ci->ei_block, 1);
     put_inode(SIMPLEFS_SB(sb), inode->i_ino);
     iput(inode);
     RELEASE_BUFFER_HEAD(bh);
@@ -0,0 +1,67 @@
+#define pr_fmt(fmt) KBUILD_MODNAME ": " fmt
+
+#include <linux/capability.h>
+#include <linux/fs.h>
+#include <linux/kernel.h>
+#include <linux/mount.h>
+#include <linux/uaccess.h>
+
+#include "simplefs.h"
+
+/* Discard the free space of the filesystem (fstrim) */
+static long simplefs_ioctl_fitrim(struct file *file, void __user *arg)
+{
+    struct super_block *sb = file_inode(file)->i_sb;
+    struct fstrim_range range;
+    int ret;
+
+    if (!capable(CAP_SYS_ADMIN))
+        return -EPERM;
+    if (!simplefs_can_discard(sb))
+        return -EOPNOTSUPP;
+    if (copy_from_user(&range, arg, sizeof(range)))
+        return -EFAULT;
+
+    ret = simplefs_trim_fs(sb, &range);
+    if (ret)
+        return ret;
+
+    if (copy_to_user(arg, &range, sizeof(range)))
+        return -EFAULT;
+    return 0;
+}
+
+/* Move the data of a regular file into fewer extents */
+static long simplefs_ioctl_defrag(struct file *file, void __user *arg)
+{
+    struct simplefs_defrag_info info;
+    int ret;
+
+    if (!capable(CAP_SYS_ADMIN))
+        return -EPERM;
+
+    ret = mnt_want_write_file(file);
+    if (ret)
+        return ret;
+    ret = simplefs_defrag_file(file, &info);
+    mnt_drop_write_file(file);
+    if (ret)
+        return ret;
+
+    if (copy_to_user(arg, &info, sizeof(info)))
+        return -EFAULT;
+    return 0;
+}
+
+/* Handle the ioctls shared by files and directories */
+long simplefs_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
+{
+    switch (cmd) {
+    case FITRIM:
+        return simplefs_ioctl_fitrim(file, (void __user *) arg);
+    case SIMPLEFS_IOC_DEFRAG:
+        return simplefs_ioctl_defrag(file, (void __user *) arg);
+    default:
+        return -ENOTTY;
+    }
+}
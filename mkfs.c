@@ -49,27 +49,33 @@ static struct superblock *write_superblock(int fd, struct stat *fstats)
         return NULL;
 
     uint32_t nr_blocks = fstats->st_size / SIMPLEFS_BLOCK_SIZE;
+    /* Inode chunks are allocated on demand, the number of inodes only sizes
+     * the inode chunk map and the ifree bitmap.
+     */
     uint32_t nr_inodes = nr_blocks;
-    uint32_t mod = nr_inodes % SIMPLEFS_INODES_PER_BLOCK;
+    uint32_t mod = nr_inodes % SIMPLEFS_INODES_PER_CHUNK;
     if (mod)
-        nr_inodes += SIMPLEFS_INODES_PER_BLOCK - mod;
-    uint32_t nr_istore_blocks =
-        DIV_ROUND_UP(nr_inodes, SIMPLEFS_INODES_PER_BLOCK);
+        nr_inodes += SIMPLEFS_INODES_PER_CHUNK - mod;
+    uint32_t nr_imap_blocks = DIV_ROUND_UP(
+        nr_inodes / SIMPLEFS_INODES_PER_CHUNK, SIMPLEFS_CHUNKS_PER_BLOCK);
     uint32_t nr_ifree_blocks = DIV_ROUND_UP(nr_inodes, SIMPLEFS_BLOCK_SIZE * 8);
     uint32_t nr_bfree_blocks = DIV_ROUND_UP(nr_blocks, SIMPLEFS_BLOCK_SIZE * 8);
     uint32_t nr_data_blocks =
-        nr_blocks - nr_istore_blocks - nr_ifree_blocks - nr_bfree_blocks;
+        nr_blocks - 1 - nr_imap_blocks - nr_ifree_blocks - nr_bfree_blocks;
 
     memset(sb, 0, sizeof(struct superblock));
     sb->info = (struct simplefs_sb_info){
         .magic = htole32(SIMPLEFS_MAGIC),
         .nr_blocks = htole32(nr_blocks),
         .nr_inodes = htole32(nr_inodes),
-        .nr_istore_blocks = htole32(nr_istore_blocks),
+        .nr_imap_blocks = htole32(nr_imap_blocks),
         .nr_ifree_blocks = htole32(nr_ifree_blocks),
         .nr_bfree_blocks = htole32(nr_bfree_blocks),
         .nr_free_inodes = htole32(nr_inodes - 1),
-        .nr_free_blocks = htole32(nr_data_blocks - 1),
+        /* The first inode chunk and the root index block are used */
+        .nr_free_blocks =
+            htole32(nr_data_blocks - SIMPLEFS_INODE_CHUNK_BLOCKS - 1),
+        .version = htole32(SIMPLEFS_LAYOUT_VERSION),
     };
 
     int ret = write(fd, sb, sizeof(struct superblock));
@@ -82,72 +88,56 @@ static struct superblock *write_superblock(int fd, struct stat *fstats)
         "Superblock: (%ld)\n"
         "\tmagic=%#x\n"
         "\tnr_blocks=%u\n"
-        "\tnr_inodes=%u (istore=%u blocks)\n"
+        "\tnr_inodes=%u (imap=%u blocks)\n"
         "\tnr_ifree_blocks=%u\n"
         "\tnr_bfree_blocks=%u\n"
         "\tnr_free_inodes=%u\n"
-        "\tnr_free_blocks=%u\n",
+        "\tnr_free_blocks=%u\n"
+        "\tversion=%u\n",
         sizeof(struct superblock), sb->info.magic, sb->info.nr_blocks,
-        sb->info.nr_inodes, sb->info.nr_istore_blocks, sb->info.nr_ifree_blocks,
+        sb->info.nr_inodes, sb->info.nr_imap_blocks, sb->info.nr_ifree_blocks,
         sb->info.nr_bfree_blocks, sb->info.nr_free_inodes,
-        sb->info.nr_free_blocks);
+        sb->info.nr_free_blocks, sb->info.version);
 
     return sb;
 }
 
-static int write_inode_store(int fd, struct superblock *sb)
+/* Return the first block after the metadata, where the first inode chunk
+ * starts. The root index block follows that chunk.
+ */
+static uint32_t first_data_block(struct superblock *sb)
 {
-    /* Allocate a block of zeroed-out memory space for the inode storage. */
-    char *block = malloc(SIMPLEFS_BLOCK_SIZE);
+    return 1 + le32toh(sb->info.nr_imap_blocks) +
+           le32toh(sb->info.nr_ifree_blocks) +
+           le32toh(sb->info.nr_bfree_blocks);
+}
+
+static int write_imap_blocks(int fd, struct superblock *sb)
+{
+    /* Allocate a block of zeroed-out memory space for the inode chunk map. */
+    uint32_t *block = calloc(1, SIMPLEFS_BLOCK_SIZE);
     if (!block)
         return -1;
 
-    memset(block, 0, SIMPLEFS_BLOCK_SIZE);
-
-    /* Root inode (inode 1) */
-    struct simplefs_inode *inode = (struct simplefs_inode *) block;
-    uint32_t first_data_block = 1 + le32toh(sb->info.nr_bfree_blocks) +
-                                le32toh(sb->info.nr_ifree_blocks) +
-                                le32toh(sb->info.nr_istore_blocks);
-
-    /* Designate inode 1 as the root inode.
-     * When the system uses the glibc, the readdir function will skip over
-     * inode 0. Additionally, the VFS layer avoids using inode 0 to prevent
-     * potential issues.
-     */
-    inode += 1;
-    inode->i_mode = htole32(S_IFDIR | S_IRUSR | S_IRGRP | S_IROTH | S_IWUSR |
-                            S_IWGRP | S_IXUSR | S_IXGRP | S_IXOTH);
-    inode->i_uid = 0;
-    inode->i_gid = 0;
-    inode->i_size = htole32(SIMPLEFS_BLOCK_SIZE);
-    inode->i_ctime = inode->i_atime = inode->i_mtime = htole32(0);
-    inode->i_blocks = htole32(1);
-    inode->i_nlink = htole32(2);
-    inode->ei_block = htole32(first_data_block);
+    /* Only the first inode chunk, holding the root inode, is allocated. */
+    block[0] = htole32(first_data_block(sb));
 
-    int ret = write(fd, block, SIMPLEFS_BLOCK_SIZE);
-    if (ret != SIMPLEFS_BLOCK_SIZE) {
-        ret = -1;
-        goto end;
-    }
-
-    /* Clear all memory blocks allocated for inode storage. */
-    memset(block, 0, SIMPLEFS_BLOCK_SIZE);
     uint32_t i;
-    for (i = 1; i < sb->info.nr_istore_blocks; i++) {
+    int ret;
+    for (i = 0; i < le32toh(sb->info.nr_imap_blocks); i++) {
         ret = write(fd, block, SIMPLEFS_BLOCK_SIZE);
         if (ret != SIMPLEFS_BLOCK_SIZE) {
             ret = -1;
             goto end;
         }
+        block[0] = 0;
     }
     ret = 0;
 
     printf(
-        "Inode store: wrote %d blocks\n"
-        "\tinode size = %ld B\n",
-        i, sizeof(struct simplefs_inode));
+        "Inode chunk map: wrote %d blocks\n"
+        "\tinode size = %ld B, %d inodes per chunk\n",
+        i, sizeof(struct simplefs_inode), (int) SIMPLEFS_INODES_PER_CHUNK);
 
 end:
     free(block);
@@ -197,9 +187,8 @@ end:
 
 static int write_bfree_blocks(int fd, struct superblock *sb)
 {
-    uint32_t nr_used = le32toh(sb->info.nr_istore_blocks) +
-                       le32toh(sb->info.nr_ifree_blocks) +
-                       le32toh(sb->info.nr_bfree_blocks) + 2;
+    uint32_t nr_used =
+        first_data_block(sb) + SIMPLEFS_INODE_CHUNK_BLOCKS + 1;
 
     char *block = malloc(SIMPLEFS_BLOCK_SIZE);
     if (!block)
@@ -207,8 +196,9 @@ static int write_bfree_blocks(int fd, struct superblock *sb)
     uint64_t *bfree = (uint64_t *) block;
 
     /* The first blocks refer to the superblock (metadata about the fs), inode
-     * store (where inode data is stored), ifree (list of free inodes), bfree
-     * (list of free data blocks), and one data block marked as used.
+     * chunk map (where inode chunks are), ifree (list of free inodes), bfree
+     * (list of free data blocks), the first inode chunk and one data block
+     * marked as used.
      */
     memset(bfree, 0xff, SIMPLEFS_BLOCK_SIZE);
     uint32_t i = 0;
@@ -249,20 +239,46 @@ end:
 
 static int write_data_blocks(int fd, struct superblock *sb)
 {
-    char *buffer = calloc(1, SIMPLEFS_BLOCK_SIZE);
-    if (!buffer) {
+    char *block = calloc(1, SIMPLEFS_BLOCK_SIZE);
+    if (!block) {
         perror("Failed to allocate memory");
         return -1;
     }
 
-    ssize_t ret = write(fd, buffer, SIMPLEFS_BLOCK_SIZE);
-    if (ret != SIMPLEFS_BLOCK_SIZE) {
-        perror("Failed to write data block");
-        free(buffer);
-        return -1;
+    /* Root inode (inode 1), in the first block of the first inode chunk */
+    struct simplefs_inode *inode = (struct simplefs_inode *) block;
+
+    /* Designate inode 1 as the root inode.
+     * When the system uses the glibc, the readdir function will skip over
+     * inode 0. Additionally, the VFS layer avoids using inode 0 to prevent
+     * potential issues.
+     */
+    inode += 1;
+    inode->i_mode = htole32(S_IFDIR | S_IRUSR | S_IRGRP | S_IROTH | S_IWUSR |
+                            S_IWGRP | S_IXUSR | S_IXGRP | S_IXOTH);
+    inode->i_uid = 0;
+    inode->i_gid = 0;
+    inode->i_size = htole32(SIMPLEFS_BLOCK_SIZE);
+    inode->i_ctime = inode->i_atime = inode->i_mtime = htole32(0);
+    inode->i_blocks = htole32(1);
+    inode->i_nlink = htole32(2);
+    inode->ei_block =
+        htole32(first_data_block(sb) + SIMPLEFS_INODE_CHUNK_BLOCKS);
+
+    /* Then the rest of the chunk and the root index block, cleared */
+    for (int i = 0; i < SIMPLEFS_INODE_CHUNK_BLOCKS + 1; i++) {
+        ssize_t ret = write(fd, block, SIMPLEFS_BLOCK_SIZE);
+        if (ret != SIMPLEFS_BLOCK_SIZE) {
+            perror("Failed to write data block");
+            free(block);
+            return -1;
+        }
+        memset(block, 0, SIMPLEFS_BLOCK_SIZE);
     }
 
-    free(buffer);
+    printf("Data blocks: wrote the first inode chunk and the root index\n");
+
+    free(block);
     return 0;
 }
 
@@ -337,10 +353,10 @@ int main(int argc, char **argv)
         goto fclose;
     }
 
-    /* Write inode store blocks (from block 1) */
-    ret = write_inode_store(fd, sb);
+    /* Write inode chunk map blocks (from block 1) */
+    ret = write_imap_blocks(fd, sb);
     if (ret) {
-        perror("write_inode_store():");
+        perror("write_imap_blocks():");
         ret = EXIT_FAILURE;
         goto free_sb;
     }
@@ -361,7 +377,7 @@ int main(int argc, char **argv)
         goto free_sb;
     }
 
-    /* clear a root index block */
+    /* Write the first inode chunk and clear a root index block */
     ret = write_data_blocks(fd, sb);
     if (ret) {
         perror("write_data_blocks():");
@@ -0,0 +1,195 @@
+#define pr_fmt(fmt) KBUILD_MODNAME ": " fmt
+
+#include <linux/buffer_head.h>
+#include <linux/fs.h>
+#include <linux/kernel.h>
+#include <linux/log2.h>
+#include <linux/proc_fs.h>
+#include <linux/seq_file.h>
+#include <linux/slab.h>
+
+#include "bitmap.h"
+#include "simplefs.h"
+
+/* Free runs are counted in power-of-two buckets of length, 1, 2-3, 4-7... */
+#define SIMPLEFS_FREEFRAG_BUCKETS 32
+
+/* /proc/fs/simplefs, holding one directory per mounted device */
+static struct proc_dir_entry *simplefs_proc_root;
+
+struct simplefs_freefrag {
+    uint64_t nr_runs[SIMPLEFS_FREEFRAG_BUCKETS];   /* Free runs per bucket */
+    uint64_t nr_blocks[SIMPLEFS_FREEFRAG_BUCKETS]; /* Their free blocks */
+    uint64_t total_runs;                           /* Free runs */
+    uint64_t total_free;                           /* Free blocks */
+    uint32_t max_run;                              /* Largest free run */
+    uint32_t run;                                  /* Length of current run */
+};
+
+/* Account for the free run that just ended, if any */
+static void simplefs_freefrag_end_run(struct simplefs_freefrag *ff)
+{
+    uint32_t b;
+
+    if (!ff->run)
+        return;
+    b = ilog2(ff->run);
+    ff->nr_runs[b]++;
+    ff->nr_blocks[b] += ff->run;
+    ff->total_runs++;
+    ff->total_free += ff->run;
+    ff->max_run = max(ff->max_run, ff->run);
+    ff->run = 0;
+}
+
+/* Copy the bitmap slice of group 'i' into 'map'. A loaded slice is copied
+ * under the group lock, which is only held for the copy. Otherwise the
+ * on-disk bitmap block is up to date and is read without loading the group;
+ * the preallocation windows and the FITRIM run, free on disk, are then marked
+ * used as they are in a loaded slice.
+ * Return 0 or -EIO.
+ */
+static int simplefs_freefrag_copy(struct super_block *sb,
+                                  uint32_t i,
+                                  unsigned long *map)
+{
+    struct simplefs_sb_info *sbi = SIMPLEFS_SB(sb);
+    struct simplefs_group *g = &sbi->bgroups[i];
+    struct buffer_head *bh;
+
+    spin_lock(&g->lock);
+    if (g->map) {
+        bitmap_copy(map, g->map, g->nr_bits);
+        spin_unlock(&g->lock);
+        return 0;
+    }
+    spin_unlock(&g->lock);
+
+    bh = sb_bread(sb, g->block);
+    if (!bh)
+        return -EIO;
+    memcpy(map, bh->b_data, SIMPLEFS_BLOCK_SIZE);
+    brelse(bh);
+    get_prealloc_bits(sbi, map, i);
+    get_trim_bits(sbi, map, i);
+    return 0;
+}
+
+/* Report the free runs of the block bitmap: a histogram of their lengths,
+ * the largest one and the fill level of each allocation group. Free runs
+ * crossing a group boundary are counted as one. Blocks held in preallocation
+ * windows count as used in every group, as allocators see them. The report
+ * is built from a copy of each group in turn, so allocators are never held
+ * up and the figures are a close, not exact, picture of a changing
+ * filesystem.
+ */
+static int simplefs_freefrag_show(struct seq_file *m, void *v)
+{
+    struct super_block *sb = m->private;
+    struct simplefs_sb_info *sbi = SIMPLEFS_SB(sb);
+    struct simplefs_freefrag *ff;
+    unsigned long *map;
+    unsigned long first, next;
+    uint32_t i, b, group_free, group_max;
+    int ret = 0;
+
+    ff = kzalloc(sizeof(*ff), GFP_KERNEL);
+    map = bitmap_zalloc(SIMPLEFS_BITS_PER_GROUP, GFP_KERNEL);
+    if (!ff || !map) {
+        ret = -ENOMEM;
+        goto out;
+    }
+
+    seq_printf(m, "%-8s %12s %12s %8s %12s\n", "group", "blocks", "free",
+               "used(%)", "largest run");
+    for (i = 0; i < sbi->nr_bgroups; i++) {
+        struct simplefs_group *g = &sbi->bgroups[i];
+
+        ret = simplefs_freefrag_copy(sb, i, map);
+        if (ret)
+            goto out;
+
+        group_free = 0;
+        group_max = 0;
+        for (first = find_first_bit(map, g->nr_bits); first < g->nr_bits;
+             first = find_next_bit(map, g->nr_bits, next)) {
+            next = find_next_zero_bit(map, g->nr_bits, first);
+
+            /* A run at the start of the group continues the previous one */
+            if (first)
+                simplefs_freefrag_end_run(ff);
+            ff->run += next - first;
+            group_free += next - first;
+            group_max = max_t(uint32_t, group_max, next - first);
+        }
+        if (!test_bit(g->nr_bits - 1, map))
+            simplefs_freefrag_end_run(ff);
+
+        seq_printf(m, "%-8u %12u %12u %8u %12u\n", i, g->nr_bits, group_free,
+                   (uint32_t) ((g->nr_bits - group_free) * 100ULL /
+                               g->nr_bits),
+                   group_max);
+        cond_resched();
+    }
+    simplefs_freefrag_end_run(ff);
+
+    seq_printf(m, "\ntotal blocks: %u\n", sbi->nr_blocks);
+    seq_printf(m, "free blocks: %llu (%llu%%)\n", ff->total_free,
+               ff->total_free * 100 / sbi->nr_blocks);
+    seq_printf(m, "free runs: %llu\n", ff->total_runs);
+    seq_printf(m, "largest free run: %u\n", ff->max_run);
+    seq_printf(m, "average free run: %llu\n",
+               ff->total_runs ? ff->total_free / ff->total_runs : 0);
+
+    seq_printf(m, "\n%-24s %12s %12s %8s\n", "run length", "free runs",
+               "free blocks", "free(%)");
+    for (b = 0; b < SIMPLEFS_FREEFRAG_BUCKETS; b++) {
+        if (!ff->nr_runs[b])
+            continue;
+        seq_printf(m, "%10llu - %-11llu %12llu %12llu %8llu\n", 1ULL << b,
+                   (2ULL << b) - 1, ff->nr_runs[b], ff->nr_blocks[b],
+                   ff->nr_blocks[b] * 100 / ff->total_free);
+    }
+
+out:
+    bitmap_free(map);
+    kfree(ff);
+    return ret;
+}
+
+/* Create /proc/fs/simplefs/<dev> for a newly mounted filesystem. The report
+ * is a convenience only, a failure does not prevent the mount.
+ */
+void simplefs_register_proc(struct super_block *sb)
+{
+    struct simplefs_sb_info *sbi = SIMPLEFS_SB(sb);
+
+    if (!simplefs_proc_root)
+        return;
+
+    sbi->proc_dir = proc_mkdir(sb->s_id, simplefs_proc_root);
+    if (!sbi->proc_dir ||
+        !proc_create_single_data("freefrag", 0444, sbi->proc_dir,
+                                 simplefs_freefrag_show, sb))
+        pr_warn("cannot create /proc/fs/simplefs/%s\n", sb->s_id);
+}
+
+void simplefs_unregister_proc(struct super_block *sb)
+{
+    struct simplefs_sb_info *sbi = SIMPLEFS_SB(sb);
+
+    proc_remove(sbi->proc_dir);
+    sbi->proc_dir = NULL;
+}
+
+void simplefs_init_proc(void)
+{
+    simplefs_proc_root = proc_mkdir("fs/simplefs", NULL);
+    if (!simplefs_proc_root)
+        pr_warn("cannot create /proc/fs/simplefs\n");
+}
+
+void simplefs_exit_proc(void)
+{
+    remove_proc_entry("fs/simplefs", NULL);
+}
@@ -0,0 +1,69 @@
+#!/usr/bin/env bash
+
+# Measure block allocation latency against the fill level of the image.
+# At each level, half of the filler files are removed to fragment the free
+# space, then a batch of 32 KiB files is created and timed.
+
+SIMPLEFS_MOD=simplefs.ko
+IMAGE=$1
+IMAGESIZE=$2
+MKFS=$3
+LEVELS=${LEVELS:-"0 25 50 75 90"}
+NR_PROBES=${NR_PROBES:-200}
+FILES_PER_DIR=10000
+
+if [ "$EUID" -eq 0 ]
+  then echo "Don't run this script as root"
+  exit
+fi
+
+# Number of used blocks, read from the superblock (nr_blocks, nr_free_blocks)
+used_blocks() {
+    local nr_blocks=$(($(dd if=$IMAGE bs=1 skip=4 count=4 2>/dev/null | hexdump -v -e '1/4 "0x%08x\n"')))
+    local nr_free=$(($(dd if=$IMAGE bs=1 skip=28 count=4 2>/dev/null | hexdump -v -e '1/4 "0x%08x\n"')))
+    echo $(( (nr_blocks - nr_free) * 100 / nr_blocks ))
+}
+
+fill_to() {
+    local level=$1
+    sync
+    while [ $(used_blocks) -lt $level ]; do
+        for ((j=0; j<256; j++)); do
+            local dir=fill/$((nr_fill / FILES_PER_DIR))
+            [ $((nr_fill % FILES_PER_DIR)) -eq 0 ] && sudo mkdir -p $dir
+            sudo dd if=/dev/zero of=$dir/$nr_fill bs=32K count=1 status=none || return
+            nr_fill=$((nr_fill + 1))
+        done
+        sync
+    done
+    # fragment the free space: drop every other filler file
+    sudo find fill -type f -name '*[02468]' -delete
+    sync
+}
+
+mkdir -p test
+sudo umount test 2>/dev/null
+sudo rmmod simplefs 2>/dev/null
+sudo insmod $SIMPLEFS_MOD || exit 1
+dd if=/dev/zero of=$IMAGE bs=1M count=$IMAGESIZE status=none
+./$MKFS $IMAGE >/dev/null || exit 1
+sudo mount -t simplefs -o loop $IMAGE test || exit 1
+pushd test >/dev/null
+
+nr_fill=0
+printf "%-10s %-10s %s\n" "fill(%)" "files" "avg alloc latency (us)"
+for level in $LEVELS; do
+    fill_to $level
+    sudo mkdir -p probe
+    start=$(date +%s%N)
+    for ((i=0; i<$NR_PROBES; i++)); do
+        sudo dd if=/dev/zero of=probe/$i bs=32K count=1 conv=fsync status=none || break
+    done
+    end=$(date +%s%N)
+    printf "%-10s %-10s %s\n" $(used_blocks) $i $(( (end - start) / 1000 / (i ? i : 1) ))
+    sudo rm -rf probe
+done
+
+popd >/dev/null
+sudo umount test
+sudo rmmod simplefs
@@ -0,0 +1,49 @@
+#!/usr/bin/env bash
+
+# Measure the file creation rate against the number of concurrent creators.
+# Each thread creates empty files in a directory of its own, the aggregate
+# rate is reported for every thread count.
+
+SIMPLEFS_MOD=simplefs.ko
+IMAGE=$1
+IMAGESIZE=$2
+MKFS=$3
+THREADS=${THREADS:-"1 2 4 8 $(nproc)"}
+NR_FILES=${NR_FILES:-2000}
+
+if [ "$EUID" -eq 0 ]
+  then echo "Don't run this script as root"
+  exit
+fi
+
+mkdir -p test
+sudo umount test 2>/dev/null
+sudo rmmod simplefs 2>/dev/null
+sudo insmod $SIMPLEFS_MOD || exit 1
+dd if=/dev/zero of=$IMAGE bs=1M count=$IMAGESIZE status=none
+./$MKFS $IMAGE >/dev/null || exit 1
+sudo mount -t simplefs -o loop $IMAGE test || exit 1
+pushd test >/dev/null
+
+printf "%-10s %-10s %s\n" "threads" "files" "creates/s"
+for nr in $(echo $THREADS | tr ' ' '\n' | sort -nu); do
+    for ((t=0; t<nr; t++)); do
+        sudo mkdir -p create/$t
+    done
+    sync
+    start=$(date +%s%N)
+    for ((t=0; t<nr; t++)); do
+        # the redirection creates the file without forking a process
+        sudo bash -c "for ((i=0; i<$NR_FILES; i++)); do : > create/$t/\$i; done" &
+    done
+    wait
+    end=$(date +%s%N)
+    total=$((nr * NR_FILES))
+    printf "%-10s %-10s %s\n" $nr $total $(( total * 1000000000 / (end - start) ))
+    sudo rm -rf create
+    sync
+done
+
+popd >/dev/null
+sudo umount test
+sudo rmmod simplefs
@@ -44,6 +44,9 @@ test_rm_all_files
 # test remount file exist or not
 test_remount_file_exist
 
+# test online discard and fstrim
+test_remount_discard
+
 popd >/dev/null || { echo "popd failed"; exit 1; }
 
 # Get ready to count free block
@@ -61,12 +64,31 @@ test_too_large_file
 # Write the a file larger than BLOCK_SIZE
 test_file_size_larger_than_block_size
 
+# Write a file with more extents than its index block holds
+test_extent_tree
+
+# preallocate, punch a hole and zero a range
+test_fallocate
+
+# move the data of fragmented files into fewer extents
+test_defrag
+
+# report the extents of a sparse file
+test_sparse_file
+
+# read and write bypassing the page cache
+test_direct_io
+
+# free space fragmentation report
+grep -q "largest free run" /proc/fs/simplefs/*/freefrag || echo "Failed, no freefrag report"
+
 # mkdir
 test_op 'mkdir dir'
 test_op 'mkdir dir' # expected to fail
 
 # create file
 test_op 'touch file'
+test $(sudo stat -c %b file) -eq 0 || echo "Failed, empty file uses blocks"
 
 # hard link
 test_op 'ln file hdlink'
@@ -86,6 +108,8 @@ test_op 'ln -s dir len_of_name_of_the_link_is_29'
 # write to file
 test_op 'echo abc > file'
 test $(cat file) = "abc" || echo "Failed to write"
+sync
+test $(sudo stat -c %b file) -gt 0 || echo "Failed, written file uses no block"
 
 # test remove symbolic link
 test_op 'ln -s file symlink_fake'
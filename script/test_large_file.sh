@@ -1,7 +1,8 @@
 # file too large
 test_too_large_file() {
-    TESTLG_FILE_SZ=$(( $MAXFILESIZE / 1024 / 1024 + 1 ))
-    test_op "dd if=/dev/zero of=exceed_max_sz_file bs=1M count=$TESTLG_FILE_SZ status=none"
+    # Write sparsely across the limit, the image is much smaller than it
+    TESTLG_FILE_SZ=$(( $MAXFILESIZE / 1024 / 1024 ))
+    test_op "dd if=/dev/zero of=exceed_max_sz_file bs=1M seek=$TESTLG_FILE_SZ count=1 status=none"
     echo
     filesize=$(sudo ls -lR  | grep -e "$F_MOD 1".*file | awk '{print $5}')
     test $filesize -le $MAXFILESIZE || echo "Failed, file size over the limit"
@@ -26,3 +27,89 @@ test_file_size_larger_than_block_size() {
     test_op 'rm exceed_blk.txt checkfile.txt'
     echo
 }
+
+# Preallocate a file, then punch a hole and zero a range in it. The result is
+# compared, after dropping the page cache, with the same operations on tmpfs.
+test_fallocate() {
+    local ref=$(mktemp -p /dev/shm)
+    test_op 'fallocate -l 1M falloc_file'
+    filesize=$(sudo stat -c %s falloc_file)
+    test "$filesize" -eq 1048576 || echo "Failed, preallocated size not matching"
+    sudo cmp -s -n 1048576 falloc_file /dev/zero || echo "Failed, preallocated range not zeroed"
+    test_op 'yes 123456789 | head -c 1048576 | dd of=falloc_file conv=notrunc status=none'
+    test_op 'fallocate -p -o 6000 -l 10000 falloc_file'
+    test_op 'fallocate -z -o 100 -l 200 falloc_file'
+    test_op 'fallocate -n -o 1M -l 1M falloc_file'
+    yes 123456789 | head -c 1048576 > $ref
+    fallocate -p -o 6000 -l 10000 $ref
+    fallocate -z -o 100 -l 200 $ref
+    sync
+    echo 3 | sudo tee /proc/sys/vm/drop_caches >/dev/null
+    sudo cmp -s falloc_file $ref || echo "Failed, fallocate content not matching"
+    rm -f $ref
+    test_op 'rm falloc_file'
+    echo
+}
+
+test_defrag() {
+    local ref=$(mktemp -p /dev/shm)
+    head -c 1048576 /dev/urandom > $ref
+    # interleave the appends of two files to scatter their extents
+    for ((i=0; i<64; i++)); do
+        for f in frag_a frag_b; do
+            sudo dd if=$ref of=$f bs=16K skip=$i seek=$i count=1 conv=notrunc status=none
+        done
+        sync
+    done
+    test_op '../simplefs-defrag -v .'
+    echo 3 | sudo tee /proc/sys/vm/drop_caches >/dev/null
+    sudo cmp -s frag_a $ref || echo "Failed, frag_a content not matching after defrag"
+    sudo cmp -s frag_b $ref || echo "Failed, frag_b content not matching after defrag"
+    rm -f $ref
+    test_op 'rm frag_a frag_b'
+    echo
+}
+
+test_sparse_file() {
+    test_op 'dd if=/dev/urandom of=sparse_file bs=4K seek=256 count=1 status=none'
+    sync
+    filesize=$(sudo stat -c %s sparse_file)
+    test "$filesize" -eq 1052672 || echo "Failed, sparse file size not matching"
+    sudo filefrag sparse_file | grep -q ": 1 extent found" || echo "Failed, sparse file extents not matching"
+    test_op 'rm sparse_file'
+    echo
+}
+
+test_direct_io() {
+    local ref=$(mktemp -p /dev/shm)
+    head -c 1048576 /dev/urandom > $ref
+    test_op "dd if=$ref of=direct_file bs=64K oflag=direct status=none"
+    # overwrite part of the file through the page cache, then directly again
+    test_op "dd if=$ref of=direct_file bs=4K skip=3 seek=3 count=5 conv=notrunc status=none"
+    test_op "dd if=$ref of=direct_file bs=4K skip=5 seek=5 count=1 oflag=direct conv=notrunc status=none"
+    filesize=$(sudo stat -c %s direct_file)
+    test "$filesize" -eq 1048576 || echo "Failed, direct file size not matching"
+    sudo dd if=direct_file bs=64K iflag=direct status=none | cmp -s - $ref || echo "Failed, direct read not matching"
+    echo 3 | sudo tee /proc/sys/vm/drop_caches >/dev/null
+    sudo cmp -s direct_file $ref || echo "Failed, direct file content not matching"
+    rm -f $ref
+    test_op 'rm direct_file'
+    echo
+}
+
+# Write every other block of a file, which takes more extents than its index
+# block holds, so that the extents spill into a tree
+test_extent_tree() {
+    local ref=$(mktemp -p /dev/shm)
+    for ((i=0; i<600; i+=2)); do
+        dd if=/dev/urandom of=$ref bs=4K seek=$i count=1 conv=notrunc status=none
+        sudo dd if=$ref of=tree_file bs=4K skip=$i seek=$i count=1 conv=notrunc status=none
+    done
+    sync
+    echo 3 | sudo tee /proc/sys/vm/drop_caches >/dev/null
+    sudo cmp -s tree_file $ref || echo "Failed, extent tree content not matching"
+    sudo filefrag tree_file | grep -q ": 300 extents found" || echo "Failed, extent tree extents not matching"
+    rm -f $ref
+    test_op 'rm tree_file'
+    echo
+}
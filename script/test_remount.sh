@@ -35,3 +35,25 @@ test_remount_file_exist() {
     find . -name 'file_[0-9]*.txt' | xargs sudo rm || { echo "Failed to delete files"; exit 1; }
     sync
 }
+
+# remount with online discard, free some blocks and trim the free space
+test_remount_discard() {
+    popd >/dev/null || { echo "popd failed"; exit 1; }
+    sudo umount test || { echo "umount failed"; exit 1; }
+    sleep 1
+    sudo mount -t simplefs -o loop,discard $IMAGE test || { echo "mount -o discard failed"; exit 1; }
+    pushd test >/dev/null || { echo "pushd failed"; exit 1; }
+
+    test_op 'dd if=/dev/urandom of=discard_keep bs=4K count=64 status=none'
+    test_op 'dd if=/dev/urandom of=discard_file bs=4K count=256 status=none'
+    sync
+    sudo cp discard_keep /dev/shm/discard_keep
+    test_op 'rm discard_file'
+    sync
+    test_op 'fstrim -v .'
+    echo 3 | sudo tee /proc/sys/vm/drop_caches >/dev/null
+    sudo cmp -s discard_keep /dev/shm/discard_keep || echo "Failed, data lost by discard"
+    sudo rm -f /dev/shm/discard_keep
+    test_op 'rm discard_keep'
+    sync
+}
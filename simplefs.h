@@ -6,22 +6,38 @@
 
 #define SIMPLEFS_SB_BLOCK_NR 0
 
+/* On-disk layout version, set by mkfs.simplefs and checked at mount. Images
+ * formatted before it was recorded read as version 0: their inode store is
+ * preallocated and their inodes have no i_size_high.
+ */
+#define SIMPLEFS_LAYOUT_VERSION 1
+
 #define SIMPLEFS_BLOCK_SIZE (1 << 12) /* 4 KiB */
 #define SIMPLEFS_MAX_EXTENTS \
     ((SIMPLEFS_BLOCK_SIZE - sizeof(uint32_t)) / sizeof(struct simplefs_extent))
-#define SIMPLEFS_MAX_BLOCKS_PER_EXTENT 8 /* It can be ~(uint32) 0 */
+#define SIMPLEFS_MAX_EXT_IDX \
+    ((SIMPLEFS_BLOCK_SIZE - sizeof(uint32_t)) / sizeof(struct simplefs_ext_idx))
+/* Levels of interior nodes above the extents of a file */
+#define SIMPLEFS_EXT_MAX_DEPTH 4
+#define SIMPLEFS_DIR_BLOCKS_PER_EXTENT 8 /* Blocks in a directory extent */
+/* File extents have a variable length. One never spans more than an allocation
+ * group, i.e. the blocks tracked by one bitmap block.
+ */
+#define SIMPLEFS_MAX_BLOCKS_PER_EXTENT (SIMPLEFS_BLOCK_SIZE * 8)
 #define SIMPLEFS_MAX_SIZES_PER_EXTENT \
-    (SIMPLEFS_MAX_BLOCKS_PER_EXTENT * SIMPLEFS_BLOCK_SIZE)
-#define SIMPLEFS_MAX_FILESIZE                                          \
-    ((uint64_t) SIMPLEFS_MAX_BLOCKS_PER_EXTENT * SIMPLEFS_BLOCK_SIZE * \
-     SIMPLEFS_MAX_EXTENTS)
+    ((uint64_t) SIMPLEFS_MAX_BLOCKS_PER_EXTENT * SIMPLEFS_BLOCK_SIZE)
+/* Logical block numbers and i_blocks, which counts the index block too, are
+ * stored on 32 bits. The last logical block is not used.
+ */
+#define SIMPLEFS_MAX_FILESIZE \
+    ((((uint64_t) 1 << 32) - 2) * (uint64_t) SIMPLEFS_BLOCK_SIZE)
 
 #define SIMPLEFS_FILENAME_LEN 255
 
 #define SIMPLEFS_FILES_PER_BLOCK \
     (SIMPLEFS_BLOCK_SIZE / sizeof(struct simplefs_file))
 #define SIMPLEFS_FILES_PER_EXT \
-    (SIMPLEFS_FILES_PER_BLOCK * SIMPLEFS_MAX_BLOCKS_PER_EXTENT)
+    (SIMPLEFS_FILES_PER_BLOCK * SIMPLEFS_DIR_BLOCKS_PER_EXTENT)
 
 #define SIMPLEFS_MAX_SUBFILES (SIMPLEFS_FILES_PER_EXT * SIMPLEFS_MAX_EXTENTS)
 
@@ -29,7 +45,8 @@
  * +---------------+
  * |  superblock   |  1 block
  * +---------------+
- * |  inode store  |  sb->nr_istore_blocks blocks
+ * | inode chunk   |  sb->nr_imap_blocks blocks
+ * |      map      |
  * +---------------+
  * | ifree bitmap  |  sb->nr_ifree_blocks blocks
  * +---------------+
@@ -44,24 +61,51 @@
 #endif
 
 struct simplefs_inode {
-    uint32_t i_mode;   /* File mode */
-    uint32_t i_uid;    /* Owner id */
-    uint32_t i_gid;    /* Group id */
-    uint32_t i_size;   /* Size in bytes */
-    uint32_t i_ctime;  /* Inode change time */
-    uint32_t i_atime;  /* Access time */
-    uint32_t i_mtime;  /* Modification time */
-    uint32_t i_blocks; /* Block count */
-    uint32_t i_nlink;  /* Hard links count */
-    uint32_t ei_block; /* Block with list of extents for this file */
-    char i_data[32];   /* store symlink content */
+    uint32_t i_mode;      /* File mode */
+    uint32_t i_uid;       /* Owner id */
+    uint32_t i_gid;       /* Group id */
+    uint32_t i_size;      /* Size in bytes, low 32 bits */
+    uint32_t i_ctime;     /* Inode change time */
+    uint32_t i_atime;     /* Access time */
+    uint32_t i_mtime;     /* Modification time */
+    uint32_t i_blocks;    /* Block count */
+    uint32_t i_nlink;     /* Hard links count */
+    uint32_t ei_block;    /* Block with list of extents for this file */
+    uint32_t i_size_high; /* Size in bytes, high 32 bits */
+    char i_data[32];      /* store symlink content */
 };
 
 #define SIMPLEFS_INODES_PER_BLOCK \
     (SIMPLEFS_BLOCK_SIZE / sizeof(struct simplefs_inode))
 
+/* The inode store is not preallocated: inodes live in chunks of blocks taken
+ * from the data blocks when one of their inodes is first allocated. The inode
+ * chunk map gives the first block of each chunk, 0 if it is not allocated.
+ */
+#define SIMPLEFS_INODE_CHUNK_BLOCKS 8
+#define SIMPLEFS_INODES_PER_CHUNK \
+    (SIMPLEFS_INODES_PER_BLOCK * SIMPLEFS_INODE_CHUNK_BLOCKS)
+#define SIMPLEFS_CHUNKS_PER_BLOCK (SIMPLEFS_BLOCK_SIZE / sizeof(uint32_t))
+
+/* SIMPLEFS_IOC_DEFRAG: move the data of a regular file into as few extents as
+ * possible. Requires CAP_SYS_ADMIN.
+ */
+struct simplefs_defrag_info {
+    uint32_t nr_extents_before; /* Extents of the file before the call */
+    uint32_t nr_extents_after;  /* Extents of the file after the call */
+    uint32_t nr_blocks_moved;   /* Blocks relocated */
+};
+
+#define SIMPLEFS_IOC_DEFRAG _IOR(0xDE, 1, struct simplefs_defrag_info)
+
 #ifdef __KERNEL__
+#include <linux/percpu_counter.h>
+#include <linux/mutex.h>
+#include <linux/rwsem.h>
+#include <linux/spinlock.h>
 #include <linux/version.h>
+#include <linux/workqueue.h>
+#include <linux/xarray.h>
 /* compatibility macros */
 #define SIMPLEFS_AT_LEAST(major, minor, rev) \
     LINUX_VERSION_CODE >= KERNEL_VERSION(major, minor, rev)
@@ -74,21 +118,137 @@ struct simplefs_inode {
 struct simplefs_inode_info {
     uint32_t ei_block; /* Block with list of extents for this file */
     char i_data[32];
+    struct rw_semaphore ext_lock; /* Serializes changes to the extents */
+    uint32_t pa_start;            /* First block of preallocation window */
+    uint32_t pa_len;              /* Blocks left in preallocation window */
+    struct list_head pa_list;     /* Entry in the sb list of windows */
+    struct simplefs_ext_cache *ext_cache; /* Decoded index, RCU protected */
+    struct list_head ec_list; /* Entry in the sb list of extent caches */
+    struct xarray delayed;    /* Blocks reserved by delayed allocation */
     struct inode vfs_inode;
 };
 
+/* An allocation group covers the bits held by one on-disk bitmap block. Each
+ * group owns its slice of the in-memory bitmap, a lock and a free counter, so
+ * allocators running on different CPUs can work on different groups without
+ * contending with each other. The slice is loaded on first use and may be
+ * freed again under memory pressure while it is clean.
+ */
+#define SIMPLEFS_BITS_PER_GROUP (SIMPLEFS_BLOCK_SIZE * 8)
+
+/* Blocks claimed ahead by a file appending after its last extent */
+#define SIMPLEFS_PREALLOC_BLOCKS 128
+
+/* Blocks kept out of reach of data reservations, so that the index and
+ * extent tree nodes needed to write delayed blocks back can be allocated
+ */
+#define SIMPLEFS_META_RESERVE_BLOCKS 256
+
+/* Bitmap blocks read ahead when a group is loaded */
+#define SIMPLEFS_BITMAP_READAHEAD 8
+
+struct simplefs_group {
+    spinlock_t lock;     /* Protects the bitmap slice and the fields below */
+    unsigned long *map;  /* Bitmap slice, NULL while not loaded */
+    uint32_t block;      /* On-disk bitmap block of this group */
+    uint32_t start;      /* First bit covered by this group */
+    uint32_t nr_bits;    /* Number of bits covered by this group */
+    uint32_t nr_free;    /* Free bits, an upper bound until first loaded */
+    uint32_t first_free; /* No free bit below this one, relative to start */
+    uint32_t max_run;    /* No free run longer than this one */
+    uint32_t rotor;      /* Start of searches without a goal, relative */
+    bool dirty;          /* Bitmap slice changed since the last sync */
+};
+
+/* Write lifetimes from WRITE_LIFE_SHORT to WRITE_LIFE_EXTREME, each of them
+ * placed in its own region of the device
+ */
+#define SIMPLEFS_NR_HINTS 4
+
+/* Inode numbers reserved ahead by one CPU for file creation. The run comes
+ * from a single allocation group; it is used in the in-memory bitmap but
+ * still counted, and recorded on disk, as free. It serves the goal it was
+ * taken for, and other goals it lies close to, within a few inode store
+ * blocks.
+ */
+#define SIMPLEFS_INODE_BATCH 32
+#define SIMPLEFS_INODE_BATCH_REACH (4 * SIMPLEFS_INODES_PER_BLOCK)
+
+struct simplefs_ino_batch {
+    spinlock_t lock; /* Protects the fields below */
+    uint32_t goal;   /* Goal the batch was taken for */
+    uint32_t next;   /* First reserved inode */
+    uint32_t nr;     /* Reserved inodes left from next */
+};
+
+/* File extent flags */
+#define SIMPLEFS_EXT_UNWRITTEN 0x1 /* Allocated but never written, reads as 0 */
+
 struct simplefs_extent {
     uint32_t ee_block; /* first logical block extent covers */
     uint32_t ee_len;   /* number of blocks covered by extent */
     uint32_t ee_start; /* first physical block extent covers */
-    uint32_t nr_files; /* Number of files in this extent */
+    union {
+        uint32_t nr_files; /* Number of files in this extent (directory) */
+        uint32_t ee_flags; /* SIMPLEFS_EXT_* flags (file) */
+    };
 };
 
 struct simplefs_file_ei_block {
-    uint32_t nr_files; /* Number of files in directory */
+    union {
+        uint32_t nr_files; /* Number of files in directory */
+        uint32_t depth;    /* Always 0 for the extents of a file */
+    };
     struct simplefs_extent extents[SIMPLEFS_MAX_EXTENTS];
 };
 
+/* The extents of a regular file form a B+tree. Its root is the block at
+ * ei_block, which holds the extents themselves as long as they fit in it,
+ * like the index of a directory. Then the root becomes an interior node,
+ * pointing to the blocks below it by the first logical block they cover.
+ * Leaves hold the extents and interior nodes the entries below. The header
+ * of every node gives its depth, the number of levels below it, so the root
+ * of a file written before the tree existed reads as a single leaf.
+ */
+struct simplefs_ext_idx {
+    uint32_t ei_block; /* First logical block covered by the child */
+    uint32_t ei_child; /* Block of the child node */
+};
+
+struct simplefs_ext_node {
+    uint32_t depth; /* Levels below this node, at least 1 */
+    struct simplefs_ext_idx idx[SIMPLEFS_MAX_EXT_IDX];
+};
+
+/* Upper bound of the blocks covered by the last node of each level */
+#define SIMPLEFS_EXT_END ((uint32_t) -1)
+
+/* Path from the root of the extent tree of a file down to the leaf covering
+ * a block. The blocks of the nodes on the path are held until released.
+ */
+struct simplefs_ext_path {
+    uint32_t depth; /* Depth of the tree, 0 when the root is a leaf */
+    uint32_t end;   /* The leaf covers the blocks below this one */
+    bool nowait;    /* Only walk nodes found in the buffer cache */
+    uint32_t pos[SIMPLEFS_EXT_MAX_DEPTH]; /* Child followed at each level */
+    struct buffer_head *bh[SIMPLEFS_EXT_MAX_DEPTH + 1]; /* Root first */
+};
+
+/* Extents of the leaf at the end of a path */
+#define SIMPLEFS_EXT_LEAF(path) \
+    ((struct simplefs_file_ei_block *) (path)->bh[(path)->depth]->b_data)
+
+/* Decoded copy of the extent index of a file. Block mapping for reads looks
+ * it up under RCU, without the extent lock nor the buffer cache. It is built
+ * by the first lookup and dropped whenever the index changes, or by the
+ * superblock shrinker.
+ */
+struct simplefs_ext_cache {
+    struct rcu_head rcu;
+    uint32_t nr; /* Number of extents */
+    struct simplefs_extent extents[];
+};
+
 struct simplefs_file {
     uint32_t inode;
     uint32_t nr_blk;
@@ -103,6 +263,7 @@ struct simplefs_dir_block {
 struct simplefs_fs_context {
     u32 journal_dev;
     char *journal_path;
+    bool discard;
 };
 #endif
 /* superblock functions */
@@ -112,6 +273,9 @@ int simplefs_fill_super(struct super_block *sb, struct fs_context *fc);
 int simplefs_fill_super(struct super_block *sb, void *data, int silent);
 #endif
 void simplefs_kill_sb(struct super_block *sb);
+/* Buffers written together by simplefs_write_batch() */
+#define SIMPLEFS_SYNC_BATCH 32
+int simplefs_write_batch(struct buffer_head **bhs, int nr);
 #if SIMPLEFS_AT_LEAST(6, 18, 0)
 #include <linux/fs_context.h>
 #include <linux/fs_parser.h>
@@ -121,6 +285,10 @@ int simplefs_parse_param(struct fs_context *fc, struct fs_parameter *param);
 int simplefs_init_inode_cache(void);
 void simplefs_destroy_inode_cache(void);
 struct inode *simplefs_iget(struct super_block *sb, unsigned long ino);
+void simplefs_delete_inode(struct inode *inode);
+uint32_t simplefs_inode_block(struct super_block *sb,
+                              uint32_t ino,
+                              bool create);
 
 /* dentry function */
 struct dentry *simplefs_mount(struct file_system_type *fs_type,
@@ -132,13 +300,72 @@ struct dentry *simplefs_mount(struct file_system_type *fs_type,
 uint32_t simplefs_hash(struct dentry *dentry);
 
 /* file functions */
+struct simplefs_sb_info;
+extern const struct inode_operations simplefs_file_inode_ops;
 extern const struct file_operations simplefs_file_ops;
 extern const struct file_operations simplefs_dir_ops;
 extern const struct address_space_operations simplefs_aops;
+int simplefs_defrag_file(struct file *file, struct simplefs_defrag_info *info);
+void simplefs_drop_delayed(struct inode *inode, uint32_t first, uint32_t last);
+int simplefs_init_ioend(struct simplefs_sb_info *sbi);
 
 /* extent functions */
+extern uint32_t simplefs_ext_count(struct simplefs_file_ei_block *index);
 extern uint32_t simplefs_ext_search(struct simplefs_file_ei_block *index,
                                     uint32_t iblock);
+extern void simplefs_ext_insert(struct simplefs_file_ei_block *index,
+                                uint32_t pos,
+                                const struct simplefs_extent *ext);
+extern void simplefs_ext_remove(struct simplefs_file_ei_block *index,
+                                uint32_t pos);
+int simplefs_ext_find(struct super_block *sb,
+                      struct buffer_head *root,
+                      uint32_t iblock,
+                      struct simplefs_ext_path *path);
+int simplefs_ext_find_nowait(struct super_block *sb,
+                             struct buffer_head *root,
+                             uint32_t iblock,
+                             struct simplefs_ext_path *path);
+int simplefs_ext_refind(struct super_block *sb,
+                        struct simplefs_ext_path *path,
+                        uint32_t iblock);
+void simplefs_ext_release(struct simplefs_ext_path *path);
+int simplefs_ext_make_room(struct inode *inode,
+                           struct simplefs_ext_path *path,
+                           uint32_t iblock,
+                           uint32_t n);
+int simplefs_ext_truncate(struct inode *inode,
+                          struct buffer_head *root,
+                          uint32_t first);
+int simplefs_ext_cache_lookup(struct simplefs_inode_info *ci,
+                              uint32_t iblock,
+                              struct simplefs_extent *ext);
+void simplefs_ext_cache_fill(struct simplefs_sb_info *sbi,
+                             struct simplefs_inode_info *ci,
+                             struct simplefs_file_ei_block *index);
+void simplefs_ext_cache_drop(struct simplefs_sb_info *sbi,
+                             struct simplefs_inode_info *ci);
+unsigned long simplefs_ext_cache_shrink(struct simplefs_sb_info *sbi,
+                                        unsigned long nr);
+
+/* discard functions */
+struct fstrim_range;
+bool simplefs_can_discard(struct super_block *sb);
+void simplefs_init_discard(struct simplefs_sb_info *sbi);
+bool simplefs_queue_discard(struct simplefs_sb_info *sbi,
+                            uint32_t bno,
+                            uint32_t len);
+uint32_t simplefs_flush_discard(struct simplefs_sb_info *sbi);
+int simplefs_trim_fs(struct super_block *sb, struct fstrim_range *range);
+
+/* ioctl functions */
+long simplefs_ioctl(struct file *file, unsigned int cmd, unsigned long arg);
+
+/* proc functions */
+void simplefs_init_proc(void);
+void simplefs_exit_proc(void);
+void simplefs_register_proc(struct super_block *sb);
+void simplefs_unregister_proc(struct super_block *sb);
 
 /* Getters for superblock and inode */
 #define SIMPLEFS_SB(sb) (sb->s_fs_info)
@@ -154,16 +381,57 @@ struct simplefs_sb_info {
     uint32_t nr_blocks; /* Total number of blocks (incl sb & inodes) */
     uint32_t nr_inodes; /* Total number of inodes */
 
-    uint32_t nr_istore_blocks; /* Number of inode store blocks */
+    uint32_t nr_imap_blocks;   /* Number of inode chunk map blocks */
     uint32_t nr_ifree_blocks;  /* Number of inode free bitmap blocks */
     uint32_t nr_bfree_blocks;  /* Number of block free bitmap blocks */
 
     uint32_t nr_free_inodes; /* Number of free inodes */
     uint32_t nr_free_blocks; /* Number of free blocks */
 
-    unsigned long *ifree_bitmap; /* In-memory free inodes bitmap */
-    unsigned long *bfree_bitmap; /* In-memory free blocks bitmap */
+    uint32_t version; /* On-disk layout version */
+
 #ifdef __KERNEL__
+    struct super_block *sb;         /* VFS superblock */
+    struct simplefs_group *igroups; /* Inode allocation groups */
+    struct simplefs_group *bgroups; /* Block allocation groups */
+    uint32_t nr_igroups;            /* Number of inode allocation groups */
+    uint32_t nr_bgroups;            /* Number of block allocation groups */
+    atomic_t nr_maps;               /* Bitmap blocks loaded in memory */
+    struct mutex imap_lock;         /* Serializes inode chunk allocation */
+    struct simplefs_ino_batch __percpu *ino_batch; /* Per-CPU inode runs */
+
+    /* Free space counters, per-CPU */
+    struct percpu_counter free_inodes;     /* Free inodes */
+    struct percpu_counter free_blocks;     /* Free blocks */
+    struct percpu_counter dirty_blocks;    /* Reserved by delayed allocation */
+    struct percpu_counter prealloc_blocks; /* Held in preallocation windows */
+    spinlock_t reserve_lock; /* Serializes reservations near ENOSPC */
+
+    spinlock_t pa_lock;         /* Protects the preallocation windows */
+    struct list_head pa_inodes; /* Inodes holding a preallocation window */
+
+    spinlock_t ec_lock;          /* Protects the fields below */
+    struct list_head ec_inodes;  /* Inodes with an extent cache, oldest first */
+    unsigned long nr_ext_caches; /* Number of extent caches */
+
+    uint32_t hint_goal[SIMPLEFS_NR_HINTS]; /* Next block for each lifetime */
+
+    bool discard;                     /* Discard freed blocks (-o discard) */
+    atomic_t discard_blocks;          /* Freed blocks waiting for discard */
+    spinlock_t discard_lock;          /* Protects the list and run below */
+    struct list_head discard_list;    /* Freed ranges waiting for discard */
+    struct delayed_work discard_work; /* Issues the queued discards */
+    struct mutex trim_lock;           /* Serializes FITRIM */
+    uint32_t trim_start; /* Run claimed by FITRIM, still free on disk */
+    uint32_t trim_len;
+
+    spinlock_t ioend_lock;             /* Protects ioend_list */
+    struct list_head ioend_list;       /* Written ioends to complete */
+    struct work_struct ioend_work;     /* Completes them */
+    struct workqueue_struct *ioend_wq; /* Runs ioend_work */
+
+    struct proc_dir_entry *proc_dir; /* /proc/fs/simplefs/<dev> */
+
     journal_t *journal;
     struct block_device *s_journal_bdev; /* v5.10+ external journal device */
 #if SIMPLEFS_AT_LEAST(6, 9, 0)
@@ -12,6 +12,7 @@
 #include <linux/namei.h>
 #include <linux/parser.h>
 
+#include "bitmap.h"
 #include "simplefs.h"
 #if SIMPLEFS_AT_LEAST(6, 18, 0)
 #include <linux/fs_context.h>
@@ -23,6 +24,7 @@ struct dentry *simplefs_mount(struct file_system_type *fs_type,
                               void *data);
 void simplefs_kill_sb(struct super_block *sb);
 static struct kmem_cache *simplefs_inode_cache;
+static int simplefs_sync_fs(struct super_block *sb, int wait);
 
 /* Needed to initiate the inode cache, to allow us to attach
  * filesystem-specific inode information.
@@ -54,9 +56,33 @@ static struct inode *simplefs_alloc_inode(struct super_block *sb)
         return NULL;
 
     inode_init_once(&ci->vfs_inode);
+    init_rwsem(&ci->ext_lock);
+    ci->pa_len = 0;
+    INIT_LIST_HEAD(&ci->pa_list);
+    ci->ext_cache = NULL;
+    INIT_LIST_HEAD(&ci->ec_list);
+    xa_init(&ci->delayed);
     return &ci->vfs_inode;
 }
 
+/* Called when the inode leaves memory. Its cached pages are dropped, along
+ * with the reservation of their delayed blocks, and so are the extent tree
+ * blocks attached to it for fsync(), its preallocation window and its extent
+ * cache.
+ * An inode without links is deleted from the disk then.
+ */
+static void simplefs_evict_inode(struct inode *inode)
+{
+    truncate_inode_pages_final(&inode->i_data);
+    simplefs_drop_delayed(inode, 0, U32_MAX);
+    if (!inode->i_nlink && !is_bad_inode(inode))
+        simplefs_delete_inode(inode);
+    invalidate_inode_buffers(inode);
+    clear_inode(inode);
+    put_prealloc(SIMPLEFS_SB(inode->i_sb), SIMPLEFS_INODE(inode));
+    simplefs_ext_cache_drop(SIMPLEFS_SB(inode->i_sb), SIMPLEFS_INODE(inode));
+}
+
 static void simplefs_destroy_inode(struct inode *inode)
 {
     struct simplefs_inode_info *ci = SIMPLEFS_INODE(inode);
@@ -72,12 +98,15 @@ static int simplefs_write_inode(struct inode *inode,
     struct simplefs_sb_info *sbi = SIMPLEFS_SB(sb);
     struct buffer_head *bh;
     uint32_t ino = inode->i_ino;
-    uint32_t inode_block = (ino / SIMPLEFS_INODES_PER_BLOCK) + 1;
+    uint32_t inode_block;
     uint32_t inode_shift = ino % SIMPLEFS_INODES_PER_BLOCK;
 
     if (ino >= sbi->nr_inodes)
         return 0;
 
+    inode_block = simplefs_inode_block(sb, ino, false);
+    if (!inode_block)
+        return -EIO;
     bh = sb_bread(sb, inode_block);
     if (!bh)
         return -EIO;
@@ -90,6 +119,7 @@ static int simplefs_write_inode(struct inode *inode,
     disk_inode->i_uid = i_uid_read(inode);
     disk_inode->i_gid = i_gid_read(inode);
     disk_inode->i_size = inode->i_size;
+    disk_inode->i_size_high = inode->i_size >> 32;
 
 #if SIMPLEFS_AT_LEAST(6, 6, 0)
     struct timespec64 ctime = inode_get_ctime(inode);
@@ -117,12 +147,60 @@ static int simplefs_write_inode(struct inode *inode,
     return 0;
 }
 
+/* The free space counters start from the values recorded on disk, and the
+ * per-CPU inode batches empty.
+ */
+static int simplefs_init_counters(struct simplefs_sb_info *sbi)
+{
+    int ret, cpu;
+
+    sbi->ino_batch = alloc_percpu(struct simplefs_ino_batch);
+    if (!sbi->ino_batch)
+        return -ENOMEM;
+    for_each_possible_cpu(cpu) {
+        struct simplefs_ino_batch *b = per_cpu_ptr(sbi->ino_batch, cpu);
+
+        spin_lock_init(&b->lock);
+        b->nr = 0;
+    }
+
+    ret = percpu_counter_init(&sbi->free_inodes, sbi->nr_free_inodes,
+                              GFP_KERNEL);
+    if (!ret)
+        ret = percpu_counter_init(&sbi->free_blocks, sbi->nr_free_blocks,
+                                  GFP_KERNEL);
+    if (!ret)
+        ret = percpu_counter_init(&sbi->dirty_blocks, 0, GFP_KERNEL);
+    if (!ret)
+        ret = percpu_counter_init(&sbi->prealloc_blocks, 0, GFP_KERNEL);
+    return ret;
+}
+
+/* Also safe on counters that were never initialized */
+static void simplefs_destroy_counters(struct simplefs_sb_info *sbi)
+{
+    percpu_counter_destroy(&sbi->free_inodes);
+    percpu_counter_destroy(&sbi->free_blocks);
+    percpu_counter_destroy(&sbi->dirty_blocks);
+    percpu_counter_destroy(&sbi->prealloc_blocks);
+    free_percpu(sbi->ino_batch);
+}
+
 static void simplefs_put_super(struct super_block *sb)
 {
     struct simplefs_sb_info *sbi = SIMPLEFS_SB(sb);
     int aborted = 0;
     int err;
 
+    simplefs_unregister_proc(sb);
+
+    /* Normally empty, sync_fs() already waited for the discards */
+    if (simplefs_flush_discard(sbi) && !sb_rdonly(sb))
+        simplefs_sync_fs(sb, 1);
+
+    /* Batched inodes are already recorded as free on disk */
+    put_all_ino_batches(sbi);
+
     if (sbi->journal) {
         aborted = is_journal_aborted(sbi->journal);
         err = jbd2_journal_destroy(sbi->journal);
@@ -166,20 +244,110 @@ static void simplefs_put_super(struct super_block *sb)
 #endif
 
     if (sbi) {
-        kfree(sbi->ifree_bitmap);
-        kfree(sbi->bfree_bitmap);
+        /* Writeback is over, only the tail of the last completion may run */
+        destroy_workqueue(sbi->ioend_wq);
+        destroy_groups(sbi->igroups, sbi->nr_igroups);
+        destroy_groups(sbi->bgroups, sbi->nr_bgroups);
+        simplefs_destroy_counters(sbi);
         kfree(sbi);
     }
 }
 
+/* Write the 'nr' buffers of 'bhs' as one batch, wait for them and release
+ * them.
+ */
+int simplefs_write_batch(struct buffer_head **bhs, int nr)
+{
+    struct blk_plug plug;
+    int i, ret = 0;
+
+    blk_start_plug(&plug);
+    for (i = 0; i < nr; i++)
+        write_dirty_buffer(bhs[i], REQ_SYNC);
+    blk_finish_plug(&plug);
+
+    for (i = 0; i < nr; i++) {
+        wait_on_buffer(bhs[i]);
+        if (!buffer_uptodate(bhs[i]))
+            ret = -EIO;
+        brelse(bhs[i]);
+    }
+    return ret;
+}
+
+/* Copy the bitmap slices of the groups that changed since the last sync to
+ * their on-disk blocks. Clean groups, loaded or not, are skipped. With 'wait',
+ * the blocks are submitted in batches and waited for.
+ */
+static int simplefs_sync_bitmap(struct super_block *sb,
+                                struct simplefs_group *groups,
+                                uint32_t nr_groups,
+                                int wait)
+{
+    struct simplefs_sb_info *sbi = SIMPLEFS_SB(sb);
+    struct buffer_head *bhs[SIMPLEFS_SYNC_BATCH];
+    struct buffer_head *bh;
+    int nr = 0, ret = 0, err;
+    uint32_t i;
+
+    for (i = 0; i < nr_groups; i++) {
+        struct simplefs_group *g = &groups[i];
+
+        if (!READ_ONCE(g->dirty))
+            continue;
+
+        /* The whole block is overwritten, there is no need to read it */
+        bh = sb_getblk(sb, g->block);
+        if (!bh)
+            return -EIO;
+
+        /* Dirty groups are never dropped, their slice is loaded */
+        lock_buffer(bh);
+        spin_lock(&g->lock);
+        g->dirty = false;
+        memcpy(bh->b_data, g->map, SIMPLEFS_BLOCK_SIZE);
+        if (groups == sbi->bgroups) {
+            put_prealloc_bits(sbi, (unsigned long *) bh->b_data, i);
+            put_trim_bits(sbi, (unsigned long *) bh->b_data, i);
+        } else {
+            put_batch_bits(sbi, (unsigned long *) bh->b_data, i);
+        }
+        spin_unlock(&g->lock);
+        set_buffer_uptodate(bh);
+        unlock_buffer(bh);
+        mark_buffer_dirty(bh);
+
+        if (!wait) {
+            brelse(bh);
+            continue;
+        }
+        bhs[nr++] = bh;
+        if (nr == SIMPLEFS_SYNC_BATCH) {
+            err = simplefs_write_batch(bhs, nr);
+            ret = ret ? ret : err;
+            nr = 0;
+        }
+    }
+    if (nr) {
+        err = simplefs_write_batch(bhs, nr);
+        ret = ret ? ret : err;
+    }
+    return ret;
+}
+
 static int simplefs_sync_fs(struct super_block *sb, int wait)
 {
     struct simplefs_sb_info *sbi = SIMPLEFS_SB(sb);
     struct simplefs_sb_info *disk_sb;
-    int i;
+    int ret;
+
+    struct buffer_head *bh;
+
+    /* Blocks waiting for discard are still used in the bitmap */
+    simplefs_flush_discard(sbi);
 
     /* Flush superblock */
-    struct buffer_head *bh = sb_bread(sb, 0);
+    bh = sb_bread(sb, 0);
     if (!bh)
         return -EIO;
 
@@ -187,11 +355,13 @@ static int simplefs_sync_fs(struct super_block *sb, int wait)
 
     disk_sb->nr_blocks = sbi->nr_blocks;
     disk_sb->nr_inodes = sbi->nr_inodes;
-    disk_sb->nr_istore_blocks = sbi->nr_istore_blocks;
+    disk_sb->nr_imap_blocks = sbi->nr_imap_blocks;
     disk_sb->nr_ifree_blocks = sbi->nr_ifree_blocks;
     disk_sb->nr_bfree_blocks = sbi->nr_bfree_blocks;
-    disk_sb->nr_free_inodes = sbi->nr_free_inodes;
-    disk_sb->nr_free_blocks = sbi->nr_free_blocks;
+    disk_sb->nr_free_inodes = sbi->nr_free_inodes =
+        percpu_counter_sum_positive(&sbi->free_inodes);
+    /* Preallocation windows are not persistent, they are free on disk */
+    disk_sb->nr_free_blocks = sbi->nr_free_blocks = avail_blocks_sum(sbi);
 
     mark_buffer_dirty(bh);
     if (wait)
@@ -199,40 +369,12 @@ static int simplefs_sync_fs(struct super_block *sb, int wait)
     brelse(bh);
 
     /* Flush free inodes bitmask */
-    for (i = 0; i < sbi->nr_ifree_blocks; i++) {
-        int idx = sbi->nr_istore_blocks + i + 1;
-
-        bh = sb_bread(sb, idx);
-        if (!bh)
-            return -EIO;
-
-        memcpy(bh->b_data, (void *) sbi->ifree_bitmap + i * SIMPLEFS_BLOCK_SIZE,
-               SIMPLEFS_BLOCK_SIZE);
-
-        mark_buffer_dirty(bh);
-        if (wait)
-            sync_dirty_buffer(bh);
-        brelse(bh);
-    }
+    ret = simplefs_sync_bitmap(sb, sbi->igroups, sbi->nr_igroups, wait);
+    if (ret)
+        return ret;
 
     /* Flush free blocks bitmask */
-    for (i = 0; i < sbi->nr_bfree_blocks; i++) {
-        int idx = sbi->nr_istore_blocks + sbi->nr_ifree_blocks + i + 1;
-
-        bh = sb_bread(sb, idx);
-        if (!bh)
-            return -EIO;
-
-        memcpy(bh->b_data, (void *) sbi->bfree_bitmap + i * SIMPLEFS_BLOCK_SIZE,
-               SIMPLEFS_BLOCK_SIZE);
-
-        mark_buffer_dirty(bh);
-        if (wait)
-            sync_dirty_buffer(bh);
-        brelse(bh);
-    }
-
-    return 0;
+    return simplefs_sync_bitmap(sb, sbi->bgroups, sbi->nr_bgroups, wait);
 }
 
 static int simplefs_statfs(struct dentry *dentry, struct kstatfs *stat)
@@ -243,10 +385,18 @@ static int simplefs_statfs(struct dentry *dentry, struct kstatfs *stat)
     stat->f_type = SIMPLEFS_MAGIC;
     stat->f_bsize = SIMPLEFS_BLOCK_SIZE;
     stat->f_blocks = sbi->nr_blocks;
-    stat->f_bfree = sbi->nr_free_blocks;
-    stat->f_bavail = sbi->nr_free_blocks;
+    /* Blocks reserved by delayed allocation are not available anymore. The
+     * per-CPU counters are read without summing them, so statfs can be
+     * polled often without disturbing writers.
+     */
+    stat->f_bfree =
+        max_t(s64, avail_blocks(sbi) -
+                       percpu_counter_read_positive(&sbi->dirty_blocks),
+              0);
+    /* The metadata reserve is free but cannot hold data */
+    stat->f_bavail = max_t(s64, stat->f_bfree - meta_reserve(sbi), 0);
     stat->f_files = sbi->nr_inodes;
-    stat->f_ffree = sbi->nr_free_inodes;
+    stat->f_ffree = percpu_counter_read_positive(&sbi->free_inodes);
     stat->f_namelen = SIMPLEFS_FILENAME_LEN;
 
     return 0;
@@ -446,14 +596,27 @@ err_out:
 /* we use SIMPLEFS_OPT_JOURNAL_PATH case to load external journal device now */
 #define SIMPLEFS_OPT_JOURNAL_DEV 1
 #define SIMPLEFS_OPT_JOURNAL_PATH 2
+#define SIMPLEFS_OPT_DISCARD 3
 static const match_table_t tokens = {
     {SIMPLEFS_OPT_JOURNAL_DEV, "journal_dev=%u"},
     {SIMPLEFS_OPT_JOURNAL_PATH, "journal_path=%s"},
+    {SIMPLEFS_OPT_DISCARD, "discard"},
 };
+
+/* Turn on online discard, if the device supports it */
+static void simplefs_set_discard(struct super_block *sb)
+{
+    if (!simplefs_can_discard(sb)) {
+        pr_warn("discard not supported by the device, option ignored\n");
+        return;
+    }
+    SIMPLEFS_SB(sb)->discard = true;
+}
 #if SIMPLEFS_AT_LEAST(6, 18, 0)
 const struct fs_parameter_spec simplefs_param_specs[] = {
     fsparam_u32("journal_dev", SIMPLEFS_OPT_JOURNAL_DEV),
     fsparam_string("journal_path", SIMPLEFS_OPT_JOURNAL_PATH),
+    fsparam_flag("discard", SIMPLEFS_OPT_DISCARD),
     {}};
 int simplefs_parse_param(struct fs_context *fc, struct fs_parameter *param)
 {
@@ -470,16 +633,20 @@ int simplefs_parse_param(struct fs_context *fc, struct fs_parameter *param)
         ctx->journal_dev = result.uint_32;
         break;
 
-    case SIMPLEFS_OPT_JOURNAL_PATH: {
+    case SIMPLEFS_OPT_JOURNAL_PATH:
         kfree(ctx->journal_path);
         ctx->journal_path = kstrdup(param->string, GFP_KERNEL);
         if (!ctx->journal_path)
             return -ENOMEM;
         break;
+
+    case SIMPLEFS_OPT_DISCARD:
+        ctx->discard = true;
+        break;
+
     default:
         return -EINVAL;
     }
-    }
     return 0;
 }
 #else
@@ -547,19 +714,55 @@ static int simplefs_parse_options(struct super_block *sb, char *options)
             path_put(&path);
             break;
         }
+        case SIMPLEFS_OPT_DISCARD:
+            simplefs_set_discard(sb);
+            break;
         }
     }
 
     return 0;
 }
 #endif
+
+/* Bitmap slices and extent caches are cached objects of the superblock: the
+ * bitmap slices of clean groups and the extent caches of files are freed by
+ * the superblock shrinker and built again on demand.
+ */
+static long simplefs_nr_cached_objects(struct super_block *sb,
+                                       struct shrink_control *sc)
+{
+    struct simplefs_sb_info *sbi = SIMPLEFS_SB(sb);
+
+    return atomic_read(&sbi->nr_maps) + READ_ONCE(sbi->nr_ext_caches);
+}
+
+static long simplefs_free_cached_objects(struct super_block *sb,
+                                         struct shrink_control *sc)
+{
+    struct simplefs_sb_info *sbi = SIMPLEFS_SB(sb);
+    unsigned long freed;
+
+    /* Inodes held by the per-CPU batches go back to the bitmap first */
+    put_all_ino_batches(sbi);
+    freed = drop_clean_groups(sbi, sbi->igroups, sbi->nr_igroups,
+                              sc->nr_to_scan);
+    freed += drop_clean_groups(sbi, sbi->bgroups, sbi->nr_bgroups,
+                               sc->nr_to_scan - freed);
+    if (freed < sc->nr_to_scan)
+        freed += simplefs_ext_cache_shrink(sbi, sc->nr_to_scan - freed);
+    return freed;
+}
+
 static struct super_operations simplefs_super_ops = {
     .put_super = simplefs_put_super,
     .alloc_inode = simplefs_alloc_inode,
     .destroy_inode = simplefs_destroy_inode,
     .write_inode = simplefs_write_inode,
+    .evict_inode = simplefs_evict_inode,
     .sync_fs = simplefs_sync_fs,
     .statfs = simplefs_statfs,
+    .nr_cached_objects = simplefs_nr_cached_objects,
+    .free_cached_objects = simplefs_free_cached_objects,
 };
 
 /* Fill the struct superblock from partition superblock */
@@ -576,7 +779,7 @@ int simplefs_fill_super(struct super_block *sb, void *data, int silent)
     struct simplefs_sb_info *sbi = NULL;
     struct inode *root_inode = NULL;
 
-    int ret = 0, i;
+    int ret = 0;
 
     /* Initialize the superblock */
     sb->s_magic = SIMPLEFS_MAGIC;
@@ -598,6 +801,15 @@ int simplefs_fill_super(struct super_block *sb, void *data, int silent)
         goto release;
     }
 
+    /* Check on-disk layout version */
+    if (csb->version != SIMPLEFS_LAYOUT_VERSION) {
+        pr_err("Unsupported layout version %u, the image must be formatted "
+               "again\n",
+               csb->version);
+        ret = -EINVAL;
+        goto release;
+    }
+
     /* Allocate sb_info */
     sbi = kzalloc(sizeof(struct simplefs_sb_info), GFP_KERNEL);
     if (!sbi) {
@@ -607,68 +819,61 @@ int simplefs_fill_super(struct super_block *sb, void *data, int silent)
 
     sbi->nr_blocks = csb->nr_blocks;
     sbi->nr_inodes = csb->nr_inodes;
-    sbi->nr_istore_blocks = csb->nr_istore_blocks;
+    sbi->nr_imap_blocks = csb->nr_imap_blocks;
     sbi->nr_ifree_blocks = csb->nr_ifree_blocks;
     sbi->nr_bfree_blocks = csb->nr_bfree_blocks;
     sbi->nr_free_inodes = csb->nr_free_inodes;
     sbi->nr_free_blocks = csb->nr_free_blocks;
     sb->s_fs_info = sbi;
+    ret = simplefs_init_counters(sbi);
+    if (ret)
+        goto free_sbi;
+    spin_lock_init(&sbi->reserve_lock);
+    mutex_init(&sbi->imap_lock);
+    atomic_set(&sbi->nr_maps, 0);
+    sbi->sb = sb;
+    spin_lock_init(&sbi->pa_lock);
+    INIT_LIST_HEAD(&sbi->pa_inodes);
+    spin_lock_init(&sbi->ec_lock);
+    INIT_LIST_HEAD(&sbi->ec_inodes);
+    init_hint_goals(sbi);
+    simplefs_init_discard(sbi);
+    ret = simplefs_init_ioend(sbi);
+    if (ret)
+        goto free_sbi;
 
     brelse(bh);
+    bh = NULL;
 
-    /* Allocate and copy ifree_bitmap */
-    sbi->ifree_bitmap =
-        kzalloc(sbi->nr_ifree_blocks * SIMPLEFS_BLOCK_SIZE, GFP_KERNEL);
-    if (!sbi->ifree_bitmap) {
+    /* Split both bitmaps into allocation groups, one per bitmap block. The
+     * bitmap blocks themselves are only read when a group is first used.
+     */
+    sbi->nr_igroups = sbi->nr_ifree_blocks;
+    sbi->igroups = kvcalloc(sbi->nr_igroups, sizeof(struct simplefs_group),
+                            GFP_KERNEL);
+    if (!sbi->igroups) {
         ret = -ENOMEM;
         goto free_sbi;
     }
+    init_groups(sbi->igroups, sbi->nr_igroups, sbi->nr_imap_blocks + 1,
+                sbi->nr_inodes);
 
-    for (i = 0; i < sbi->nr_ifree_blocks; i++) {
-        int idx = sbi->nr_istore_blocks + i + 1;
-
-        bh = sb_bread(sb, idx);
-        if (!bh) {
-            ret = -EIO;
-            goto free_ifree;
-        }
-
-        memcpy((void *) sbi->ifree_bitmap + i * SIMPLEFS_BLOCK_SIZE, bh->b_data,
-               SIMPLEFS_BLOCK_SIZE);
-
-        brelse(bh);
-    }
-    bh = NULL;
-
-    /* Allocate and copy bfree_bitmap */
-    sbi->bfree_bitmap =
-        kzalloc(sbi->nr_bfree_blocks * SIMPLEFS_BLOCK_SIZE, GFP_KERNEL);
-    if (!sbi->bfree_bitmap) {
+    sbi->nr_bgroups = sbi->nr_bfree_blocks;
+    sbi->bgroups = kvcalloc(sbi->nr_bgroups, sizeof(struct simplefs_group),
+                            GFP_KERNEL);
+    if (!sbi->bgroups) {
         ret = -ENOMEM;
-        goto free_ifree;
-    }
-
-    for (i = 0; i < sbi->nr_bfree_blocks; i++) {
-        int idx = sbi->nr_istore_blocks + sbi->nr_ifree_blocks + i + 1;
-
-        bh = sb_bread(sb, idx);
-        if (!bh) {
-            ret = -EIO;
-            goto free_bfree;
-        }
-
-        memcpy((void *) sbi->bfree_bitmap + i * SIMPLEFS_BLOCK_SIZE, bh->b_data,
-               SIMPLEFS_BLOCK_SIZE);
-
-        brelse(bh);
+        goto free_groups;
     }
+    init_groups(sbi->bgroups, sbi->nr_bgroups,
+                sbi->nr_imap_blocks + sbi->nr_ifree_blocks + 1,
+                sbi->nr_blocks);
 
-    bh = NULL;
     /* Create root inode */
     root_inode = simplefs_iget(sb, 1);
     if (IS_ERR(root_inode)) {
         ret = PTR_ERR(root_inode);
-        goto free_bfree;
+        goto free_groups;
     }
 
 #if SIMPLEFS_AT_LEAST(6, 3, 0)
@@ -696,6 +901,8 @@ inode_init_owner(root_inode, NULL, root_inode->i_mode);
             return ret;
         }
     }
+    if (ctx->discard)
+        simplefs_set_discard(sb);
     if (ctx->journal_path) {
         struct path path;
         struct inode *inode;
@@ -726,15 +933,19 @@ inode_init_owner(root_inode, NULL, root_inode->i_mode);
         return ret;
     }
 #endif
+
+    simplefs_register_proc(sb);
     return 0;
 
 iput:
     iput(root_inode);
-free_bfree:
-    kfree(sbi->bfree_bitmap);
-free_ifree:
-    kfree(sbi->ifree_bitmap);
+free_groups:
+    destroy_groups(sbi->bgroups, sbi->nr_bgroups);
+    destroy_groups(sbi->igroups, sbi->nr_igroups);
 free_sbi:
+    if (sbi->ioend_wq)
+        destroy_workqueue(sbi->ioend_wq);
+    simplefs_destroy_counters(sbi);
     kfree(sbi);
 release:
     brelse(bh);